@@ -611,12 +611,9 @@ static int _interp_sctp(struct ulogd_pluginstance *pi, struct sctphdr *sctph,
 	if (len < sizeof(struct sctphdr))
 		return ULOGD_IRET_OK;
 
-	ret[KEY_SCTP_SPORT].u.value.ui16 = ntohs(sctph->source);
-	ret[KEY_SCTP_SPORT].flags |= ULOGD_RETF_VALID;
-	ret[KEY_SCTP_DPORT].u.value.ui16 = ntohs(sctph->dest);
-	ret[KEY_SCTP_DPORT].flags |= ULOGD_RETF_VALID;
-	ret[KEY_SCTP_CSUM].u.value.ui32 = ntohl(sctph->checksum);
-	ret[KEY_SCTP_CSUM].flags |= ULOGD_RETF_VALID;
+	okey_set_u16(&ret[KEY_SCTP_SPORT], ntohs(sctph->source));
+	okey_set_u16(&ret[KEY_SCTP_DPORT], ntohs(sctph->dest));
+	okey_set_u32(&ret[KEY_SCTP_CSUM], ntohl(sctph->checksum));
 	
 	return ULOGD_IRET_OK;
 }
@@ -701,8 +698,7 @@ static int _interp_ahesp(struct ulogd_pluginstance *pi, void *protoh,
 	if (len < sizeof(struct esphdr))
 		return 0;
 
-	ret[KEY_AHESP_SPI].u.value.ui32 = ntohl(esph->spi);
-	ret[KEY_AHESP_SPI].flags |= ULOGD_RETF_VALID;
+	okey_set_u32(&ret[KEY_AHESP_SPI], ntohl(esph->spi));
 #endif
 
 	return ULOGD_IRET_OK;
@@ -961,6 +957,7 @@ static int _interp_pkt(struct ulogd_pluginstance *pi)
 static struct ulogd_key base_inp[] = {
 	{ 
 		.type = ULOGD_RET_RAW,
+		.flags = ULOGD_KEYF_HEADERS,
 		.name = "raw.pkt", 
 		.ipfix = { 
 			.vendor = IPFIX_VENDOR_NETFILTER, 
@@ -0,0 +1,758 @@
+/* ulogd_filter_AGGR.c
+ *
+ * ulogd filter plugin aggregating flow records: the counters of the
+ * records sharing a group key, made of some of their fields and of
+ * prefixes of their addresses, are summed up, and one record per group
+ * is passed on at the end of each time window.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <ulogd/ulogd.h>
+#include <ulogd/timer.h>
+#include <ulogd/hash.h>
+#include <ulogd/jhash.h>
+#include <ulogd/slab.h>
+#include <ulogd/ipfix_protocol.h>
+
+enum aggr_conf {
+	AGGR_CONF_INTERVAL,
+	AGGR_CONF_KEY,
+	AGGR_CONF_SRC_PREFIX,
+	AGGR_CONF_DST_PREFIX,
+	AGGR_CONF_SRC_PREFIX6,
+	AGGR_CONF_DST_PREFIX6,
+	AGGR_CONF_MAX_GROUPS,
+	AGGR_CONF_OPENADDR,
+};
+
+static struct config_keyset aggr_kset = {
+	.num_ces = 8,
+	.ces = {
+		[AGGR_CONF_INTERVAL] = {
+			.key	 = "interval",
+			.type	 = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 60,
+		},
+		[AGGR_CONF_KEY] = {
+			.key	 = "key",
+			.type	 = CONFIG_TYPE_STRING,
+			.options = CONFIG_OPT_NONE,
+			.u.string = "saddr,daddr,dport,proto",
+		},
+		[AGGR_CONF_SRC_PREFIX] = {
+			.key	 = "src_prefix",
+			.type	 = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 32,
+		},
+		[AGGR_CONF_DST_PREFIX] = {
+			.key	 = "dst_prefix",
+			.type	 = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 32,
+		},
+		[AGGR_CONF_SRC_PREFIX6] = {
+			.key	 = "src_prefix6",
+			.type	 = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 128,
+		},
+		[AGGR_CONF_DST_PREFIX6] = {
+			.key	 = "dst_prefix6",
+			.type	 = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 128,
+		},
+		[AGGR_CONF_MAX_GROUPS] = {
+			.key	 = "max_groups",
+			.type	 = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 65536,
+		},
+		[AGGR_CONF_OPENADDR] = {
+			.key	 = "hash_open_addressing",
+			.type	 = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 0,
+		},
+	},
+};
+
+#define interval_ce(x)		((x)->ces[AGGR_CONF_INTERVAL])
+#define key_ce(x)		((x)->ces[AGGR_CONF_KEY])
+#define src_prefix_ce(x)	((x)->ces[AGGR_CONF_SRC_PREFIX])
+#define dst_prefix_ce(x)	((x)->ces[AGGR_CONF_DST_PREFIX])
+#define src_prefix6_ce(x)	((x)->ces[AGGR_CONF_SRC_PREFIX6])
+#define dst_prefix6_ce(x)	((x)->ces[AGGR_CONF_DST_PREFIX6])
+#define max_groups_ce(x)	((x)->ces[AGGR_CONF_MAX_GROUPS])
+#define openaddr_ce(x)		((x)->ces[AGGR_CONF_OPENADDR])
+
+enum input_keys {
+	KEY_OOB_FAMILY,
+	KEY_ORIG_IP_SADDR,
+	KEY_ORIG_IP_DADDR,
+	KEY_ORIG_IP_PROTOCOL,
+	KEY_ORIG_L4_SPORT,
+	KEY_ORIG_L4_DPORT,
+	KEY_CT_MARK,
+	KEY_CT_EVENT,
+	KEY_ORIG_RAW_PKTLEN,
+	KEY_ORIG_RAW_PKTCOUNT,
+	KEY_REPLY_RAW_PKTLEN,
+	KEY_REPLY_RAW_PKTCOUNT,
+};
+
+static struct ulogd_key aggr_inp[] = {
+	[KEY_OOB_FAMILY] = {
+		.type	= ULOGD_RET_UINT8,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "oob.family",
+	},
+	[KEY_ORIG_IP_SADDR] = {
+		.type	= ULOGD_RET_IPADDR,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "orig.ip.saddr",
+	},
+	[KEY_ORIG_IP_DADDR] = {
+		.type	= ULOGD_RET_IPADDR,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "orig.ip.daddr",
+	},
+	[KEY_ORIG_IP_PROTOCOL] = {
+		.type	= ULOGD_RET_UINT8,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "orig.ip.protocol",
+	},
+	[KEY_ORIG_L4_SPORT] = {
+		.type	= ULOGD_RET_UINT16,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "orig.l4.sport",
+	},
+	[KEY_ORIG_L4_DPORT] = {
+		.type	= ULOGD_RET_UINT16,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "orig.l4.dport",
+	},
+	[KEY_CT_MARK] = {
+		.type	= ULOGD_RET_UINT32,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "ct.mark",
+	},
+	[KEY_CT_EVENT] = {
+		.type	= ULOGD_RET_UINT32,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "ct.event",
+	},
+	[KEY_ORIG_RAW_PKTLEN] = {
+		.type	= ULOGD_RET_UINT64,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "orig.raw.pktlen",
+	},
+	[KEY_ORIG_RAW_PKTCOUNT] = {
+		.type	= ULOGD_RET_UINT64,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "orig.raw.pktcount",
+	},
+	[KEY_REPLY_RAW_PKTLEN] = {
+		.type	= ULOGD_RET_UINT64,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "reply.raw.pktlen",
+	},
+	[KEY_REPLY_RAW_PKTCOUNT] = {
+		.type	= ULOGD_RET_UINT64,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "reply.raw.pktcount",
+	},
+};
+
+/* named like the keys of NFCT, so that the plugins following this one
+ * in the stack take them from here */
+enum output_keys {
+	OKEY_OOB_FAMILY,
+	OKEY_OOB_PROTOCOL,
+	OKEY_ORIG_IP_SADDR,
+	OKEY_ORIG_IP_DADDR,
+	OKEY_ORIG_IP_PROTOCOL,
+	OKEY_ORIG_L4_SPORT,
+	OKEY_ORIG_L4_DPORT,
+	OKEY_CT_MARK,
+	OKEY_ORIG_RAW_PKTLEN,
+	OKEY_ORIG_RAW_PKTCOUNT,
+	OKEY_REPLY_RAW_PKTLEN,
+	OKEY_REPLY_RAW_PKTCOUNT,
+	OKEY_FLOW_START_SEC,
+	OKEY_FLOW_START_USEC,
+	OKEY_FLOW_END_SEC,
+	OKEY_FLOW_END_USEC,
+	OKEY_AGGR_FLOWS,
+};
+
+static struct ulogd_key aggr_okeys[] = {
+	[OKEY_OOB_FAMILY] = {
+		.type	= ULOGD_RET_UINT8,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "oob.family",
+	},
+	[OKEY_OOB_PROTOCOL] = {
+		.type	= ULOGD_RET_UINT8,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "oob.protocol",
+	},
+	[OKEY_ORIG_IP_SADDR] = {
+		.type	= ULOGD_RET_IPADDR,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "orig.ip.saddr",
+		.ipfix	= {
+			.vendor = IPFIX_VENDOR_IETF,
+			.field_id = IPFIX_sourceIPv4Address,
+		},
+	},
+	[OKEY_ORIG_IP_DADDR] = {
+		.type	= ULOGD_RET_IPADDR,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "orig.ip.daddr",
+		.ipfix	= {
+			.vendor = IPFIX_VENDOR_IETF,
+			.field_id = IPFIX_destinationIPv4Address,
+		},
+	},
+	[OKEY_ORIG_IP_PROTOCOL] = {
+		.type	= ULOGD_RET_UINT8,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "orig.ip.protocol",
+		.ipfix	= {
+			.vendor = IPFIX_VENDOR_IETF,
+			.field_id = IPFIX_protocolIdentifier,
+		},
+	},
+	[OKEY_ORIG_L4_SPORT] = {
+		.type	= ULOGD_RET_UINT16,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "orig.l4.sport",
+		.ipfix	= {
+			.vendor 	= IPFIX_VENDOR_IETF,
+			.field_id 	= IPFIX_sourceTransportPort,
+		},
+	},
+	[OKEY_ORIG_L4_DPORT] = {
+		.type	= ULOGD_RET_UINT16,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "orig.l4.dport",
+		.ipfix	= {
+			.vendor 	= IPFIX_VENDOR_IETF,
+			.field_id 	= IPFIX_destinationTransportPort,
+		},
+	},
+	[OKEY_CT_MARK] = {
+		.type	= ULOGD_RET_UINT32,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "ct.mark",
+		.ipfix	= {
+			.vendor		= IPFIX_VENDOR_NETFILTER,
+			.field_id	= IPFIX_NF_mark,
+		},
+	},
+	[OKEY_ORIG_RAW_PKTLEN] = {
+		.type	= ULOGD_RET_UINT64,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "orig.raw.pktlen",
+		.ipfix	= {
+			.vendor 	= IPFIX_VENDOR_IETF,
+			.field_id 	= IPFIX_octetDeltaCount,
+		},
+	},
+	[OKEY_ORIG_RAW_PKTCOUNT] = {
+		.type	= ULOGD_RET_UINT64,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "orig.raw.pktcount",
+		.ipfix	= {
+			.vendor 	= IPFIX_VENDOR_IETF,
+			.field_id 	= IPFIX_packetDeltaCount,
+		},
+	},
+	[OKEY_REPLY_RAW_PKTLEN] = {
+		.type	= ULOGD_RET_UINT64,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "reply.raw.pktlen",
+		.ipfix	= {
+			.vendor 	= IPFIX_VENDOR_IETF,
+			.field_id 	= IPFIX_octetDeltaCount,
+		},
+	},
+	[OKEY_REPLY_RAW_PKTCOUNT] = {
+		.type	= ULOGD_RET_UINT64,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "reply.raw.pktcount",
+		.ipfix	= {
+			.vendor 	= IPFIX_VENDOR_IETF,
+			.field_id 	= IPFIX_packetDeltaCount,
+		},
+	},
+	[OKEY_FLOW_START_SEC] = {
+		.type 	= ULOGD_RET_UINT32,
+		.flags 	= ULOGD_RETF_NONE,
+		.name 	= "flow.start.sec",
+		.ipfix	= {
+			.vendor		= IPFIX_VENDOR_IETF,
+			.field_id	= IPFIX_flowStartSeconds,
+		},
+	},
+	[OKEY_FLOW_START_USEC] = {
+		.type 	= ULOGD_RET_UINT32,
+		.flags 	= ULOGD_RETF_NONE,
+		.name 	= "flow.start.usec",
+		.ipfix	= {
+			.vendor		= IPFIX_VENDOR_IETF,
+			.field_id	= IPFIX_flowStartMicroSeconds,
+		},
+	},
+	[OKEY_FLOW_END_SEC] = {
+		.type	= ULOGD_RET_UINT32,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "flow.end.sec",
+		.ipfix	= {
+			.vendor		= IPFIX_VENDOR_IETF,
+			.field_id	= IPFIX_flowEndSeconds,
+		},
+	},
+	[OKEY_FLOW_END_USEC] = {
+		.type	= ULOGD_RET_UINT32,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "flow.end.usec",
+		.ipfix	= {
+			.vendor		= IPFIX_VENDOR_IETF,
+			.field_id	= IPFIX_flowEndMicroSeconds,
+		},
+	},
+	[OKEY_AGGR_FLOWS] = {
+		.type	= ULOGD_RET_UINT32,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "aggr.flows",
+	},
+};
+
+/* fields the group key may be made of */
+#define AGGR_F_SADDR	0x01
+#define AGGR_F_DADDR	0x02
+#define AGGR_F_SPORT	0x04
+#define AGGR_F_DPORT	0x08
+#define AGGR_F_PROTO	0x10
+#define AGGR_F_MARK	0x20
+
+static const struct {
+	const char *name;
+	uint32_t flag;
+} aggr_fields[] = {
+	{ "saddr",	AGGR_F_SADDR },
+	{ "daddr",	AGGR_F_DADDR },
+	{ "sport",	AGGR_F_SPORT },
+	{ "dport",	AGGR_F_DPORT },
+	{ "proto",	AGGR_F_PROTO },
+	{ "mark",	AGGR_F_MARK },
+};
+
+/* what is not part of the key stays zero. IPv4 addresses use the first
+ * word of the IPv6 ones. */
+struct aggr_tuple {
+	uint32_t saddr[4];
+	uint32_t daddr[4];
+	uint32_t mark;
+	uint16_t sport;
+	uint16_t dport;
+	uint8_t family;
+	uint8_t proto;
+	uint16_t pad;
+};
+
+struct aggr_key {
+	uint32_t hash;			/* of tuple */
+	struct aggr_tuple tuple;
+};
+
+struct aggr_group {
+	struct hashtable_node hashnode;
+	struct aggr_key key;
+	uint64_t orig_bytes;
+	uint64_t orig_packets;
+	uint64_t repl_bytes;
+	uint64_t repl_packets;
+	uint32_t flows;
+};
+
+#define AGGR_BUCKETS	1024
+
+/* NFCT_T_DESTROY of libnetfilter_conntrack, as found in ct.event */
+#define AGGR_CT_DESTROY	(1 << 2)
+
+struct aggr_instance {
+	uint32_t fields;
+	/* prefix masks, in network byte order */
+	uint32_t smask[4];
+	uint32_t dmask[4];
+	uint32_t smask6[4];
+	uint32_t dmask6[4];
+	struct hashtable *groups;
+	struct slab *slab;		/* entries of groups */
+	struct ulogd_timer timer;
+	struct timeval window_start;
+	uint64_t dropped;		/* records not counted, window */
+};
+
+static uint32_t aggr_hash(const void *data, const struct hashtable *table)
+{
+	const struct aggr_key *k = data;
+
+	return k->hash;
+}
+
+static int aggr_compare(const void *data1, const void *data2)
+{
+	const struct aggr_group *g = data1;
+	const struct aggr_key *k = data2;
+
+	return memcmp(&g->key.tuple, &k->tuple, sizeof(k->tuple)) == 0;
+}
+
+static void prefix_mask(uint32_t *mask, int bits, int words)
+{
+	int i;
+
+	for (i = 0; i < words; i++) {
+		if (bits >= 32)
+			mask[i] = 0xffffffff;
+		else if (bits <= 0)
+			mask[i] = 0;
+		else
+			mask[i] = htonl(0xffffffff << (32 - bits));
+		bits -= 32;
+	}
+}
+
+static void key_addr(uint32_t *addr, struct ulogd_key *inp, uint8_t family,
+		     const uint32_t *mask4, const uint32_t *mask6)
+{
+	const uint32_t *a;
+	int i;
+
+	switch (family) {
+	case AF_INET:
+		addr[0] = ikey_get_u32(inp) & mask4[0];
+		break;
+	case AF_INET6:
+		a = ikey_get_u128(inp);
+		for (i = 0; i < 4; i++)
+			addr[i] = a[i] & mask6[i];
+		break;
+	}
+}
+
+static void key_build(struct aggr_instance *ai, struct aggr_key *k,
+		      struct ulogd_key *inp)
+{
+	struct aggr_tuple *t = &k->tuple;
+
+	memset(k, 0, sizeof(*k));
+	if (pp_is_valid(inp, KEY_OOB_FAMILY))
+		t->family = ikey_get_u8(&inp[KEY_OOB_FAMILY]);
+
+	if (ai->fields & AGGR_F_SADDR && pp_is_valid(inp, KEY_ORIG_IP_SADDR))
+		key_addr(t->saddr, &inp[KEY_ORIG_IP_SADDR], t->family,
+			 ai->smask, ai->smask6);
+	if (ai->fields & AGGR_F_DADDR && pp_is_valid(inp, KEY_ORIG_IP_DADDR))
+		key_addr(t->daddr, &inp[KEY_ORIG_IP_DADDR], t->family,
+			 ai->dmask, ai->dmask6);
+	if (ai->fields & AGGR_F_SPORT && pp_is_valid(inp, KEY_ORIG_L4_SPORT))
+		t->sport = ikey_get_u16(&inp[KEY_ORIG_L4_SPORT]);
+	if (ai->fields & AGGR_F_DPORT && pp_is_valid(inp, KEY_ORIG_L4_DPORT))
+		t->dport = ikey_get_u16(&inp[KEY_ORIG_L4_DPORT]);
+	if (ai->fields & AGGR_F_PROTO && pp_is_valid(inp, KEY_ORIG_IP_PROTOCOL))
+		t->proto = ikey_get_u8(&inp[KEY_ORIG_IP_PROTOCOL]);
+	if (ai->fields & AGGR_F_MARK && pp_is_valid(inp, KEY_CT_MARK))
+		t->mark = ikey_get_u32(&inp[KEY_CT_MARK]);
+
+	k->hash = jhash2((uint32_t *)t, sizeof(*t) / sizeof(uint32_t), 0);
+}
+
+static inline uint64_t key_u64(struct ulogd_key *inp, int i)
+{
+	return pp_is_valid(inp, i) ? ikey_get_u64(&inp[i]) : 0;
+}
+
+static int interp_aggr(struct ulogd_pluginstance *pi)
+{
+	struct aggr_instance *ai = (struct aggr_instance *) &pi->private;
+	struct ulogd_key *inp = pi->input.keys;
+	struct aggr_group *g;
+	struct aggr_key k;
+
+	key_build(ai, &k, inp);
+	g = (struct aggr_group *)hashtable_find(ai->groups, &k, k.hash);
+	if (g == NULL) {
+		g = slab_alloc(ai->slab);
+		if (g == NULL) {
+			if (ai->dropped++ == 0)
+				ulogd_log(ULOGD_ERROR, "AGGR: more than %u "
+					  "groups, consider raising "
+					  "`max_groups'\n",
+					  hashtable_counter(ai->groups));
+			return ULOGD_IRET_STOP;
+		}
+		g->key = k;
+		if (hashtable_add(ai->groups, &g->hashnode, k.hash) < 0) {
+			slab_free(ai->slab, g);
+			return ULOGD_IRET_STOP;
+		}
+	}
+
+	g->orig_bytes += key_u64(inp, KEY_ORIG_RAW_PKTLEN);
+	g->orig_packets += key_u64(inp, KEY_ORIG_RAW_PKTCOUNT);
+	g->repl_bytes += key_u64(inp, KEY_REPLY_RAW_PKTLEN);
+	g->repl_packets += key_u64(inp, KEY_REPLY_RAW_PKTCOUNT);
+	/* interim records of a flow don't make it another flow */
+	if (!pp_is_valid(inp, KEY_CT_EVENT) ||
+	    ikey_get_u32(&inp[KEY_CT_EVENT]) == AGGR_CT_DESTROY)
+		g->flows++;
+
+	/* the record goes on as part of its group only */
+	return ULOGD_IRET_STOP;
+}
+
+static void set_addr(struct ulogd_key *key, uint8_t family,
+		     const uint32_t *addr)
+{
+	if (family == AF_INET6)
+		okey_set_u128(key, addr);
+	else
+		okey_set_u32(key, addr[0]);
+}
+
+struct aggr_flush {
+	struct ulogd_pluginstance *pi;
+	struct timeval end;
+};
+
+static int do_flush(void *data1, void *data2)
+{
+	struct aggr_flush *f = data1;
+	struct aggr_group *g = data2;
+	struct ulogd_pluginstance *pi = f->pi;
+	struct aggr_instance *ai = (struct aggr_instance *) &pi->private;
+	struct ulogd_key *ret = pi->output.keys;
+	const struct aggr_tuple *t = &g->key.tuple;
+
+	okey_set_u8(&ret[OKEY_OOB_FAMILY], t->family);
+	okey_set_u8(&ret[OKEY_OOB_PROTOCOL], 0);
+	if (ai->fields & AGGR_F_SADDR)
+		set_addr(&ret[OKEY_ORIG_IP_SADDR], t->family, t->saddr);
+	if (ai->fields & AGGR_F_DADDR)
+		set_addr(&ret[OKEY_ORIG_IP_DADDR], t->family, t->daddr);
+	if (ai->fields & AGGR_F_SPORT)
+		okey_set_u16(&ret[OKEY_ORIG_L4_SPORT], t->sport);
+	if (ai->fields & AGGR_F_DPORT)
+		okey_set_u16(&ret[OKEY_ORIG_L4_DPORT], t->dport);
+	if (ai->fields & AGGR_F_PROTO)
+		okey_set_u8(&ret[OKEY_ORIG_IP_PROTOCOL], t->proto);
+	if (ai->fields & AGGR_F_MARK)
+		okey_set_u32(&ret[OKEY_CT_MARK], t->mark);
+
+	okey_set_u64(&ret[OKEY_ORIG_RAW_PKTLEN], g->orig_bytes);
+	okey_set_u64(&ret[OKEY_ORIG_RAW_PKTCOUNT], g->orig_packets);
+	okey_set_u64(&ret[OKEY_REPLY_RAW_PKTLEN], g->repl_bytes);
+	okey_set_u64(&ret[OKEY_REPLY_RAW_PKTCOUNT], g->repl_packets);
+	okey_set_u32(&ret[OKEY_FLOW_START_SEC], ai->window_start.tv_sec);
+	okey_set_u32(&ret[OKEY_FLOW_START_USEC], ai->window_start.tv_usec);
+	okey_set_u32(&ret[OKEY_FLOW_END_SEC], f->end.tv_sec);
+	okey_set_u32(&ret[OKEY_FLOW_END_USEC], f->end.tv_usec);
+	okey_set_u32(&ret[OKEY_AGGR_FLOWS], g->flows);
+
+	ulogd_propagate_from(pi);
+
+	hashtable_del(ai->groups, &g->hashnode);
+	slab_free(ai->slab, g);
+	return 0;
+}
+
+/* pass on one record per group, and start a new window */
+static void aggr_flush(struct ulogd_pluginstance *pi)
+{
+	struct aggr_instance *ai = (struct aggr_instance *) &pi->private;
+	struct aggr_flush f = { .pi = pi };
+
+	gettimeofday(&f.end, NULL);
+	hashtable_iterate(ai->groups, &f, do_flush);
+	if (ai->dropped) {
+		ulogd_log(ULOGD_NOTICE, "AGGR: %llu records not counted "
+			  "in this window\n", (unsigned long long)ai->dropped);
+		ai->dropped = 0;
+	}
+	ai->window_start = f.end;
+}
+
+/* windows end on multiples of the interval */
+static void aggr_arm(struct ulogd_pluginstance *pi)
+{
+	struct aggr_instance *ai = (struct aggr_instance *) &pi->private;
+	int interval = interval_ce(pi->config_kset).u.value;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	ulogd_add_timer(&ai->timer, interval - now.tv_sec % interval);
+}
+
+static void aggr_timer_cb(struct ulogd_timer *t, void *data)
+{
+	struct ulogd_pluginstance *pi = data;
+
+	aggr_flush(pi);
+	aggr_arm(pi);
+}
+
+static int parse_key(struct ulogd_pluginstance *pi)
+{
+	struct aggr_instance *ai = (struct aggr_instance *) &pi->private;
+	char buf[CONFIG_VAL_STRING_LEN];
+	char *tok, *save = NULL;
+	unsigned int i;
+
+	ai->fields = 0;
+	snprintf(buf, sizeof(buf), "%s", key_ce(pi->config_kset).u.string);
+	for (tok = strtok_r(buf, ", \t", &save); tok;
+	     tok = strtok_r(NULL, ", \t", &save)) {
+		for (i = 0; i < ARRAY_SIZE(aggr_fields); i++) {
+			if (strcmp(tok, aggr_fields[i].name) == 0)
+				break;
+		}
+		if (i == ARRAY_SIZE(aggr_fields)) {
+			ulogd_log(ULOGD_FATAL, "AGGR: unknown key field "
+				  "`%s'\n", tok);
+			return -1;
+		}
+		ai->fields |= aggr_fields[i].flag;
+	}
+	return 0;
+}
+
+static int configure_aggr(struct ulogd_pluginstance *pi,
+			  struct ulogd_pluginstance_stack *stack)
+{
+	struct aggr_instance *ai = (struct aggr_instance *) &pi->private;
+	int ret;
+
+	ulogd_log(ULOGD_DEBUG, "parsing config file section `%s', "
+		  "plugin `%s'\n", pi->id, pi->plugin->name);
+
+	ret = config_parse_file(pi->id, pi->config_kset);
+	if (ret < 0)
+		return ret;
+
+	if (interval_ce(pi->config_kset).u.value <= 0) {
+		ulogd_log(ULOGD_FATAL, "AGGR: interval must be positive\n");
+		return -1;
+	}
+	if (parse_key(pi) < 0)
+		return -1;
+
+	prefix_mask(ai->smask, src_prefix_ce(pi->config_kset).u.value, 1);
+	prefix_mask(ai->dmask, dst_prefix_ce(pi->config_kset).u.value, 1);
+	prefix_mask(ai->smask6, src_prefix6_ce(pi->config_kset).u.value, 4);
+	prefix_mask(ai->dmask6, dst_prefix6_ce(pi->config_kset).u.value, 4);
+	return 0;
+}
+
+static int start_aggr(struct ulogd_pluginstance *pi)
+{
+	struct aggr_instance *ai = (struct aggr_instance *) &pi->private;
+
+	ai->groups = hashtable_create_flags(AGGR_BUCKETS, 0, aggr_hash,
+				aggr_compare,
+				openaddr_ce(pi->config_kset).u.value ?
+				HASHTABLE_F_OPEN : 0);
+	if (ai->groups == NULL) {
+		ulogd_log(ULOGD_FATAL, "AGGR: error allocating hash\n");
+		return -1;
+	}
+	ai->slab = slab_create_table(sizeof(struct aggr_group),
+				     max_groups_ce(pi->config_kset).u.value,
+				     AGGR_BUCKETS);
+	if (ai->slab == NULL) {
+		ulogd_log(ULOGD_FATAL, "AGGR: error allocating groups\n");
+		hashtable_destroy(ai->groups);
+		return -1;
+	}
+
+	gettimeofday(&ai->window_start, NULL);
+	ulogd_init_timer(&ai->timer, pi, aggr_timer_cb);
+	aggr_arm(pi);
+	return 0;
+}
+
+static int stop_aggr(struct ulogd_pluginstance *pi)
+{
+	struct aggr_instance *ai = (struct aggr_instance *) &pi->private;
+
+	ulogd_del_timer(&ai->timer);
+	hashtable_destroy(ai->groups);
+	slab_destroy(ai->slab);
+	return 0;
+}
+
+static void signal_aggr(struct ulogd_pluginstance *pi, int signal)
+{
+	switch (signal) {
+	case SIGTERM:
+	case SIGINT:
+		/* the window is cut short, but not lost */
+		aggr_flush(pi);
+		break;
+	}
+}
+
+static struct ulogd_plugin aggr_plugin = {
+	.name = "AGGR",
+	.input = {
+		.keys = aggr_inp,
+		.num_keys = ARRAY_SIZE(aggr_inp),
+		.type = ULOGD_DTYPE_FLOW,
+	},
+	.output = {
+		.keys = aggr_okeys,
+		.num_keys = ARRAY_SIZE(aggr_okeys),
+		.type = ULOGD_DTYPE_FLOW,
+	},
+	.config_kset	= &aggr_kset,
+	.priv_size	= sizeof(struct aggr_instance),
+	.configure	= &configure_aggr,
+	.start		= &start_aggr,
+	.stop		= &stop_aggr,
+	.signal		= &signal_aggr,
+	.interp		= &interp_aggr,
+	.version	= VERSION,
+};
+
+void __attribute__ ((constructor)) init(void);
+
+void init(void)
+{
+	ulogd_register_plugin(&aggr_plugin);
+}
@@ -109,11 +109,17 @@ static struct ulogd_key mac2str_keys[] = {
 	},
 };
 
-static char hwmac_str[MAX_KEY - START_KEY][HWADDR_LENGTH];
+/* per instance: stacks may run on threads of their own */
+struct mac2str_priv {
+	char hwmac_str[MAX_KEY - START_KEY + 1][HWADDR_LENGTH];
+};
 
-static int parse_mac2str(struct ulogd_key *ret, unsigned char *mac,
+static int parse_mac2str(struct ulogd_pluginstance *pi, unsigned char *mac,
 			 int okey, int len)
 {
+	struct mac2str_priv *priv = (struct mac2str_priv *)pi->private;
+	char (*hwmac_str)[HWADDR_LENGTH] = priv->hwmac_str;
+	struct ulogd_key *ret = pi->output.keys;
 	char *buf_cur;
 	int i;
 
@@ -148,16 +154,18 @@ static uint16_t hwhdr_get_len(struct ulogd_key *inp)
 	void *len = ikey_get_ptr(&inp[KEY_RAW_MAC]) + 2 * ETH_ALEN;
 	return ntohs(*(uint16_t *) len);
 }
-static int parse_ethernet(struct ulogd_key *ret, struct ulogd_key *inp)
+static int parse_ethernet(struct ulogd_pluginstance *pi)
 {
+	struct ulogd_key *ret = pi->output.keys;
+	struct ulogd_key *inp = pi->input.keys;
 	int fret;
 	if (!pp_is_valid(inp, KEY_RAW_MAC_SADDR)) {
-		fret = parse_mac2str(ret, hwhdr_get_saddr(inp),
+		fret = parse_mac2str(pi, hwhdr_get_saddr(inp),
 				     KEY_MAC_SADDR, ETH_ALEN);
 		if (fret != ULOGD_IRET_OK)
 			return fret;
 	}
-	fret = parse_mac2str(ret, hwhdr_get_daddr(inp),
+	fret = parse_mac2str(pi, hwhdr_get_daddr(inp),
 			     KEY_MAC_DADDR, ETH_ALEN);
 	if (fret != ULOGD_IRET_OK)
 		return fret;
@@ -181,7 +189,7 @@ static int interp_mac2str(struct ulogd_pluginstance *pi)
 		int fret;
 		if (! pp_is_valid(inp, KEY_RAW_MAC_ADDRLEN))
 			return ULOGD_IRET_ERR;
-		fret = parse_mac2str(ret,
+		fret = parse_mac2str(pi,
 				     ikey_get_ptr(&inp[KEY_RAW_MAC_SADDR]),
 				     KEY_MAC_SADDR,
 				     ikey_get_u16(&inp[KEY_RAW_MAC_ADDRLEN]));
@@ -209,10 +217,10 @@ static int interp_mac2str(struct ulogd_pluginstance *pi)
 	okey_set_u16(&ret[KEY_MAC_TYPE], type);
 
 	if (type == ARPHRD_ETHER)
-		parse_ethernet(ret, inp);
+		parse_ethernet(pi);
 
 	/* convert raw header to string */
-	return parse_mac2str(ret,
+	return parse_mac2str(pi,
 			     ikey_get_ptr(&inp[KEY_RAW_MAC]),
 			     KEY_MAC_ADDR,
 			     ikey_get_u16(&inp[KEY_RAW_MACLEN]));
@@ -233,6 +241,7 @@ static struct ulogd_plugin mac2str_pluging = {
 		.type = ULOGD_DTYPE_PACKET,
 		},
 	.interp = &interp_mac2str,
+	.priv_size = sizeof(struct mac2str_priv),
 	.version = VERSION,
 };
 
@@ -22,6 +22,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <ulogd/ulogd.h>
 #include <libnfnetlink/libnfnetlink.h>
 
@@ -57,20 +58,31 @@ static struct ulogd_key ifindex_inp[] = {
 static struct ulogd_fd nlif_u_fd = { .fd = -1 };
 static int nlif_users;
 static struct nlif_handle *nlif_inst;
+/* the cache is shared by stacks that may run on threads of their own */
+static pthread_mutex_t nlif_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct ifindex_priv {
+	char indev[IFNAMSIZ];
+	char outdev[IFNAMSIZ];
+};
 
 static int interp_ifindex(struct ulogd_pluginstance *pi)
 {
+	struct ifindex_priv *priv = (struct ifindex_priv *)pi->private;
 	struct ulogd_key *ret = pi->output.keys;
 	struct ulogd_key *inp = pi->input.keys;
-	static char indev[IFNAMSIZ];
-	static char outdev[IFNAMSIZ];
+	char *indev = priv->indev;
+	char *outdev = priv->outdev;
 
+	pthread_mutex_lock(&nlif_lock);
 	nlif_index2name(nlif_inst, ikey_get_u32(&inp[0]), indev);
+	nlif_index2name(nlif_inst, ikey_get_u32(&inp[1]), outdev);
+	pthread_mutex_unlock(&nlif_lock);
+
 	if (indev[0] == '*')
 		indev[0] = 0;
 	okey_set_ptr(&ret[0], indev);
 
-	nlif_index2name(nlif_inst, ikey_get_u32(&inp[1]), outdev);
 	if (outdev[0] == '*')
 		outdev[0] = 0;
 	okey_set_ptr(&ret[1], outdev);
@@ -80,10 +92,16 @@ static int interp_ifindex(struct ulogd_pluginstance *pi)
 
 static int nlif_read_cb(int fd, unsigned int what, void *param)
 {
+	int ret;
+
 	if (!(what & ULOGD_FD_READ))
 		return 0;
 
-	return nlif_catch(nlif_inst);
+	pthread_mutex_lock(&nlif_lock);
+	ret = nlif_catch(nlif_inst);
+	pthread_mutex_unlock(&nlif_lock);
+
+	return ret;
 }
 
 static int ifindex_start(struct ulogd_pluginstance *upi)
@@ -143,6 +161,7 @@ static struct ulogd_plugin ifindex_plugin = {
 		.type = ULOGD_DTYPE_PACKET | ULOGD_DTYPE_FLOW,
 		},
 	.interp = &interp_ifindex,
+	.priv_size = sizeof(struct ifindex_priv),
 
 	.start = &ifindex_start,
 	.stop = &ifindex_fini,
@@ -114,7 +114,10 @@ static struct ulogd_key ip2bin_keys[] = {
 
 };
 
-static char ipbin_array[MAX_KEY-START_KEY][IPADDR_LENGTH];
+/* per instance: stacks may run on threads of their own */
+struct ip2bin_priv {
+	char ipbin_array[MAX_KEY-START_KEY][IPADDR_LENGTH];
+};
 
 /**
  * Convert IPv4 address (as 32-bit unsigned integer) to IPv6 address:
@@ -128,7 +131,8 @@ static inline void uint32_to_ipv6(const uint32_t ipv4, struct in6_addr *ipv6)
 	ipv6->s6_addr32[3] = ipv4;
 }
 
-static int ip2bin(struct ulogd_key* inp, int index, int oindex)
+static int ip2bin(struct ip2bin_priv *priv, struct ulogd_key* inp,
+		  int index, int oindex)
 {
 	char family = ikey_get_u8(&inp[KEY_OOB_FAMILY]);
 	char convfamily = family;
@@ -176,7 +180,7 @@ static int ip2bin(struct ulogd_key* inp, int index, int oindex)
 			return ULOGD_IRET_ERR;
 	}
 
-	buffer = ipbin_array[oindex];
+	buffer = priv->ipbin_array[oindex];
 	/* format IPv6 to BINARY(16) as "0x..." */
 	buffer[0] = '0';
 	buffer[1] = 'x';
@@ -199,6 +203,7 @@ static int ip2bin(struct ulogd_key* inp, int index, int oindex)
 
 static int interp_ip2bin(struct ulogd_pluginstance *pi)
 {
+	struct ip2bin_priv *priv = (struct ip2bin_priv *)pi->private;
 	struct ulogd_key *ret = pi->output.keys;
 	struct ulogd_key *inp = pi->input.keys;
 	int i;
@@ -207,11 +212,11 @@ static int interp_ip2bin(struct ulogd_pluginstance *pi)
 	/* Iter on all addr fields */
 	for(i = START_KEY; i < MAX_KEY; i++) {
 		if (pp_is_valid(inp, i)) {
-			fret = ip2bin(inp, i, i-START_KEY);
+			fret = ip2bin(priv, inp, i, i-START_KEY);
 			if (fret != ULOGD_IRET_OK)
 				return fret;
 			okey_set_ptr(&ret[i-START_KEY],
-				     ipbin_array[i-START_KEY]);
+				     priv->ipbin_array[i-START_KEY]);
 		}
 	}
 
@@ -231,6 +236,7 @@ static struct ulogd_plugin ip2bin_pluging = {
 		.type = ULOGD_DTYPE_PACKET | ULOGD_DTYPE_FLOW,
 		},
 	.interp = &interp_ip2bin,
+	.priv_size = sizeof(struct ip2bin_priv),
 	.version = VERSION,
 };
 
@@ -137,10 +137,15 @@ static struct ulogd_key ip2str_keys[] = {
 	},
 };
 
-static char ipstr_array[MAX_KEY-START_KEY][IPADDR_LENGTH];
+/* per instance: stacks may run on threads of their own */
+struct ip2str_priv {
+	char ipstr_array[MAX_KEY-START_KEY+1][IPADDR_LENGTH];
+};
 
-static int ip2str(struct ulogd_key *inp, int index, int oindex)
+static int ip2str(struct ip2str_priv *priv, struct ulogd_key *inp,
+		  int index, int oindex)
 {
+	char (*ipstr_array)[IPADDR_LENGTH] = priv->ipstr_array;
 	char family = ikey_get_u8(&inp[KEY_OOB_FAMILY]);
 	char convfamily = family;
 
@@ -189,6 +194,7 @@ static int ip2str(struct ulogd_key *inp, int index, int oindex)
 
 static int interp_ip2str(struct ulogd_pluginstance *pi)
 {
+	struct ip2str_priv *priv = (struct ip2str_priv *)pi->private;
 	struct ulogd_key *ret = pi->output.keys;
 	struct ulogd_key *inp = pi->input.keys;
 	int i;
@@ -197,11 +203,11 @@ static int interp_ip2str(struct ulogd_pluginstance *pi)
 	/* Iter on all addr fields */
 	for (i = START_KEY; i <= MAX_KEY; i++) {
 		if (pp_is_valid(inp, i)) {
-			fret = ip2str(inp, i, i-START_KEY);
+			fret = ip2str(priv, inp, i, i-START_KEY);
 			if (fret != ULOGD_IRET_OK)
 				return fret;
 			okey_set_ptr(&ret[i-START_KEY],
-				     ipstr_array[i-START_KEY]);
+				     priv->ipstr_array[i-START_KEY]);
 		}
 	}
 
@@ -221,6 +227,7 @@ static struct ulogd_plugin ip2str_pluging = {
 		.type = ULOGD_DTYPE_PACKET | ULOGD_DTYPE_FLOW,
 		},
 	.interp = &interp_ip2str,
+	.priv_size = sizeof(struct ip2str_priv),
 	.version = VERSION,
 };
 
@@ -0,0 +1,784 @@
+/* ulogd_filter_PKT2FLOW.c
+ *
+ * ulogd filter plugin turning a stream of logged packets into flow
+ * records: packets are accounted to the flow of their 5-tuple, which is
+ * passed on once it has been idle for inactive_timeout seconds, or has
+ * lasted active_timeout seconds.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2
+ *  as published by the Free Software Foundation
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <ulogd/ulogd.h>
+#include <ulogd/timer.h>
+#include <ulogd/hash.h>
+#include <ulogd/jhash.h>
+#include <ulogd/slab.h>
+#include <ulogd/linuxlist.h>
+#include <ulogd/ipfix_protocol.h>
+
+enum p2f_conf {
+	P2F_CONF_ACTIVE_TIMEOUT,
+	P2F_CONF_INACTIVE_TIMEOUT,
+	P2F_CONF_MAX_FLOWS,
+	P2F_CONF_OPENADDR,
+};
+
+static struct config_keyset p2f_kset = {
+	.num_ces = 4,
+	.ces = {
+		[P2F_CONF_ACTIVE_TIMEOUT] = {
+			.key	 = "active_timeout",
+			.type	 = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 300,
+		},
+		[P2F_CONF_INACTIVE_TIMEOUT] = {
+			.key	 = "inactive_timeout",
+			.type	 = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 15,
+		},
+		[P2F_CONF_MAX_FLOWS] = {
+			.key	 = "max_flows",
+			.type	 = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 65536,
+		},
+		[P2F_CONF_OPENADDR] = {
+			.key	 = "hash_open_addressing",
+			.type	 = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 0,
+		},
+	},
+};
+
+#define active_timeout_ce(x)	((x)->ces[P2F_CONF_ACTIVE_TIMEOUT])
+#define inactive_timeout_ce(x)	((x)->ces[P2F_CONF_INACTIVE_TIMEOUT])
+#define max_flows_ce(x)		((x)->ces[P2F_CONF_MAX_FLOWS])
+#define openaddr_ce(x)		((x)->ces[P2F_CONF_OPENADDR])
+
+enum input_keys {
+	KEY_OOB_FAMILY,
+	KEY_OOB_MARK,
+	KEY_OOB_TIME_SEC,
+	KEY_OOB_TIME_USEC,
+	KEY_RAW_PKTLEN,
+	KEY_IP_SADDR,
+	KEY_IP_DADDR,
+	KEY_IP_PROTOCOL,
+	KEY_IP_TOTLEN,
+	KEY_IP6_PAYLOAD_LEN,
+	KEY_TCP_SPORT,
+	KEY_TCP_DPORT,
+	KEY_UDP_SPORT,
+	KEY_UDP_DPORT,
+	KEY_SCTP_SPORT,
+	KEY_SCTP_DPORT,
+	KEY_ICMP_TYPE,
+	KEY_ICMP_CODE,
+	KEY_ICMPV6_TYPE,
+	KEY_ICMPV6_CODE,
+};
+
+static struct ulogd_key p2f_inp[] = {
+	[KEY_OOB_FAMILY] = {
+		.type	= ULOGD_RET_UINT8,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "oob.family",
+	},
+	[KEY_OOB_MARK] = {
+		.type	= ULOGD_RET_UINT32,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "oob.mark",
+	},
+	[KEY_OOB_TIME_SEC] = {
+		.type	= ULOGD_RET_UINT32,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "oob.time.sec",
+	},
+	[KEY_OOB_TIME_USEC] = {
+		.type	= ULOGD_RET_UINT32,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "oob.time.usec",
+	},
+	[KEY_RAW_PKTLEN] = {
+		.type	= ULOGD_RET_UINT32,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "raw.pktlen",
+	},
+	[KEY_IP_SADDR] = {
+		.type	= ULOGD_RET_IPADDR,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "ip.saddr",
+	},
+	[KEY_IP_DADDR] = {
+		.type	= ULOGD_RET_IPADDR,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "ip.daddr",
+	},
+	[KEY_IP_PROTOCOL] = {
+		.type	= ULOGD_RET_UINT8,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "ip.protocol",
+	},
+	[KEY_IP_TOTLEN] = {
+		.type	= ULOGD_RET_UINT16,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "ip.totlen",
+	},
+	[KEY_IP6_PAYLOAD_LEN] = {
+		.type	= ULOGD_RET_UINT16,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "ip6.payloadlen",
+	},
+	[KEY_TCP_SPORT] = {
+		.type	= ULOGD_RET_UINT16,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "tcp.sport",
+	},
+	[KEY_TCP_DPORT] = {
+		.type	= ULOGD_RET_UINT16,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "tcp.dport",
+	},
+	[KEY_UDP_SPORT] = {
+		.type	= ULOGD_RET_UINT16,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "udp.sport",
+	},
+	[KEY_UDP_DPORT] = {
+		.type	= ULOGD_RET_UINT16,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "udp.dport",
+	},
+	[KEY_SCTP_SPORT] = {
+		.type	= ULOGD_RET_UINT16,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "sctp.sport",
+	},
+	[KEY_SCTP_DPORT] = {
+		.type	= ULOGD_RET_UINT16,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "sctp.dport",
+	},
+	[KEY_ICMP_TYPE] = {
+		.type	= ULOGD_RET_UINT8,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "icmp.type",
+	},
+	[KEY_ICMP_CODE] = {
+		.type	= ULOGD_RET_UINT8,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "icmp.code",
+	},
+	[KEY_ICMPV6_TYPE] = {
+		.type	= ULOGD_RET_UINT8,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "icmpv6.type",
+	},
+	[KEY_ICMPV6_CODE] = {
+		.type	= ULOGD_RET_UINT8,
+		.flags	= ULOGD_RETF_NONE|ULOGD_KEYF_OPTIONAL,
+		.name	= "icmpv6.code",
+	},
+};
+
+/* the keys of NFCT, flows being seen in the original direction only */
+enum output_keys {
+	OKEY_ORIG_IP_SADDR,
+	OKEY_ORIG_IP_DADDR,
+	OKEY_ORIG_IP_PROTOCOL,
+	OKEY_ORIG_L4_SPORT,
+	OKEY_ORIG_L4_DPORT,
+	OKEY_ORIG_RAW_PKTLEN,
+	OKEY_ORIG_RAW_PKTCOUNT,
+	OKEY_REPLY_RAW_PKTLEN,
+	OKEY_REPLY_RAW_PKTCOUNT,
+	OKEY_ICMP_CODE,
+	OKEY_ICMP_TYPE,
+	OKEY_CT_MARK,
+	OKEY_CT_EVENT,
+	OKEY_FLOW_START_SEC,
+	OKEY_FLOW_START_USEC,
+	OKEY_FLOW_END_SEC,
+	OKEY_FLOW_END_USEC,
+	OKEY_OOB_FAMILY,
+	OKEY_OOB_PROTOCOL,
+};
+
+static struct ulogd_key p2f_okeys[] = {
+	[OKEY_ORIG_IP_SADDR] = {
+		.type	= ULOGD_RET_IPADDR,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "orig.ip.saddr",
+		.ipfix	= {
+			.vendor = IPFIX_VENDOR_IETF,
+			.field_id = IPFIX_sourceIPv4Address,
+		},
+	},
+	[OKEY_ORIG_IP_DADDR] = {
+		.type	= ULOGD_RET_IPADDR,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "orig.ip.daddr",
+		.ipfix	= {
+			.vendor = IPFIX_VENDOR_IETF,
+			.field_id = IPFIX_destinationIPv4Address,
+		},
+	},
+	[OKEY_ORIG_IP_PROTOCOL] = {
+		.type	= ULOGD_RET_UINT8,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "orig.ip.protocol",
+		.ipfix	= {
+			.vendor = IPFIX_VENDOR_IETF,
+			.field_id = IPFIX_protocolIdentifier,
+		},
+	},
+	[OKEY_ORIG_L4_SPORT] = {
+		.type	= ULOGD_RET_UINT16,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "orig.l4.sport",
+		.ipfix	= {
+			.vendor 	= IPFIX_VENDOR_IETF,
+			.field_id 	= IPFIX_sourceTransportPort,
+		},
+	},
+	[OKEY_ORIG_L4_DPORT] = {
+		.type	= ULOGD_RET_UINT16,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "orig.l4.dport",
+		.ipfix	= {
+			.vendor 	= IPFIX_VENDOR_IETF,
+			.field_id 	= IPFIX_destinationTransportPort,
+		},
+	},
+	[OKEY_ORIG_RAW_PKTLEN] = {
+		.type	= ULOGD_RET_UINT64,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "orig.raw.pktlen",
+		.ipfix	= {
+			.vendor 	= IPFIX_VENDOR_IETF,
+			.field_id 	= IPFIX_octetTotalCount,
+		},
+	},
+	[OKEY_ORIG_RAW_PKTCOUNT] = {
+		.type	= ULOGD_RET_UINT64,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "orig.raw.pktcount",
+		.ipfix	= {
+			.vendor 	= IPFIX_VENDOR_IETF,
+			.field_id 	= IPFIX_packetTotalCount,
+		},
+	},
+	[OKEY_REPLY_RAW_PKTLEN] = {
+		.type	= ULOGD_RET_UINT64,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "reply.raw.pktlen",
+		.ipfix	= {
+			.vendor 	= IPFIX_VENDOR_IETF,
+			.field_id 	= IPFIX_octetTotalCount,
+		},
+	},
+	[OKEY_REPLY_RAW_PKTCOUNT] = {
+		.type	= ULOGD_RET_UINT64,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "reply.raw.pktcount",
+		.ipfix	= {
+			.vendor 	= IPFIX_VENDOR_IETF,
+			.field_id 	= IPFIX_packetTotalCount,
+		},
+	},
+	[OKEY_ICMP_CODE] = {
+		.type	= ULOGD_RET_UINT8,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "icmp.code",
+		.ipfix	= {
+			.vendor		= IPFIX_VENDOR_IETF,
+			.field_id	= IPFIX_icmpCodeIPv4,
+		},
+	},
+	[OKEY_ICMP_TYPE] = {
+		.type	= ULOGD_RET_UINT8,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "icmp.type",
+		.ipfix	= {
+			.vendor		= IPFIX_VENDOR_IETF,
+			.field_id	= IPFIX_icmpTypeIPv4,
+		},
+	},
+	[OKEY_CT_MARK] = {
+		.type	= ULOGD_RET_UINT32,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "ct.mark",
+		.ipfix	= {
+			.vendor		= IPFIX_VENDOR_NETFILTER,
+			.field_id	= IPFIX_NF_mark,
+		},
+	},
+	[OKEY_CT_EVENT] = {
+		.type	= ULOGD_RET_UINT32,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "ct.event",
+	},
+	[OKEY_FLOW_START_SEC] = {
+		.type 	= ULOGD_RET_UINT32,
+		.flags 	= ULOGD_RETF_NONE,
+		.name	= "flow.start.sec",
+		.ipfix	= {
+			.vendor		= IPFIX_VENDOR_IETF,
+			.field_id	= IPFIX_flowStartSeconds,
+		},
+	},
+	[OKEY_FLOW_START_USEC] = {
+		.type 	= ULOGD_RET_UINT32,
+		.flags 	= ULOGD_RETF_NONE,
+		.name	= "flow.start.usec",
+		.ipfix	= {
+			.vendor		= IPFIX_VENDOR_IETF,
+			.field_id	= IPFIX_flowStartMicroSeconds,
+		},
+	},
+	[OKEY_FLOW_END_SEC] = {
+		.type	= ULOGD_RET_UINT32,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "flow.end.sec",
+		.ipfix	= {
+			.vendor		= IPFIX_VENDOR_IETF,
+			.field_id	= IPFIX_flowEndSeconds,
+		},
+	},
+	[OKEY_FLOW_END_USEC] = {
+		.type	= ULOGD_RET_UINT32,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "flow.end.usec",
+		.ipfix	= {
+			.vendor		= IPFIX_VENDOR_IETF,
+			.field_id	= IPFIX_flowEndMicroSeconds,
+		},
+	},
+	[OKEY_OOB_FAMILY] = {
+		.type	= ULOGD_RET_UINT8,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "oob.family",
+	},
+	[OKEY_OOB_PROTOCOL] = {
+		.type	= ULOGD_RET_UINT8,
+		.flags	= ULOGD_RETF_NONE,
+		.name	= "oob.protocol",
+	},
+};
+
+/* NFCT_T_DESTROY of libnetfilter_conntrack, as NFCT sets ct.event */
+#define P2F_CT_DESTROY	(1 << 2)
+
+/* IPv4 addresses use the first word of the IPv6 ones */
+struct p2f_tuple {
+	uint32_t saddr[4];
+	uint32_t daddr[4];
+	uint16_t sport;
+	uint16_t dport;
+	uint8_t family;
+	uint8_t proto;
+	uint8_t icmp_type;
+	uint8_t icmp_code;
+};
+
+struct p2f_key {
+	uint32_t hash;			/* of tuple */
+	struct p2f_tuple tuple;
+};
+
+struct p2f_flow {
+	struct hashtable_node hashnode;
+	struct llist_head idle;		/* in p2f_instance.idle */
+	struct llist_head age;		/* in p2f_instance.age */
+	struct p2f_key key;
+	struct timeval start;
+	struct timeval last;
+	uint64_t bytes;
+	uint64_t packets;
+	uint32_t mark;
+};
+
+#define P2F_BUCKETS	1024
+
+/* Expiry doesn't need to scan the cache: a flow moves to the tail of the
+ * idle list on each packet, and goes to the tail of the age list when it
+ * is created, so that both lists are sorted by the time the timeouts
+ * count from, and the flows to expire are found at their heads. */
+struct p2f_instance {
+	struct hashtable *flows;
+	struct slab *slab;		/* entries of flows */
+	struct llist_head idle;		/* least recently seen first */
+	struct llist_head age;		/* oldest first */
+	struct ulogd_timer timer;
+	uint64_t evicted;		/* flows ended early, max_flows */
+};
+
+static uint32_t p2f_hash(const void *data, const struct hashtable *table)
+{
+	const struct p2f_key *k = data;
+
+	return k->hash;
+}
+
+static int p2f_compare(const void *data1, const void *data2)
+{
+	const struct p2f_flow *f = data1;
+	const struct p2f_key *k = data2;
+
+	return memcmp(&f->key.tuple, &k->tuple, sizeof(k->tuple)) == 0;
+}
+
+static void set_addr(struct ulogd_key *key, uint8_t family,
+		     const uint32_t *addr)
+{
+	if (family == AF_INET6)
+		okey_set_u128(key, addr);
+	else
+		okey_set_u32(key, addr[0]);
+}
+
+/* pass the flow on, and forget about it: the next packet of its tuple
+ * starts a new one */
+static void flow_end(struct ulogd_pluginstance *pi, struct p2f_flow *f)
+{
+	struct p2f_instance *pf = (struct p2f_instance *) &pi->private;
+	struct ulogd_key *ret = pi->output.keys;
+	const struct p2f_tuple *t = &f->key.tuple;
+
+	okey_set_u8(&ret[OKEY_OOB_FAMILY], t->family);
+	okey_set_u8(&ret[OKEY_OOB_PROTOCOL], 0);
+	set_addr(&ret[OKEY_ORIG_IP_SADDR], t->family, t->saddr);
+	set_addr(&ret[OKEY_ORIG_IP_DADDR], t->family, t->daddr);
+	okey_set_u8(&ret[OKEY_ORIG_IP_PROTOCOL], t->proto);
+
+	switch (t->proto) {
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+	case IPPROTO_UDPLITE:
+	case IPPROTO_SCTP:
+	case IPPROTO_DCCP:
+		okey_set_u16(&ret[OKEY_ORIG_L4_SPORT], t->sport);
+		okey_set_u16(&ret[OKEY_ORIG_L4_DPORT], t->dport);
+		break;
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		okey_set_u8(&ret[OKEY_ICMP_TYPE], t->icmp_type);
+		okey_set_u8(&ret[OKEY_ICMP_CODE], t->icmp_code);
+		break;
+	}
+
+	okey_set_u64(&ret[OKEY_ORIG_RAW_PKTLEN], f->bytes);
+	okey_set_u64(&ret[OKEY_ORIG_RAW_PKTCOUNT], f->packets);
+	okey_set_u64(&ret[OKEY_REPLY_RAW_PKTLEN], 0);
+	okey_set_u64(&ret[OKEY_REPLY_RAW_PKTCOUNT], 0);
+	okey_set_u32(&ret[OKEY_CT_MARK], f->mark);
+	okey_set_u32(&ret[OKEY_CT_EVENT], P2F_CT_DESTROY);
+	okey_set_u32(&ret[OKEY_FLOW_START_SEC], f->start.tv_sec);
+	okey_set_u32(&ret[OKEY_FLOW_START_USEC], f->start.tv_usec);
+	okey_set_u32(&ret[OKEY_FLOW_END_SEC], f->last.tv_sec);
+	okey_set_u32(&ret[OKEY_FLOW_END_USEC], f->last.tv_usec);
+
+	ulogd_propagate_from(pi);
+
+	llist_del(&f->idle);
+	llist_del(&f->age);
+	hashtable_del(pf->flows, &f->hashnode);
+	slab_free(pf->slab, f);
+}
+
+/* end the flows which reached one of the timeouts at now */
+static void p2f_expire(struct ulogd_pluginstance *pi, time_t now)
+{
+	struct p2f_instance *pf = (struct p2f_instance *) &pi->private;
+	int active = active_timeout_ce(pi->config_kset).u.value;
+	int inactive = inactive_timeout_ce(pi->config_kset).u.value;
+	struct p2f_flow *f;
+
+	while (!llist_empty(&pf->idle)) {
+		f = llist_entry(pf->idle.next, struct p2f_flow, idle);
+		if (now - f->last.tv_sec < inactive)
+			break;
+		flow_end(pi, f);
+	}
+
+	if (active <= 0)
+		return;
+
+	while (!llist_empty(&pf->age)) {
+		f = llist_entry(pf->age.next, struct p2f_flow, age);
+		if (now - f->start.tv_sec < active)
+			break;
+		flow_end(pi, f);
+	}
+}
+
+static void p2f_timer_cb(struct ulogd_timer *t, void *data)
+{
+	struct ulogd_pluginstance *pi = data;
+	struct p2f_instance *pf = (struct p2f_instance *) &pi->private;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	p2f_expire(pi, now.tv_sec);
+	if (pf->evicted) {
+		ulogd_log(ULOGD_NOTICE, "PKT2FLOW: %llu flows ended before "
+			  "their timeout, consider raising `max_flows'\n",
+			  (unsigned long long)pf->evicted);
+		pf->evicted = 0;
+	}
+	ulogd_add_timer(&pf->timer, 1);
+}
+
+static void key_build(struct p2f_key *k, struct ulogd_key *inp,
+		      uint8_t family)
+{
+	struct p2f_tuple *t = &k->tuple;
+
+	memset(k, 0, sizeof(*k));
+	t->family = family;
+	t->proto = ikey_get_u8(&inp[KEY_IP_PROTOCOL]);
+	if (family == AF_INET6) {
+		memcpy(t->saddr, ikey_get_u128(&inp[KEY_IP_SADDR]),
+		       sizeof(t->saddr));
+		memcpy(t->daddr, ikey_get_u128(&inp[KEY_IP_DADDR]),
+		       sizeof(t->daddr));
+	} else {
+		t->saddr[0] = ikey_get_u32(&inp[KEY_IP_SADDR]);
+		t->daddr[0] = ikey_get_u32(&inp[KEY_IP_DADDR]);
+	}
+
+	/* BASE only sets the keys of the protocol of the packet */
+	if (pp_is_valid(inp, KEY_TCP_SPORT)) {
+		t->sport = ikey_get_u16(&inp[KEY_TCP_SPORT]);
+		t->dport = ikey_get_u16(&inp[KEY_TCP_DPORT]);
+	} else if (pp_is_valid(inp, KEY_UDP_SPORT)) {
+		t->sport = ikey_get_u16(&inp[KEY_UDP_SPORT]);
+		t->dport = ikey_get_u16(&inp[KEY_UDP_DPORT]);
+	} else if (pp_is_valid(inp, KEY_SCTP_SPORT)) {
+		t->sport = ikey_get_u16(&inp[KEY_SCTP_SPORT]);
+		t->dport = ikey_get_u16(&inp[KEY_SCTP_DPORT]);
+	} else if (pp_is_valid(inp, KEY_ICMP_TYPE)) {
+		t->icmp_type = ikey_get_u8(&inp[KEY_ICMP_TYPE]);
+		t->icmp_code = ikey_get_u8(&inp[KEY_ICMP_CODE]);
+	} else if (pp_is_valid(inp, KEY_ICMPV6_TYPE)) {
+		t->icmp_type = ikey_get_u8(&inp[KEY_ICMPV6_TYPE]);
+		t->icmp_code = ikey_get_u8(&inp[KEY_ICMPV6_CODE]);
+	}
+
+	k->hash = jhash2((uint32_t *)t, sizeof(*t) / sizeof(uint32_t), 0);
+}
+
+/* length of the packet on the wire, raw.pktlen being what got copied */
+static uint32_t pkt_len(struct ulogd_key *inp, uint8_t family)
+{
+	if (family == AF_INET && pp_is_valid(inp, KEY_IP_TOTLEN))
+		return ikey_get_u16(&inp[KEY_IP_TOTLEN]);
+	if (family == AF_INET6 && pp_is_valid(inp, KEY_IP6_PAYLOAD_LEN))
+		return ikey_get_u16(&inp[KEY_IP6_PAYLOAD_LEN]) + 40;
+	if (pp_is_valid(inp, KEY_RAW_PKTLEN))
+		return ikey_get_u32(&inp[KEY_RAW_PKTLEN]);
+	return 0;
+}
+
+static struct p2f_flow *flow_new(struct ulogd_pluginstance *pi,
+				 const struct p2f_key *k)
+{
+	struct p2f_instance *pf = (struct p2f_instance *) &pi->private;
+	struct p2f_flow *f;
+
+	f = slab_alloc(pf->slab);
+	if (f == NULL && !llist_empty(&pf->idle)) {
+		/* make room by ending the flow idle for the longest time */
+		flow_end(pi, llist_entry(pf->idle.next, struct p2f_flow,
+					 idle));
+		pf->evicted++;
+		f = slab_alloc(pf->slab);
+	}
+	if (f == NULL)
+		return NULL;
+
+	f->key = *k;
+	if (hashtable_add(pf->flows, &f->hashnode, k->hash) < 0) {
+		slab_free(pf->slab, f);
+		return NULL;
+	}
+	llist_add_tail(&f->idle, &pf->idle);
+	llist_add_tail(&f->age, &pf->age);
+	return f;
+}
+
+static int interp_p2f(struct ulogd_pluginstance *pi)
+{
+	struct p2f_instance *pf = (struct p2f_instance *) &pi->private;
+	struct ulogd_key *inp = pi->input.keys;
+	struct p2f_flow *f;
+	struct p2f_key k;
+	struct timeval tv;
+	uint32_t len, mark = 0;
+	int has_mark;
+	uint8_t family;
+
+	if (!pp_is_valid(inp, KEY_IP_SADDR) ||
+	    !pp_is_valid(inp, KEY_IP_PROTOCOL))
+		return ULOGD_IRET_STOP;
+	family = ikey_get_u8(&inp[KEY_OOB_FAMILY]);
+	if (family != AF_INET && family != AF_INET6)
+		return ULOGD_IRET_STOP;
+
+	if (pp_is_valid(inp, KEY_OOB_TIME_SEC)) {
+		tv.tv_sec = ikey_get_u32(&inp[KEY_OOB_TIME_SEC]);
+		tv.tv_usec = pp_is_valid(inp, KEY_OOB_TIME_USEC) ?
+			     ikey_get_u32(&inp[KEY_OOB_TIME_USEC]) : 0;
+	} else
+		gettimeofday(&tv, NULL);
+
+	/* read all of the packet first: making room for its flow may pass
+	 * another one on */
+	len = pkt_len(inp, family);
+	has_mark = pp_is_valid(inp, KEY_OOB_MARK);
+	if (has_mark)
+		mark = ikey_get_u32(&inp[KEY_OOB_MARK]);
+	key_build(&k, inp, family);
+	f = (struct p2f_flow *)hashtable_find(pf->flows, &k, k.hash);
+	if (f == NULL) {
+		f = flow_new(pi, &k);
+		if (f == NULL)
+			return ULOGD_IRET_STOP;
+		f->start = tv;
+	} else {
+		llist_del(&f->idle);
+		llist_add_tail(&f->idle, &pf->idle);
+	}
+
+	f->last = tv;
+	f->bytes += len;
+	f->packets++;
+	if (has_mark)
+		f->mark = mark;
+
+	/* the packet goes on as part of its flow only */
+	return ULOGD_IRET_STOP;
+}
+
+static int configure_p2f(struct ulogd_pluginstance *pi,
+			 struct ulogd_pluginstance_stack *stack)
+{
+	int ret;
+
+	ulogd_log(ULOGD_DEBUG, "parsing config file section `%s', "
+		  "plugin `%s'\n", pi->id, pi->plugin->name);
+
+	ret = config_parse_file(pi->id, pi->config_kset);
+	if (ret < 0)
+		return ret;
+
+	if (inactive_timeout_ce(pi->config_kset).u.value <= 0) {
+		ulogd_log(ULOGD_FATAL, "PKT2FLOW: inactive_timeout must be "
+			  "positive\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int start_p2f(struct ulogd_pluginstance *pi)
+{
+	struct p2f_instance *pf = (struct p2f_instance *) &pi->private;
+
+	pf->flows = hashtable_create_flags(P2F_BUCKETS, 0, p2f_hash,
+				p2f_compare,
+				openaddr_ce(pi->config_kset).u.value ?
+				HASHTABLE_F_OPEN : 0);
+	if (pf->flows == NULL) {
+		ulogd_log(ULOGD_FATAL, "PKT2FLOW: error allocating hash\n");
+		return -1;
+	}
+	pf->slab = slab_create_table(sizeof(struct p2f_flow),
+				     max_flows_ce(pi->config_kset).u.value,
+				     P2F_BUCKETS);
+	if (pf->slab == NULL) {
+		ulogd_log(ULOGD_FATAL, "PKT2FLOW: error allocating flows\n");
+		hashtable_destroy(pf->flows);
+		return -1;
+	}
+	INIT_LLIST_HEAD(&pf->idle);
+	INIT_LLIST_HEAD(&pf->age);
+
+	ulogd_init_timer(&pf->timer, pi, p2f_timer_cb);
+	ulogd_add_timer(&pf->timer, 1);
+	return 0;
+}
+
+static int stop_p2f(struct ulogd_pluginstance *pi)
+{
+	struct p2f_instance *pf = (struct p2f_instance *) &pi->private;
+
+	ulogd_del_timer(&pf->timer);
+	hashtable_destroy(pf->flows);
+	slab_destroy(pf->slab);
+	return 0;
+}
+
+static void signal_p2f(struct ulogd_pluginstance *pi, int signal)
+{
+	struct p2f_instance *pf = (struct p2f_instance *) &pi->private;
+
+	switch (signal) {
+	case SIGTERM:
+	case SIGINT:
+		/* the flows in the cache end here */
+		while (!llist_empty(&pf->age))
+			flow_end(pi, llist_entry(pf->age.next,
+						 struct p2f_flow, age));
+		break;
+	}
+}
+
+static struct ulogd_plugin p2f_plugin = {
+	.name = "PKT2FLOW",
+	.input = {
+		.keys = p2f_inp,
+		.num_keys = ARRAY_SIZE(p2f_inp),
+		.type = ULOGD_DTYPE_PACKET,
+	},
+	.output = {
+		.keys = p2f_okeys,
+		.num_keys = ARRAY_SIZE(p2f_okeys),
+		.type = ULOGD_DTYPE_FLOW,
+	},
+	.config_kset	= &p2f_kset,
+	.priv_size	= sizeof(struct p2f_instance),
+	.configure	= &configure_p2f,
+	.start		= &start_p2f,
+	.stop		= &stop_p2f,
+	.signal		= &signal_p2f,
+	.interp		= &interp_p2f,
+	.version	= VERSION,
+};
+
+void __attribute__ ((constructor)) init(void);
+
+void init(void)
+{
+	ulogd_register_plugin(&p2f_plugin);
+}
@@ -0,0 +1,140 @@
+/*
+ * Compare the chained and the open addressing hashtables.
+ *
+ * Built with `make', not installed.  Run as `hashbench/hashbench
+ * [entries...]', 1M and 10M entries by default.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ulogd/hash.h>
+#include <ulogd/jhash.h>
+
+/* about the size of a NFCT flow key */
+struct entry {
+	struct hashtable_node node;
+	uint32_t key[19];
+};
+
+static uint32_t hash(const void *data, const struct hashtable *table)
+{
+	return jhash2((uint32_t *)data, 19, 0);
+}
+
+static int compare(const void *data1, const void *data2)
+{
+	const struct entry *e = data1;
+
+	return memcmp(e->key, data2, sizeof(e->key)) == 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill(struct entry *e, uint32_t i, uint32_t salt)
+{
+	memset(e->key, 0, sizeof(e->key));
+	e->key[0] = i * 2654435761U;
+	e->key[4] = i ^ salt;
+	e->key[17] = 6 << 8 | 2;
+}
+
+static void run(uint32_t n, uint32_t flags, const char *name)
+{
+	struct hashtable *t;
+	struct hashtable_stats st;
+	struct entry *e, probe;
+	uint32_t *order, i, j, found = 0;
+	double t0, t_add, t_hit, t_miss, t_del;
+
+	e = malloc(n * sizeof(*e));
+	order = malloc(n * sizeof(*order));
+	t = hashtable_create_flags(8192, 0, hash, compare, flags);
+	if (e == NULL || order == NULL || t == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* look up in an order unrelated to insertion */
+	for (i = 0; i < n; i++)
+		order[i] = i;
+	srandom(1);
+	for (i = n - 1; i > 0; i--) {
+		uint32_t tmp;
+
+		j = random() % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+
+	t0 = now();
+	for (i = 0; i < n; i++) {
+		fill(&e[i], i, 0);
+		hashtable_add(t, &e[i].node, hashtable_hash(t, e[i].key));
+	}
+	t_add = now() - t0;
+	hashtable_stats(t, &st);
+
+	t0 = now();
+	for (i = 0; i < n; i++) {
+		const uint32_t *k = e[order[i]].key;
+
+		found += hashtable_find(t, k, hashtable_hash(t, k)) != NULL;
+	}
+	t_hit = now() - t0;
+
+	t0 = now();
+	for (i = 0; i < n; i++) {
+		fill(&probe, order[i], 0x5a5a5a5a);
+		found += hashtable_find(t, probe.key,
+				hashtable_hash(t, probe.key)) != NULL;
+	}
+	t_miss = now() - t0;
+
+	t0 = now();
+	for (i = 0; i < n; i++)
+		hashtable_del(t, &e[order[i]].node);
+	t_del = now() - t0;
+
+	printf("%-8s %9u  add %6.1f  hit %6.1f  miss %6.1f  del %6.1f ns"
+	       "  (%u buckets, longest %u)%s\n", name, n,
+	       t_add * 1e9 / n, t_hit * 1e9 / n, t_miss * 1e9 / n,
+	       t_del * 1e9 / n, st.buckets, st.max_chain,
+	       found == n ? "" : "  WRONG");
+
+	hashtable_destroy(t);
+	free(order);
+	free(e);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t sizes[] = { 1000000, 10000000 };
+	int i;
+
+	if (argc > 1) {
+		for (i = 1; i < argc; i++) {
+			run(strtoul(argv[i], NULL, 0), 0, "chained");
+			run(strtoul(argv[i], NULL, 0), HASHTABLE_F_OPEN, "open");
+		}
+		return 0;
+	}
+
+	for (i = 0; i < 2; i++) {
+		run(sizes[i], 0, "chained");
+		run(sizes[i], HASHTABLE_F_OPEN, "open");
+	}
+	return 0;
+}
@@ -9,20 +9,62 @@
 struct hashtable;
 struct hashtable_node;
 
+/* Open addressing rather than chaining: nodes are referenced from an
+ * array of slots probed a group at a time, using a control byte per slot
+ * that holds 7 bits of the hash of its node.  Most lookups then read a
+ * single group of control bytes and the node they look for. */
+#define HASHTABLE_F_OPEN	0x0001
+
+/* The table doubles when it holds more entries than buckets (7 for 8
+ * slots with HASHTABLE_F_OPEN) and halves, down to its initial size, when
+ * it holds less than one per eight.  The entries are moved to the new
+ * buckets a few at a time on later lookups and insertions, so a resize
+ * never stalls the caller. */
 struct hashtable {
 	uint32_t hashsize;
-	uint32_t limit;
+	uint32_t min_size;		/* as created */
+	uint32_t limit;			/* 0 for none */
 	uint32_t count;
 	uint32_t initval;
-	
+	uint32_t flags;
+
 	uint32_t (*hash)(const void *data, const struct hashtable *table);
 	int	 (*compare)(const void *data1, const void *data2);
 
-	struct llist_head 	members[0];
+	struct llist_head	*members;
+	/* buckets of the previous size, those below rehash_idx have been
+	 * moved already */
+	struct llist_head	*old;
+	uint32_t		old_size;
+	uint32_t		rehash_idx;
+	unsigned int		iterating;
+	uint32_t		generation;	/* resizes started and done */
+
+	/* HASHTABLE_F_OPEN: control bytes and slots, of the current and
+	 * of the previous size */
+	uint8_t			*ctrl;
+	struct hashtable_node	**slots;
+	uint8_t			*old_ctrl;
+	struct hashtable_node	**old_slots;
+	uint32_t		used;		/* slots not empty */
 };
 
 struct hashtable_node {
 	struct llist_head head;
+	uint32_t hash;
+};
+
+/* chains[i] is the number of buckets holding i + 1 entries, the last
+ * one counts the longer chains as well.  With HASHTABLE_F_OPEN, buckets
+ * are slots, and chains[i] counts the entries found in the i + 1th group
+ * probed. */
+#define HASHTABLE_CHAINS	4
+
+struct hashtable_stats {
+	uint32_t buckets;
+	uint32_t used;
+	uint32_t max_chain;
+	uint32_t chains[HASHTABLE_CHAINS];
 };
 
 struct hashtable *
@@ -30,15 +72,26 @@ hashtable_create(int hashsize, int limit,
 		 uint32_t (*hash)(const void *data,
 		 		  const struct hashtable *table),
 		 int (*compare)(const void *data1, const void *data2));
+struct hashtable *
+hashtable_create_flags(int hashsize, int limit,
+		       uint32_t (*hash)(const void *data,
+					const struct hashtable *table),
+		       int (*compare)(const void *data1, const void *data2),
+		       uint32_t flags);
 void hashtable_destroy(struct hashtable *h);
-int hashtable_hash(const struct hashtable *table, const void *data);
-struct hashtable_node *hashtable_find(const struct hashtable *table, const void *data, int id);
-int hashtable_add(struct hashtable *table, struct hashtable_node *n, int id);
+uint32_t hashtable_hash(const struct hashtable *table, const void *data);
+struct hashtable_node *hashtable_find(struct hashtable *table, const void *data, uint32_t hash);
+int hashtable_add(struct hashtable *table, struct hashtable_node *n, uint32_t hash);
 void hashtable_del(struct hashtable *table, struct hashtable_node *node);
+void hashtable_rehash(struct hashtable *table, unsigned int steps);
 int hashtable_flush(struct hashtable *table);
 int hashtable_iterate(struct hashtable *table, void *data,
 		      int (*iterate)(void *data, void *n));
 int hashtable_iterate_limit(struct hashtable *table, void *data, uint32_t from, uint32_t steps, int (*iterate)(void *data1, void *n));
 unsigned int hashtable_counter(const struct hashtable *table);
+uint32_t hashtable_buckets(const struct hashtable *table);
+uint32_t hashtable_generation(const struct hashtable *table);
+void hashtable_stats(const struct hashtable *table,
+		     struct hashtable_stats *stats);
 
 #endif
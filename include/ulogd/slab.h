@@ -0,0 +1,33 @@
+#ifndef _ULOGD_SLAB_H_
+#define _ULOGD_SLAB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "linuxlist.h"
+
+struct slab_chunk;
+
+/* fixed-size object allocator: objects are carved out of chunks mapped
+ * from the system, chunks that become empty are given back to it */
+struct slab {
+	size_t objsize;			/* including the chunk back-pointer */
+	size_t chunk_size;		/* mapped bytes per chunk */
+	uint32_t per_chunk;		/* objects per chunk */
+	uint32_t limit;			/* maximum objects in use, or 0 */
+
+	uint32_t count;			/* objects in use */
+	uint32_t chunks;		/* chunks mapped */
+
+	struct llist_head partial;	/* chunks with free objects */
+	struct llist_head full;
+	struct slab_chunk *spare;	/* one empty chunk kept around */
+};
+
+struct slab *slab_create(size_t objsize, uint32_t per_chunk, uint32_t limit);
+struct slab *slab_create_table(size_t objsize, int limit, int size);
+void slab_destroy(struct slab *s);
+void *slab_alloc(struct slab *s);
+void slab_free(struct slab *s, void *obj);
+size_t slab_mapped(const struct slab *s);
+
+#endif
@@ -6,12 +6,16 @@
 
 #include <sys/time.h>
 
+struct ulogd_pluginstance;
+
 struct ulogd_timer {
 	struct rb_node		node;
 	struct llist_head	list;
 	struct timeval		tv;
 	void			*data;
 	void			(*cb)(struct ulogd_timer *a, void *data);
+	/* set by ulogd_init_timer() */
+	struct ulogd_pluginstance *owner;
 };
 
 void ulogd_init_timer(struct ulogd_timer *t,
@@ -56,10 +56,14 @@
 #define ULOGD_RETF_FREE		0x0002	/* ptr needs to be free()d */
 #define ULOGD_RETF_NEEDED	0x0004	/* this parameter is actually needed
 					 * by some downstream plugin */
+#define ULOGD_RETF_PAYLOAD	0x0008	/* some downstream plugin reads more
+					 * than the packet headers from it */
 
 #define ULOGD_KEYF_OPTIONAL	0x0100	/* this key is optional */
 #define ULOGD_KEYF_INACTIVE	0x0200	/* marked as inactive (i.e. totally
 					   to be ignored by everyone */
+#define ULOGD_KEYF_HEADERS	0x0400	/* only the protocol headers of the
+					   packet behind it are read */
 
 
 /* maximum length of ulogd key */
@@ -119,6 +123,20 @@ struct ulogd_key {
 		} value;
 		struct ulogd_key *source;
 	} u;
+
+	/* dirty list of the owning stack, maintained by the core */
+	struct ulogd_keylog *dirty;
+	/* index of the sink input fed by this output key, or -1 */
+	int sink_idx;
+};
+
+/* output keys of a stack that became valid since the last cleanup */
+struct ulogd_keylog {
+	struct ulogd_key **keys;
+	unsigned int num;
+	unsigned int size;
+	/* more keys were set than fit in, clean up the whole stack */
+	int overflow;
 };
 
 struct ulogd_keyset {
@@ -130,46 +148,60 @@ struct ulogd_keyset {
 	unsigned int type;
 };
 
+/* mark key as valid and remember it for ulogd_clean_results() */
+static inline void okey_set_valid(struct ulogd_key *key)
+{
+	if (!(key->flags & ULOGD_RETF_VALID) && key->dirty) {
+		struct ulogd_keylog *log = key->dirty;
+
+		if (log->num < log->size)
+			log->keys[log->num++] = key;
+		else
+			log->overflow = 1;
+	}
+	key->flags |= ULOGD_RETF_VALID;
+}
+
 static inline void okey_set_b(struct ulogd_key *key, uint8_t value)
 {
 	key->u.value.b = value;
-	key->flags |= ULOGD_RETF_VALID;
+	okey_set_valid(key);
 }
 
 static inline void okey_set_u8(struct ulogd_key *key, uint8_t value)
 {
 	key->u.value.ui8 = value;
-	key->flags |= ULOGD_RETF_VALID;
+	okey_set_valid(key);
 }
 
 static inline void okey_set_u16(struct ulogd_key *key, uint16_t value)
 {
 	key->u.value.ui16 = value;
-	key->flags |= ULOGD_RETF_VALID;
+	okey_set_valid(key);
 }
 
 static inline void okey_set_u32(struct ulogd_key *key, uint32_t value)
 {
 	key->u.value.ui32 = value;
-	key->flags |= ULOGD_RETF_VALID;
+	okey_set_valid(key);
 }
 
 static inline void okey_set_u64(struct ulogd_key *key, uint64_t value)
 {
 	key->u.value.ui64 = value;
-	key->flags |= ULOGD_RETF_VALID;
+	okey_set_valid(key);
 }
 
 static inline void okey_set_u128(struct ulogd_key *key, const void *value)
 {
 	memcpy(key->u.value.ui128, value, 16);
-	key->flags |= ULOGD_RETF_VALID;
+	okey_set_valid(key);
 }
 
 static inline void okey_set_ptr(struct ulogd_key *key, void *value)
 {
 	key->u.value.ptr = value;
-	key->flags |= ULOGD_RETF_VALID;
+	okey_set_valid(key);
 }
 
 static inline uint8_t ikey_get_u8(struct ulogd_key *key)
@@ -229,6 +261,12 @@ struct ulogd_plugin {
 
 	/* function to call for each packet */
 	int (*interp)(struct ulogd_pluginstance *instance);
+	/* optional, sinks only: called once for a batch of records pushed
+	 * by ulogd_propagate_batch() instead of interp() for each of them.
+	 * records[i] is a copy of the resolved input keys of record i,
+	 * indexed like instance->input.keys. */
+	int (*interp_batch)(struct ulogd_pluginstance *instance,
+			    struct ulogd_key **records, unsigned int num);
 
 	int (*configure)(struct ulogd_pluginstance *instance,
 			 struct ulogd_pluginstance_stack *stack);
@@ -252,6 +290,8 @@ struct ulogd_plugin {
 #define ULOGD_IRET_STOP		-2
 #define ULOGD_IRET_OK		0
 
+struct ulogd_async;
+
 /* an instance of a plugin, element in a stack */
 struct ulogd_pluginstance {
 	/* local list of plugins in this stack */
@@ -270,16 +310,31 @@ struct ulogd_pluginstance {
 	struct ulogd_keyset output;
 	/* per-instance config parameters (array) */
 	struct config_keyset *config_kset;
+	/* sinks only: bitmap of the input keys valid for the current
+	 * record, see ulogd_for_each_valid_input() */
+	uint64_t *input_valid;
+	/* sinks only: queue to the thread running interp, if async */
+	struct ulogd_async *async;
 	/* private data */
 	char private[0];
 };
 
+struct ulogd_batch;
+struct ulogd_plan;
+struct ulogd_worker;
+
 struct ulogd_pluginstance_stack {
 	/* global list of pluginstance stacks */
 	struct llist_head stack_list;
 	/* list of plugins in this stack */
 	struct llist_head list;
 	char *name;
+	/* flat execution plan, compiled once the stack is started */
+	struct ulogd_plan *plan;
+	/* staging area for sinks implementing interp_batch */
+	struct ulogd_batch *batch;
+	/* thread running the plugins after the source, if stack_threads */
+	struct ulogd_worker *worker;
 };
 
 /***********************************************************************
@@ -288,6 +343,45 @@ struct ulogd_pluginstance_stack {
 
 void ulogd_propagate_results(struct ulogd_pluginstance *pi);
 
+/* propagate the output keys of filter pi through the rest of its stack,
+ * for filters emitting records of their own, from a timer for instance */
+void ulogd_propagate_from(struct ulogd_pluginstance *pi);
+
+/* initialize a record for ulogd_propagate_batch(): an array of
+ * pi->output.num_keys keys laid out like the plugin's output keys */
+void ulogd_init_record(struct ulogd_pluginstance *pi, struct ulogd_key *rec);
+
+/* set the output keys of pi to the valid values of rec, which may also be
+ * the output keys of another instance of the same plugin */
+void ulogd_load_record(struct ulogd_pluginstance *pi, struct ulogd_key *rec);
+
+/* propagate num records through the stack of pi in one go. Values are
+ * owned by the caller and must stay valid until this returns. */
+void ulogd_propagate_batch(struct ulogd_pluginstance *pi,
+			   struct ulogd_key **records, unsigned int num);
+
+/* A source reading on threads of its own hands its records over to the
+ * main loop through a feed, one per producing thread. The main loop runs
+ * them through the stacks of pi and of the instances sharing it. */
+struct ulogd_feed;
+struct ulogd_feed *ulogd_feed_create(struct ulogd_pluginstance *pi,
+				     unsigned int kbytes);
+/* called by the producing thread, rec was set up by ulogd_init_record().
+ * The values are copied and rec is cleaned. Returns -1 if the queue was
+ * full and the record dropped. */
+int ulogd_feed_push(struct ulogd_feed *feed, struct ulogd_key *rec);
+/* the producing thread has to be gone already */
+void ulogd_feed_destroy(struct ulogd_feed *feed);
+
+/* called by the main loop around the callbacks of the plugin instance
+ * owning a descriptor or timer. With stack_threads or an async sink,
+ * this serializes them against the thread running pi. */
+struct ulogd_pluginstance *ulogd_callback_enter(struct ulogd_pluginstance *pi);
+void ulogd_callback_leave(struct ulogd_pluginstance *pi,
+			  struct ulogd_pluginstance *prev);
+/* plugin instance the main loop is currently running code for */
+struct ulogd_pluginstance *ulogd_callback_owner(void);
+
 /* register a new interpreter plugin */
 void ulogd_register_plugin(struct ulogd_plugin *me);
 
@@ -304,7 +398,7 @@ void __ulogd_log(int level, char *file, int line, const char *message, ...)
 #define ulogd_error(format, args...) ulogd_log(ULOGD_ERROR, format, ## args)
 
 #define IS_VALID(x)	((x).flags & ULOGD_RETF_VALID)
-#define SET_VALID(x)	(x.flags |= ULOGD_RETF_VALID)
+#define SET_VALID(x)	okey_set_valid(&(x))
 #define IS_NEEDED(x)	(x.flags & ULOGD_RETF_NEEDED)
 #define SET_NEEDED(x)	(x.flags |= ULOGD_RETF_NEEDED)
 
@@ -312,6 +406,49 @@ void __ulogd_log(int level, char *file, int line, const char *message, ...)
 #define pp_is_valid(res, x)	\
 	(res[x].u.source && (GET_FLAGS(res, x) & ULOGD_RETF_VALID))
 
+/* is input key i of sink pi valid for the current record? */
+static inline int ulogd_input_valid(const struct ulogd_pluginstance *pi,
+				    unsigned int i)
+{
+	if (pi->input_valid)
+		return (pi->input_valid[i / 64] >> (i % 64)) & 1;
+
+	return pp_is_valid(pi->input.keys, i);
+}
+
+/* index of the first valid input key of sink pi at or after i, or -1 */
+static inline int ulogd_next_valid_input(const struct ulogd_pluginstance *pi,
+					 unsigned int i)
+{
+	unsigned int words = (pi->input.num_keys + 63) / 64;
+	unsigned int w = i / 64;
+	uint64_t bits;
+
+	if (!pi->input_valid) {
+		for (; i < pi->input.num_keys; i++) {
+			if (pp_is_valid(pi->input.keys, i))
+				return i;
+		}
+		return -1;
+	}
+
+	if (w >= words)
+		return -1;
+
+	bits = pi->input_valid[w] & (~0ULL << (i % 64));
+	while (!bits) {
+		if (++w >= words)
+			return -1;
+		bits = pi->input_valid[w];
+	}
+	return w * 64 + __builtin_ctzll(bits);
+}
+
+/* iterate over the valid input keys of sink pi, i is an int */
+#define ulogd_for_each_valid_input(pi, i)			\
+	for (i = ulogd_next_valid_input(pi, 0); i >= 0;		\
+	     i = ulogd_next_valid_input(pi, i + 1))
+
 int ulogd_key_size(struct ulogd_key *key);
 int ulogd_wildcard_inputkeys(struct ulogd_pluginstance *upi);
 
@@ -322,6 +459,8 @@ int ulogd_wildcard_inputkeys(struct ulogd_pluginstance *upi);
 #define ULOGD_FD_READ	0x0001
 #define ULOGD_FD_WRITE	0x0002
 #define ULOGD_FD_EXCEPT	0x0004
+#define ULOGD_FD_DRAIN	0x0008	/* callback reads until EAGAIN, may be
+				 * armed edge-triggered */
 
 struct ulogd_fd {
 	struct llist_head list;
@@ -329,10 +468,12 @@ struct ulogd_fd {
 	unsigned int when;
 	int (*cb)(int fd, unsigned int what, void *data);
 	void *data;			/* void * to pass to callback */
+	struct ulogd_pluginstance *owner; /* set by ulogd_register_fd() */
 };
 
 int ulogd_register_fd(struct ulogd_fd *ufd);
 void ulogd_unregister_fd(struct ulogd_fd *ufd);
+void ulogd_select_edge_triggered(int enable);
 int ulogd_select_main(struct timeval *tv);
 
 /***********************************************************************
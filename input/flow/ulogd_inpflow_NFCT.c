@@ -29,17 +29,34 @@
  * 	  network wide connection hash table.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	/* pthread_setaffinity_np(), recvmmsg() */
+#endif
+
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <time.h>
+#include <linux/netlink.h>
+#include <linux/filter.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <ulogd/linuxlist.h>
 #include <ulogd/jhash.h>
 #include <ulogd/hash.h>
+#include <ulogd/slab.h>
 
 #include <ulogd/ulogd.h>
 #include <ulogd/timer.h>
@@ -54,23 +71,151 @@
 
 typedef enum TIMES_ { START, STOP, __TIME_MAX } TIMES;
 
+/* what identifies a flow, packed so that it is hashed and compared as a
+ * whole.  IPv4 addresses use the first word of the IPv6 ones. */
+struct ct_tuple {
+	uint32_t orig_src[4];
+	uint32_t orig_dst[4];
+	uint32_t repl_src[4];
+	uint32_t repl_dst[4];
+	uint16_t orig_sport;		/* ICMP id */
+	uint16_t orig_dport;		/* ICMP type and code */
+	uint16_t repl_sport;
+	uint16_t repl_dport;
+	uint16_t zone;
+	uint8_t family;
+	uint8_t l4proto;
+};
+
+struct ct_key {
+	uint32_t hash;			/* of tuple */
+	struct ct_tuple tuple;
+};
+
+struct ct_counters {
+	uint64_t orig_packets;
+	uint64_t orig_bytes;
+	uint64_t repl_packets;
+	uint64_t repl_bytes;
+};
+
+/* a flow in the hash, with what is needed to log it once it is found
+ * gone from the kernel */
 struct ct_timestamp {
 	struct hashtable_node hashnode;
+	struct ct_key key;
+	uint32_t id;
+	uint32_t mark;
+	uint32_t gen;			/* of the last dump it was seen in */
+	struct ct_counters cnt;
+	/* logged by active_timeout records already, and time[START] is
+	 * that of the last one */
+	struct ct_counters exported;
 	struct timeval time[__TIME_MAX];
-	struct nf_conntrack *ct;
 };
 
-struct nfct_pluginstance {
+/* maximum number of records propagated in one batch */
+#define NFCT_BATCH_MAX	64
+
+/* buckets swept per main loop iteration after a full dump */
+#define NFCT_SWEEP_STEPS	4096
+
+/* maximum number of events handled per wakeup */
+#define NFCT_READ_BUDGET_DEFAULT	64
+
+/* number of events fetched by one recvmmsg() call, and the size of the
+ * buffer of each (as in libnfnetlink) */
+#define NFCT_RECV_BATCH		8
+#define NFCT_MSG_BUFSIZ		8192
+
+/* dumps of the overrun handle */
+enum {
+	NFCT_DUMP_NONE,
+	NFCT_DUMP_RESYNC,	/* after an overrun, the table is rebuilt */
+	NFCT_DUMP_ACTIVE,	/* active_timeout, counters refreshed */
+	NFCT_DUMP_DRAIN,	/* failed, the rest of it is ignored */
+};
+
+/* maximum value of event_sockets */
+#define NFCT_SOCKETS_MAX	64
+
+/* receive buffers of the main loop, and of each reader thread */
+struct nfct_rbuf {
+	struct mmsghdr msgs[NFCT_RECV_BATCH];
+	struct iovec iov[NFCT_RECV_BATCH];
+	struct sockaddr_nl peer[NFCT_RECV_BATCH];
+	unsigned char buf[NFCT_RECV_BATCH][NFCT_MSG_BUFSIZ];
+};
+
+/* an event socket, with several of them each only gets the events of
+ * the flows whose original tuple hashes to its partition, and is read
+ * by a thread of its own */
+struct nfct_socket {
 	struct nfct_handle *cth;
+	struct ulogd_fd fd;
+	struct ulogd_pluginstance *upi;
+	int nlbufsiz;			/* current netlink buffer size */
+	/* with several sockets */
+	pthread_t thread;
+	int stop_fd;
+	int cpu;
+	struct nfct_rbuf *rb;
+	struct ulogd_key *rec;
+	struct ulogd_feed *feed;
+};
+
+/* the flows of the hash, split by partition with several event sockets:
+ * a reader thread then only touches the shard of its socket, and the
+ * main loop locks a shard to dump, sweep or save its flows */
+struct ct_shard {
+	pthread_mutex_t lock;
+	struct hashtable *ct_active;
+	struct slab *ts_slab;		/* entries of ct_active */
+	uint64_t ct_dropped;		/* flows not tracked, table full */
+};
+
+struct nfct_pluginstance {
+	struct nfct_socket *socks;	/* event sockets */
+	unsigned int num_socks;
 	struct nfct_handle *ovh;	/* overrun handler */
-	struct nfct_handle *pgh;	/* purge handler */
-	struct ulogd_fd nfct_fd;
+	struct nfct_handle *pgh;	/* polling */
 	struct ulogd_fd nfct_ov;
+	struct ulogd_fd ov_notify;	/* overruns seen by reader threads */
 	struct ulogd_timer timer;
 	struct ulogd_timer ov_timer;	/* overrun retry timer */
-	struct hashtable *ct_active;
-	int nlbufsiz;			/* current netlink buffer size */
+	struct ct_shard *shards;
+	unsigned int num_shards;
+	/* entries not seen since the last full dump are destroyed a few
+	 * buckets at a time, one shard after the other. gen only changes
+	 * with all the shards locked. */
+	uint32_t gen;
+	struct ulogd_timer sweep_timer;
+	unsigned int sweep_shard;
+	uint32_t sweep_pos;
+	uint32_t sweep_end;
+	uint32_t sweep_gen;		/* of the table, see sweep_timer_cb */
+	struct llist_head swept;	/* unlinked, to log once unlocked */
+	/* flows of a snapshot found ended at start, logged by the sweep */
+	struct ct_timestamp **ended;
+	unsigned int num_ended;
+	/* in event mode, active_timeout dumps the table periodically to
+	 * refresh the counters of the flows due and log them */
+	struct ulogd_timer active_timer;
+	struct timeval active_now;	/* time of the last dump */
+	int ov_dump;			/* NFCT_DUMP_*, running on ovh */
+	struct timeval poll_now;	/* time of the running dump */
+	int restoring;			/* no poll since the snapshot */
 	struct nf_conntrack *ct;
+	struct nf_conntrack *purge_ct;	/* rebuilt from a ct_timestamp */
+	struct nf_conntrack *blank_ct;	/* never set, to reset purge_ct */
+	/* records of a counter dump not yet propagated, and the objects
+	 * their NFCT_CT keys point to */
+	struct ulogd_key *records[NFCT_BATCH_MAX];
+	struct nf_conntrack *batch_ct[NFCT_BATCH_MAX];
+	struct ulogd_key *keys;
+	unsigned int batch_len;
+	/* receive buffers of the main loop */
+	struct nfct_rbuf rb;
 };
 
 #define HTABLE_SIZE	(8192)
@@ -78,7 +223,7 @@ struct nfct_pluginstance {
 #define EVENT_MASK	NF_NETLINK_CONNTRACK_NEW | NF_NETLINK_CONNTRACK_DESTROY
 
 static struct config_keyset nfct_kset = {
-	.num_ces = 12,
+	.num_ces = 21,
 	.ces = {
 		{
 			.key	 = "pollinterval",
@@ -149,6 +294,60 @@ static struct config_keyset nfct_kset = {
 			.type	 = CONFIG_TYPE_STRING,
 			.options = CONFIG_OPT_NONE,
 		},
+		{
+			.key	 = "read_budget",
+			.type	 = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = NFCT_READ_BUDGET_DEFAULT,
+		},
+		{
+			.key	 = "read_budget_usec",
+			.type	 = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 0,
+		},
+		{
+			.key	 = "hash_open_addressing",
+			.type	 = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 0,
+		},
+		{
+			.key	 = "active_timeout",
+			.type	 = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 0,
+		},
+		{
+			.key	 = "event_sockets",
+			.type	 = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 1,
+		},
+		{
+			.key	 = "hash_snapshot",
+			.type	 = CONFIG_TYPE_STRING,
+			.options = CONFIG_OPT_NONE,
+			.u.string = "",
+		},
+		{
+			.key	 = "poll_deltas",
+			.type	 = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 0,
+		},
+		{
+			.key	 = "reader_cpu",
+			.type	 = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = -1,
+		},
+		{
+			.key	 = "reader_queue_size",
+			.type	 = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 4096,
+		},
 	},
 };
 #define pollint_ce(x)	(x->ces[0])
@@ -163,6 +362,15 @@ static struct config_keyset nfct_kset = {
 #define src_filter_ce(x)	((x)->ces[9])
 #define dst_filter_ce(x)	((x)->ces[10])
 #define proto_filter_ce(x)	((x)->ces[11])
+#define read_budget_ce(x)	((x)->ces[12])
+#define read_budget_usec_ce(x)	((x)->ces[13])
+#define openaddr_ce(x)		((x)->ces[14])
+#define active_timeout_ce(x)	((x)->ces[15])
+#define event_sockets_ce(x)	((x)->ces[16])
+#define snapshot_ce(x)		((x)->ces[17])
+#define polldeltas_ce(x)	((x)->ces[18])
+#define reader_cpu_ce(x)	((x)->ces[19])
+#define reader_queue_size_ce(x)	((x)->ces[20])
 
 enum nfct_keys {
 	NFCT_ORIG_IP_SADDR = 0,
@@ -419,88 +627,203 @@ static struct ulogd_key nfct_okeys[] = {
 	},
 };
 
-static uint32_t
-__hash4(const struct nf_conntrack *ct, const struct hashtable *table)
+static void get_addr6(const struct nf_conntrack *ct, int attr, uint32_t *addr)
+{
+	const void *p = nfct_get_attr(ct, attr);
+
+	if (p)
+		memcpy(addr, p, sizeof(uint32_t) * 4);
+}
+
+static void ct_key_build(struct ct_key *k, const struct nf_conntrack *ct)
 {
-	unsigned int a, b;
+	struct ct_tuple *t = &k->tuple;
 
-	a = jhash(nfct_get_attr(ct, ATTR_ORIG_IPV4_SRC), sizeof(uint32_t),
-		  ((nfct_get_attr_u8(ct, ATTR_ORIG_L3PROTO) << 16) |
-		   (nfct_get_attr_u8(ct, ATTR_ORIG_L4PROTO))));
+	memset(k, 0, sizeof(*k));
+	t->family = nfct_get_attr_u8(ct, ATTR_L3PROTO);
+	t->l4proto = nfct_get_attr_u8(ct, ATTR_L4PROTO);
+
+	switch (t->family) {
+	case AF_INET:
+		t->orig_src[0] = nfct_get_attr_u32(ct, ATTR_ORIG_IPV4_SRC);
+		t->orig_dst[0] = nfct_get_attr_u32(ct, ATTR_ORIG_IPV4_DST);
+		t->repl_src[0] = nfct_get_attr_u32(ct, ATTR_REPL_IPV4_SRC);
+		t->repl_dst[0] = nfct_get_attr_u32(ct, ATTR_REPL_IPV4_DST);
+		break;
+	case AF_INET6:
+		get_addr6(ct, ATTR_ORIG_IPV6_SRC, t->orig_src);
+		get_addr6(ct, ATTR_ORIG_IPV6_DST, t->orig_dst);
+		get_addr6(ct, ATTR_REPL_IPV6_SRC, t->repl_src);
+		get_addr6(ct, ATTR_REPL_IPV6_DST, t->repl_dst);
+		break;
+	}
 
-	b = jhash(nfct_get_attr(ct, ATTR_ORIG_IPV4_DST), sizeof(uint32_t),
-		  ((nfct_get_attr_u16(ct, ATTR_ORIG_PORT_SRC) << 16) |
-		   (nfct_get_attr_u16(ct, ATTR_ORIG_PORT_DST))));
+	switch (t->l4proto) {
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		t->orig_sport = nfct_get_attr_u16(ct, ATTR_ICMP_ID);
+		t->orig_dport = nfct_get_attr_u8(ct, ATTR_ICMP_TYPE) << 8 |
+				nfct_get_attr_u8(ct, ATTR_ICMP_CODE);
+		break;
+	default:
+		t->orig_sport = nfct_get_attr_u16(ct, ATTR_ORIG_PORT_SRC);
+		t->orig_dport = nfct_get_attr_u16(ct, ATTR_ORIG_PORT_DST);
+		t->repl_sport = nfct_get_attr_u16(ct, ATTR_REPL_PORT_SRC);
+		t->repl_dport = nfct_get_attr_u16(ct, ATTR_REPL_PORT_DST);
+		break;
+	}
+	t->zone = nfct_get_attr_u16(ct, ATTR_ZONE);
 
-	/*
-	 * Instead of returning hash % table->hashsize (implying a divide)
-	 * we return the high 32 bits of the (hash * table->hashsize) that will
-	 * give results between [0 and hashsize-1] and same hash distribution,
-	 * but using a multiply, less expensive than a divide. See:
-	 * http://www.mail-archive.com/netdev@vger.kernel.org/msg56623.html
-	 */
-	return ((uint64_t)jhash_2words(a, b, 0) * table->hashsize) >> 32;
+	k->hash = jhash2((uint32_t *)t, sizeof(*t) / sizeof(uint32_t), 0);
 }
 
-static uint32_t
-__hash6(const struct nf_conntrack *ct, const struct hashtable *table)
+/* the partition of the flow, as computed by build_part_prog() from the
+ * event: the addresses and ports of the original tuple, folded */
+static unsigned int ct_part(const struct ct_tuple *t, unsigned int num)
 {
-	unsigned int a, b;
+	int i, words = t->family == AF_INET6 ? 4 : 1;
+	uint32_t h = 0;
 
-	a = jhash(nfct_get_attr(ct, ATTR_ORIG_IPV6_SRC), sizeof(uint32_t)*4,
-		  ((nfct_get_attr_u8(ct, ATTR_ORIG_L3PROTO) << 16) |
-		   (nfct_get_attr_u8(ct, ATTR_ORIG_L4PROTO))));
+	for (i = 0; i < words; i++)
+		h ^= ntohl(t->orig_src[i]) ^ ntohl(t->orig_dst[i]);
+	/* the ICMP id and type are no ports to the kernel */
+	if (t->l4proto != IPPROTO_ICMP && t->l4proto != IPPROTO_ICMPV6)
+		h ^= (uint32_t)ntohs(t->orig_sport) << 16 |
+		     ntohs(t->orig_dport);
 
-	b = jhash(nfct_get_attr(ct, ATTR_ORIG_IPV6_DST), sizeof(uint32_t)*4,
-		  ((nfct_get_attr_u16(ct, ATTR_ORIG_PORT_SRC) << 16) |
-		   (nfct_get_attr_u16(ct, ATTR_ORIG_PORT_DST))));
+	return ((uint32_t)(h * 0x9e3779b1) >> 16) % num;
+}
 
-	return ((uint64_t)jhash_2words(a, b, 0) * table->hashsize) >> 32;
+/* the shard holding the flow of key k */
+static struct ct_shard *ct_shard(struct nfct_pluginstance *cpi,
+				 const struct ct_key *k)
+{
+	if (cpi->num_shards == 1)
+		return &cpi->shards[0];
+	return &cpi->shards[ct_part(&k->tuple, cpi->num_shards)];
 }
 
-static uint32_t hash(const void *data, const struct hashtable *table)
+/* keep what fill_ct() needs to log the flow without its conntrack */
+static void ct_entry_update(struct ct_timestamp *ts,
+			    const struct nf_conntrack *ct)
 {
-	int ret = 0;
-	const struct nf_conntrack *ct = data;
+	ts->id = nfct_get_attr_u32(ct, ATTR_ID);
+	ts->mark = nfct_get_attr_u32(ct, ATTR_MARK);
+	/* events without counters don't reset them */
+	if (nfct_attr_is_set(ct, ATTR_ORIG_COUNTER_PACKETS) <= 0)
+		return;
+	ts->cnt.orig_packets = nfct_get_attr_u64(ct, ATTR_ORIG_COUNTER_PACKETS);
+	ts->cnt.orig_bytes = nfct_get_attr_u64(ct, ATTR_ORIG_COUNTER_BYTES);
+	ts->cnt.repl_packets = nfct_get_attr_u64(ct, ATTR_REPL_COUNTER_PACKETS);
+	ts->cnt.repl_bytes = nfct_get_attr_u64(ct, ATTR_REPL_COUNTER_BYTES);
+}
 
-	switch(nfct_get_attr_u8(ct, ATTR_L3PROTO)) {
-		case AF_INET:
-			ret = __hash4(ct, table);
-			break;
-		case AF_INET6:
-			ret = __hash6(ct, table);
-			break;
-		default:
-			break;
+/* the reverse of ct_key_build() and ct_entry_update(), to log the
+ * flow.  ct starts over from blank, it is only ever set here and holds
+ * no allocated attribute that the copy would leak. */
+static void ct_entry_to_ct(struct nf_conntrack *ct,
+			   const struct nf_conntrack *blank,
+			   const struct ct_timestamp *ts)
+{
+	const struct ct_tuple *t = &ts->key.tuple;
+
+	nfct_copy(ct, blank, NFCT_CP_OVERRIDE);
+
+	nfct_set_attr_u8(ct, ATTR_ORIG_L3PROTO, t->family);
+	nfct_set_attr_u8(ct, ATTR_REPL_L3PROTO, t->family);
+	nfct_set_attr_u8(ct, ATTR_ORIG_L4PROTO, t->l4proto);
+	nfct_set_attr_u8(ct, ATTR_REPL_L4PROTO, t->l4proto);
+
+	switch (t->family) {
+	case AF_INET:
+		nfct_set_attr_u32(ct, ATTR_ORIG_IPV4_SRC, t->orig_src[0]);
+		nfct_set_attr_u32(ct, ATTR_ORIG_IPV4_DST, t->orig_dst[0]);
+		nfct_set_attr_u32(ct, ATTR_REPL_IPV4_SRC, t->repl_src[0]);
+		nfct_set_attr_u32(ct, ATTR_REPL_IPV4_DST, t->repl_dst[0]);
+		break;
+	case AF_INET6:
+		nfct_set_attr(ct, ATTR_ORIG_IPV6_SRC, t->orig_src);
+		nfct_set_attr(ct, ATTR_ORIG_IPV6_DST, t->orig_dst);
+		nfct_set_attr(ct, ATTR_REPL_IPV6_SRC, t->repl_src);
+		nfct_set_attr(ct, ATTR_REPL_IPV6_DST, t->repl_dst);
+		break;
 	}
 
-	return ret;
+	switch (t->l4proto) {
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		nfct_set_attr_u16(ct, ATTR_ICMP_ID, t->orig_sport);
+		nfct_set_attr_u8(ct, ATTR_ICMP_TYPE, t->orig_dport >> 8);
+		nfct_set_attr_u8(ct, ATTR_ICMP_CODE, t->orig_dport & 0xff);
+		break;
+	default:
+		nfct_set_attr_u16(ct, ATTR_ORIG_PORT_SRC, t->orig_sport);
+		nfct_set_attr_u16(ct, ATTR_ORIG_PORT_DST, t->orig_dport);
+		nfct_set_attr_u16(ct, ATTR_REPL_PORT_SRC, t->repl_sport);
+		nfct_set_attr_u16(ct, ATTR_REPL_PORT_DST, t->repl_dport);
+		break;
+	}
+	if (t->zone)
+		nfct_set_attr_u16(ct, ATTR_ZONE, t->zone);
+
+	nfct_set_attr_u32(ct, ATTR_ID, ts->id);
+	nfct_set_attr_u32(ct, ATTR_MARK, ts->mark);
+	nfct_set_attr_u64(ct, ATTR_ORIG_COUNTER_PACKETS, ts->cnt.orig_packets);
+	nfct_set_attr_u64(ct, ATTR_ORIG_COUNTER_BYTES, ts->cnt.orig_bytes);
+	nfct_set_attr_u64(ct, ATTR_REPL_COUNTER_PACKETS, ts->cnt.repl_packets);
+	nfct_set_attr_u64(ct, ATTR_REPL_COUNTER_BYTES, ts->cnt.repl_bytes);
+}
+
+static uint32_t hash(const void *data, const struct hashtable *table)
+{
+	const struct ct_key *k = data;
+
+	return k->hash;
 }
 
+/* the table has compared the hashes already */
 static int compare(const void *data1, const void *data2)
 {
 	const struct ct_timestamp *u1 = data1;
-	const struct nf_conntrack *ct = data2;
+	const struct ct_key *k = data2;
 
-	return nfct_cmp(u1->ct, ct, NFCT_CMP_ORIG | NFCT_CMP_REPL);
+	return memcmp(&u1->key.tuple, &k->tuple, sizeof(k->tuple)) == 0;
 }
 
-/* only the main_upi plugin instance contains the correct private data. */
-static int propagate_ct(struct ulogd_pluginstance *main_upi,
-			struct ulogd_pluginstance *upi,
-			struct nf_conntrack *ct,
-			int type,
-			struct ct_timestamp *ts)
+/* counters are zeroed by NFCT_Q_DUMP_RESET */
+static inline uint64_t counter_since(uint64_t now, uint64_t base)
 {
-	struct ulogd_key *ret = upi->output.keys;
-	struct nfct_pluginstance *cpi =
-			(struct nfct_pluginstance *) main_upi->private;
+	return now >= base ? now - base : now;
+}
+
+/* the tuple of these protocols has port numbers */
+static inline int l4_has_ports(uint8_t proto)
+{
+	switch (proto) {
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+	case IPPROTO_UDPLITE:
+	case IPPROTO_SCTP:
+	case IPPROTO_DCCP:
+		return 1;
+	}
+	return 0;
+}
+
+/* fill all keys but NFCT_CT from the conntrack object, reading each of
+ * its attributes once */
+static void fill_ct(struct ulogd_key *ret, struct nf_conntrack *ct,
+		    int type, struct ct_timestamp *ts)
+{
+	uint8_t family = nfct_get_attr_u8(ct, ATTR_L3PROTO);
+	uint8_t orig_l4 = nfct_get_attr_u8(ct, ATTR_ORIG_L4PROTO);
+	uint8_t repl_l4 = nfct_get_attr_u8(ct, ATTR_REPL_L4PROTO);
 
 	okey_set_u32(&ret[NFCT_CT_EVENT], type);
-	okey_set_u8(&ret[NFCT_OOB_FAMILY], nfct_get_attr_u8(ct, ATTR_L3PROTO));
+	okey_set_u8(&ret[NFCT_OOB_FAMILY], family);
 	okey_set_u8(&ret[NFCT_OOB_PROTOCOL], 0); /* FIXME */
 
-	switch (nfct_get_attr_u8(ct, ATTR_L3PROTO)) {
+	switch (family) {
 	case AF_INET:
 		okey_set_u32(&ret[NFCT_ORIG_IP_SADDR],
 			     nfct_get_attr_u32(ct, ATTR_ORIG_IPV4_SRC));
@@ -523,52 +846,43 @@ static int propagate_ct(struct ulogd_pluginstance *main_upi,
 		break;
 	default:
 		ulogd_log(ULOGD_NOTICE, "Unknown protocol family (%d)\n",
-			  nfct_get_attr_u8(ct, ATTR_L3PROTO));
+			  family);
 	}
-	okey_set_u8(&ret[NFCT_ORIG_IP_PROTOCOL],
-		    nfct_get_attr_u8(ct, ATTR_ORIG_L4PROTO));
-	okey_set_u8(&ret[NFCT_REPLY_IP_PROTOCOL],
-		    nfct_get_attr_u8(ct, ATTR_REPL_L4PROTO));
+	okey_set_u8(&ret[NFCT_ORIG_IP_PROTOCOL], orig_l4);
+	okey_set_u8(&ret[NFCT_REPLY_IP_PROTOCOL], repl_l4);
 
-	switch (nfct_get_attr_u8(ct, ATTR_ORIG_L4PROTO)) {
-	case IPPROTO_TCP:
-	case IPPROTO_UDP:
-	case IPPROTO_UDPLITE:
-	case IPPROTO_SCTP:
-	case IPPROTO_DCCP:
+	if (l4_has_ports(orig_l4)) {
 		okey_set_u16(&ret[NFCT_ORIG_L4_SPORT],
 			     htons(nfct_get_attr_u16(ct, ATTR_ORIG_PORT_SRC)));
 		okey_set_u16(&ret[NFCT_ORIG_L4_DPORT],
 			     htons(nfct_get_attr_u16(ct, ATTR_ORIG_PORT_DST)));
-		break;
-	case IPPROTO_ICMP:
+	} else if (orig_l4 == IPPROTO_ICMP) {
 		okey_set_u16(&ret[NFCT_ICMP_CODE],
 			     nfct_get_attr_u8(ct, ATTR_ICMP_CODE));
 		okey_set_u16(&ret[NFCT_ICMP_TYPE],
 			     nfct_get_attr_u8(ct, ATTR_ICMP_TYPE));
-		break;
 	}
 
-	switch (nfct_get_attr_u8(ct, ATTR_REPL_L4PROTO)) {
-	case IPPROTO_TCP:
-	case IPPROTO_UDP:
-	case IPPROTO_UDPLITE:
-	case IPPROTO_SCTP:
-	case IPPROTO_DCCP:
+	if (l4_has_ports(repl_l4)) {
 		okey_set_u16(&ret[NFCT_REPLY_L4_SPORT],
 			     htons(nfct_get_attr_u16(ct, ATTR_REPL_PORT_SRC)));
 		okey_set_u16(&ret[NFCT_REPLY_L4_DPORT],
 			     htons(nfct_get_attr_u16(ct, ATTR_REPL_PORT_DST)));
 	}
 
+	/* what active_timeout records haven't counted yet */
 	okey_set_u64(&ret[NFCT_ORIG_RAW_PKTLEN],
-		     nfct_get_attr_u64(ct, ATTR_ORIG_COUNTER_BYTES));
+		     counter_since(nfct_get_attr_u64(ct, ATTR_ORIG_COUNTER_BYTES),
+				   ts ? ts->exported.orig_bytes : 0));
 	okey_set_u64(&ret[NFCT_ORIG_RAW_PKTCOUNT],
-		     nfct_get_attr_u64(ct, ATTR_ORIG_COUNTER_PACKETS));
+		     counter_since(nfct_get_attr_u64(ct, ATTR_ORIG_COUNTER_PACKETS),
+				   ts ? ts->exported.orig_packets : 0));
 	okey_set_u64(&ret[NFCT_REPLY_RAW_PKTLEN],
-		     nfct_get_attr_u64(ct, ATTR_REPL_COUNTER_BYTES));
+		     counter_since(nfct_get_attr_u64(ct, ATTR_REPL_COUNTER_BYTES),
+				   ts ? ts->exported.repl_bytes : 0));
 	okey_set_u64(&ret[NFCT_REPLY_RAW_PKTCOUNT],
-		     nfct_get_attr_u64(ct, ATTR_REPL_COUNTER_PACKETS));
+		     counter_since(nfct_get_attr_u64(ct, ATTR_REPL_COUNTER_PACKETS),
+				   ts ? ts->exported.repl_packets : 0));
 
 	okey_set_u32(&ret[NFCT_CT_MARK], nfct_get_attr_u32(ct, ATTR_MARK));
 	okey_set_u32(&ret[NFCT_CT_ID], nfct_get_attr_u32(ct, ATTR_ID));
@@ -587,10 +901,18 @@ static int propagate_ct(struct ulogd_pluginstance *main_upi,
 				     ts->time[STOP].tv_usec);
 		}
 	}
-	okey_set_ptr(&ret[NFCT_CT], cpi->ct);
+}
 
-	ulogd_propagate_results(upi);
+static int ct_needed(struct ulogd_pluginstance *upi)
+{
+	struct ulogd_pluginstance *npi;
 
+	if (upi->output.keys[NFCT_CT].flags & ULOGD_RETF_NEEDED)
+		return 1;
+	llist_for_each_entry(npi, &upi->plist, plist) {
+		if (npi->output.keys[NFCT_CT].flags & ULOGD_RETF_NEEDED)
+			return 1;
+	}
 	return 0;
 }
 
@@ -603,22 +925,60 @@ do_propagate_ct(struct ulogd_pluginstance *upi,
 	struct ulogd_pluginstance *npi = NULL;
 	struct nfct_pluginstance *cpi =
 			(struct nfct_pluginstance *) upi->private;
+	struct ulogd_key *ret = upi->output.keys;
 
 	/* we copy the conntrack object to the plugin cache.
 	 * Thus, we only copy the object once, then it is used 
 	 * by the several output plugin instance that reference 
-	 * it by means of a pointer. */
-	nfct_copy(cpi->ct, ct, NFCT_CP_OVERRIDE);
+	 * it by means of a pointer.  Nobody may read it though. */
+	if (ct_needed(upi)) {
+		nfct_copy(cpi->ct, ct, NFCT_CP_OVERRIDE);
+		ct = cpi->ct;
+	}
+
+	fill_ct(ret, ct, type, ts);
+	okey_set_ptr(&ret[NFCT_CT], ct);
 
 	/* since we support the re-use of one instance in
 	 * several different stacks, we duplicate the message
-	 * to let them know */
+	 * to let them know, the keys are only filled once */
 	llist_for_each_entry(npi, &upi->plist, plist) {
-		if (propagate_ct(upi, npi, ct, type, ts) != 0)
-			break;
+		ulogd_load_record(npi, ret);
+		ulogd_propagate_results(npi);
 	}
 
-	propagate_ct(upi, upi, ct, type, ts);
+	ulogd_propagate_results(upi);
+}
+
+/* log the flow of an event: from a reader thread, the record is handed
+ * over to the main loop, without the ct key */
+static void emit_ct(struct nfct_socket *sock, struct nf_conntrack *ct,
+		    int type, struct ct_timestamp *ts)
+{
+	if (sock->feed) {
+		fill_ct(sock->rec, ct, type, ts);
+		ulogd_feed_push(sock->feed, sock->rec);
+	} else
+		do_propagate_ct(sock->upi, ct, type, ts);
+}
+
+static void do_propagate_batch(struct ulogd_pluginstance *upi)
+{
+	struct ulogd_pluginstance *npi = NULL;
+	struct nfct_pluginstance *cpi =
+			(struct nfct_pluginstance *) upi->private;
+	unsigned int i;
+
+	if (cpi->batch_len == 0)
+		return;
+
+	llist_for_each_entry(npi, &upi->plist, plist)
+		ulogd_propagate_batch(npi, cpi->records, cpi->batch_len);
+
+	ulogd_propagate_batch(upi, cpi->records, cpi->batch_len);
+	for (i = 0; i < cpi->batch_len; i++)
+		nfct_destroy(cpi->batch_ct[i]);
+	cpi->batch_len = 0;
 }
 
 static int set_timestamp_from_ct_try(struct ct_timestamp *ts,
@@ -648,77 +1008,110 @@ static void set_timestamp_from_ct(struct ct_timestamp *ts,
 		gettimeofday(&ts->time[name], NULL);
 }
 
+/* look the flow of key @k up in its locked shard @sh, and mark it as
+ * alive */
+static struct ct_timestamp *ct_lookup(struct nfct_pluginstance *cpi,
+				      struct ct_shard *sh,
+				      const struct ct_key *k)
+{
+	struct ct_timestamp *ts;
+
+	ts = (struct ct_timestamp *)hashtable_find(sh->ct_active, k, k->hash);
+	if (ts)
+		ts->gen = cpi->gen;
+	return ts;
+}
+
+/* add the flow of key @k to its locked shard @sh, NULL if it is full */
+static struct ct_timestamp *ct_add(struct nfct_pluginstance *cpi,
+				   struct ct_shard *sh,
+				   const struct ct_key *k,
+				   struct nf_conntrack *ct)
+{
+	struct ct_timestamp *ts;
+
+	ts = slab_alloc(sh->ts_slab);
+	if (ts == NULL)
+		goto err;
+
+	ts->key = *k;
+	ts->gen = cpi->gen;
+	ct_entry_update(ts, ct);
+	set_timestamp_from_ct(ts, ct, START);
+	if (hashtable_add(sh->ct_active, &ts->hashnode, k->hash) < 0) {
+		slab_free(sh->ts_slab, ts);
+		goto err;
+	}
+	return ts;
+
+err:
+	if (sh->ct_dropped++ == 0)
+		ulogd_log(ULOGD_ERROR, "NFCT: cannot track more than %u "
+			  "flows, consider rising `hash_max_entries'\n",
+			  hashtable_counter(sh->ct_active) * cpi->num_shards);
+	return NULL;
+}
+
+/* the key of the flow of @ct, and its shard, locked */
+static struct ct_shard *ct_shard_lock(struct nfct_pluginstance *cpi,
+				      struct ct_key *k,
+				      const struct nf_conntrack *ct)
+{
+	struct ct_shard *sh;
+
+	ct_key_build(k, ct);
+	sh = ct_shard(cpi, k);
+	pthread_mutex_lock(&sh->lock);
+	return sh;
+}
+
 static int
 event_handler_hashtable(enum nf_conntrack_msg_type type,
 			struct nf_conntrack *ct, void *data)
 {
-	struct ulogd_pluginstance *upi = data;
+	struct nfct_socket *sock = data;
 	struct nfct_pluginstance *cpi =
-				(struct nfct_pluginstance *) upi->private;
+			(struct nfct_pluginstance *) sock->upi->private;
 	struct ct_timestamp *ts;
-	int ret, id;
+	struct ct_shard *sh;
+	struct ct_key k;
 
 	switch(type) {
 	case NFCT_T_NEW:
-		ts = calloc(sizeof(struct ct_timestamp), 1);
-		if (ts == NULL)
-			return NFCT_CB_CONTINUE;
-
-		ts->ct = ct;
-
-		set_timestamp_from_ct(ts, ct, START);
-		id = hashtable_hash(cpi->ct_active, ct);
-		ret = hashtable_add(cpi->ct_active, &ts->hashnode, id);
-		if (ret < 0) {
-			free(ts);
-			return NFCT_CB_CONTINUE;
-		}
-		return NFCT_CB_STOLEN;
+		sh = ct_shard_lock(cpi, &k, ct);
+		ct_add(cpi, sh, &k, ct);
+		break;
 	case NFCT_T_UPDATE:
-		id = hashtable_hash(cpi->ct_active, ct);
-		ts = (struct ct_timestamp *)
-			hashtable_find(cpi->ct_active, ct, id);
+		sh = ct_shard_lock(cpi, &k, ct);
+		ts = ct_lookup(cpi, sh, &k);
 		if (ts)
-			nfct_copy(ts->ct, ct, NFCT_CP_META);
-		else {
-			ts = calloc(sizeof(struct ct_timestamp), 1);
-			if (ts == NULL)
-				return NFCT_CB_CONTINUE;
-
-			ts->ct = ct;
-			set_timestamp_from_ct(ts, ct, START);
-			ret = hashtable_add(cpi->ct_active, &ts->hashnode, id);
-			if (ret < 0) {
-				free(ts);
-				return NFCT_CB_CONTINUE;
-			}
-			return NFCT_CB_STOLEN;
-		}
+			ct_entry_update(ts, ct);
+		else
+			ct_add(cpi, sh, &k, ct);
 		break;
 	case NFCT_T_DESTROY:
-		id = hashtable_hash(cpi->ct_active, ct);
-		ts = (struct ct_timestamp *)
-			hashtable_find(cpi->ct_active, ct, id);
+		sh = ct_shard_lock(cpi, &k, ct);
+		ts = ct_lookup(cpi, sh, &k);
 		if (ts) {
 			set_timestamp_from_ct(ts, ct, STOP);
-			do_propagate_ct(upi, ct, type, ts);
-			hashtable_del(cpi->ct_active, &ts->hashnode);
-			nfct_destroy(ts->ct);
-			free(ts);
+			emit_ct(sock, ct, type, ts);
+			hashtable_del(sh->ct_active, &ts->hashnode);
+			slab_free(sh->ts_slab, ts);
 		} else {
-			struct ct_timestamp tmp = {
-				.ct = ct,
-			};
+			struct ct_timestamp tmp;
+
+			memset(&tmp, 0, sizeof(tmp));
 			set_timestamp_from_ct(&tmp, ct, STOP);
 			tmp.time[START].tv_sec = 0;
 			tmp.time[START].tv_usec = 0;
-			do_propagate_ct(upi, ct, type, &tmp);
+			emit_ct(sock, ct, type, &tmp);
 		}
 		break;
 	default:
 		ulogd_log(ULOGD_NOTICE, "unknown netlink message type\n");
-		break;
+		return NFCT_CB_CONTINUE;
 	}
+	pthread_mutex_unlock(&sh->lock);
 
 	return NFCT_CB_CONTINUE;
 }
@@ -727,11 +1120,10 @@ static int
 event_handler_no_hashtable(enum nf_conntrack_msg_type type,
 			   struct nf_conntrack *ct, void *data)
 {
-	struct ulogd_pluginstance *upi = data;
-	struct ct_timestamp tmp = {
-		.ct = ct,
-	};
+	struct nfct_socket *sock = data;
+	struct ct_timestamp tmp;
 
+	memset(&tmp, 0, sizeof(tmp));
 	switch(type) {
 	case NFCT_T_NEW:
 		set_timestamp_from_ct(&tmp, ct, START);
@@ -749,10 +1141,34 @@ event_handler_no_hashtable(enum nf_conntrack_msg_type type,
 		ulogd_log(ULOGD_NOTICE, "unsupported message type\n");
 		return NFCT_CB_CONTINUE;
 	}
-	do_propagate_ct(upi, ct, type, &tmp);
+	emit_ct(sock, ct, type, &tmp);
 	return NFCT_CB_CONTINUE;
 }
 
+/* ct_lookup() for the first dump after a snapshot was loaded: an entry
+ * whose tuple got reused by another flow while we weren't running is
+ * that of an ended flow, queued for the sweep to log it */
+static struct ct_timestamp *restore_lookup(struct nfct_pluginstance *cpi,
+					   struct ct_shard *sh,
+					   const struct ct_key *k,
+					   struct nf_conntrack *ct)
+{
+	struct ct_timestamp *ts, **ended;
+
+	ts = ct_lookup(cpi, sh, k);
+	if (ts == NULL || ts->id == nfct_get_attr_u32(ct, ATTR_ID))
+		return ts;
+
+	hashtable_del(sh->ct_active, &ts->hashnode);
+	ended = realloc(cpi->ended, (cpi->num_ended + 1) * sizeof(*ended));
+	if (ended) {
+		cpi->ended = ended;
+		cpi->ended[cpi->num_ended++] = ts;
+	} else
+		slab_free(sh->ts_slab, ts);
+	return NULL;
+}
+
 static int
 polling_handler(enum nf_conntrack_msg_type type,
 		struct nf_conntrack *ct, void *data)
@@ -761,30 +1177,30 @@ polling_handler(enum nf_conntrack_msg_type type,
 	struct nfct_pluginstance *cpi =
 				(struct nfct_pluginstance *) upi->private;
 	struct ct_timestamp *ts;
-	int ret, id;
+	struct ct_shard *sh;
+	struct ct_key k;
 
 	switch(type) {
 	case NFCT_T_UPDATE:
-		id = hashtable_hash(cpi->ct_active, ct);
-		ts = (struct ct_timestamp *)
-			hashtable_find(cpi->ct_active, ct, id);
+		sh = ct_shard_lock(cpi, &k, ct);
+		if (cpi->restoring)
+			ts = restore_lookup(cpi, sh, &k, ct);
+		else
+			ts = ct_lookup(cpi, sh, &k);
 		if (ts)
-			nfct_copy(ts->ct, ct, NFCT_CP_META);
-		else {
-			ts = calloc(sizeof(struct ct_timestamp), 1);
-			if (ts == NULL)
-				return NFCT_CB_CONTINUE;
-
-			ts->ct = ct;
-			set_timestamp_from_ct(ts, ct, START);
-
-			ret = hashtable_add(cpi->ct_active, &ts->hashnode, id);
-			if (ret < 0) {
-				free(ts);
-				return NFCT_CB_CONTINUE;
-			}
-			return NFCT_CB_STOLEN;
+			ct_entry_update(ts, ct);
+		else
+			ts = ct_add(cpi, sh, &k, ct);
+		/* idle flows cost no record */
+		if (ts && polldeltas_ce(upi->config_kset).u.value &&
+		    memcmp(&ts->cnt, &ts->exported, sizeof(ts->cnt)) != 0) {
+			ts->time[STOP] = cpi->poll_now;
+			do_propagate_ct(upi, ct, NFCT_T_UPDATE, ts);
+			ts->exported = ts->cnt;
+			ts->time[START] = ts->time[STOP];
+			timerclear(&ts->time[STOP]);
 		}
+		pthread_mutex_unlock(&sh->lock);
 		break;
 	default:
 		ulogd_log(ULOGD_NOTICE, "unknown netlink message type\n");
@@ -794,14 +1210,13 @@ polling_handler(enum nf_conntrack_msg_type type,
 	return NFCT_CB_CONTINUE;
 }
 
-static int setnlbufsiz(struct ulogd_pluginstance *upi, int size)
+static int setnlbufsiz(struct nfct_socket *sock, int size)
 {
-	struct nfct_pluginstance *cpi =
-			(struct nfct_pluginstance *)upi->private;
+	struct ulogd_pluginstance *upi = sock->upi;
 	static int warned = 0;
 
 	if (size < nlsockbufmaxsize_ce(upi->config_kset).u.value) {
-		cpi->nlbufsiz = nfnl_rcvbufsiz(nfct_nfnlh(cpi->cth), size);
+		sock->nlbufsiz = nfnl_rcvbufsiz(nfct_nfnlh(sock->cth), size);
 		return 1;
 	}
 
@@ -814,141 +1229,528 @@ static int setnlbufsiz(struct ulogd_pluginstance *upi, int size)
 				"reached. Please, consider rising "
 				"`netlink_socket_buffer_size` and "
 				"`netlink_socket_buffer_maxsize` "
-				"clauses.\n", cpi->nlbufsiz);
+				"clauses.\n", sock->nlbufsiz);
 	return 0;
 }
 
-static int read_cb_nfct(int fd, unsigned int what, void *param)
+/* schedule a resynchronization in N seconds, this parameter is
+ * configurable via config. Note that we don't re-schedule a resync if
+ * it's already in progress. */
+static void schedule_resync(struct ulogd_pluginstance *upi)
 {
-	struct nfct_pluginstance *cpi = (struct nfct_pluginstance *) param;
-	struct ulogd_pluginstance *upi = container_of(param,
-						      struct ulogd_pluginstance,
-						      private);
-	static int warned = 0;
+	struct nfct_pluginstance *cpi =
+			(struct nfct_pluginstance *) upi->private;
+
+	if (!ulogd_timer_pending(&cpi->ov_timer))
+		ulogd_add_timer(&cpi->ov_timer,
+				nlresynctimeout_ce(upi->config_kset).u.value);
+}
+
+/* a reader thread lost events */
+static int read_cb_notify(int fd, unsigned int what, void *param)
+{
+	struct ulogd_pluginstance *upi = param;
+	uint64_t n;
 
 	if (!(what & ULOGD_FD_READ))
 		return 0;
 
-	if (nfct_catch(cpi->cth) == -1) {
-		if (errno == ENOBUFS) {
-			if (nlsockbufmaxsize_ce(upi->config_kset).u.value) {
-				int s = cpi->nlbufsiz * 2;
-				if (setnlbufsiz(upi, s)) {
-					ulogd_log(ULOGD_NOTICE,
-						  "We are losing events, "
-						  "increasing buffer size "
-						  "to %d\n", cpi->nlbufsiz);
-				}
-			} else if (!warned) {
-				warned = 1;
-				ulogd_log(ULOGD_NOTICE,
-					  "We are losing events. Please, "
-					  "consider using the clauses "
-					  "`netlink_socket_buffer_size' and "
-					  "`netlink_socket_buffer_maxsize'\n");
-			}
+	if (read(fd, &n, sizeof(n)) == sizeof(n))
+		schedule_resync(upi);
+	return 0;
+}
 
-			/* internal hash can deal with refresh */
-			if (usehash_ce(upi->config_kset).u.value != 0) {
-				/* schedule a resynchronization in N
-				 * seconds, this parameter is configurable
-				 * via config. Note that we don't re-schedule
-				 * a resync if it's already in progress. */
-				if (!ulogd_timer_pending(&cpi->ov_timer)) {
-					ulogd_add_timer(&cpi->ov_timer,
-							nlresynctimeout_ce(upi->config_kset).u.value);
-				}
-			}
+static void nfct_recv_error(struct nfct_socket *sock)
+{
+	struct ulogd_pluginstance *upi = sock->upi;
+	struct nfct_pluginstance *cpi =
+			(struct nfct_pluginstance *) upi->private;
+	static int warned = 0;
+
+	if (errno != ENOBUFS)
+		return;
+
+	if (nlsockbufmaxsize_ce(upi->config_kset).u.value) {
+		int s = sock->nlbufsiz * 2;
+		if (setnlbufsiz(sock, s)) {
+			ulogd_log(ULOGD_NOTICE,
+				  "We are losing events, "
+				  "increasing buffer size "
+				  "to %d\n", sock->nlbufsiz);
 		}
+	} else if (!warned) {
+		warned = 1;
+		ulogd_log(ULOGD_NOTICE,
+			  "We are losing events. Please, "
+			  "consider using the clauses "
+			  "`netlink_socket_buffer_size' and "
+			  "`netlink_socket_buffer_maxsize'\n");
 	}
 
-	return 0;
+	/* internal hash can deal with refresh */
+	if (usehash_ce(upi->config_kset).u.value != 0) {
+		/* the timers belong to the main loop */
+		if (sock->feed) {
+			uint64_t one = 1;
+
+			if (write(cpi->ov_notify.fd, &one, sizeof(one)) < 0)
+				ulogd_log(ULOGD_ERROR, "NFCT: cannot report "
+					  "overrun: %s\n", strerror(errno));
+		} else
+			schedule_resync(upi);
+	}
 }
 
-static int do_free(void *data1, void *data2)
+static uint64_t now_usec(void)
 {
-	struct ct_timestamp *ts = data2;
-	nfct_destroy(ts->ct);
-	free(ts);
-	return 0;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
+/* read the events of sock into rb.  nfct_catch() would loop until the
+ * socket is empty, we rather handle at most `read_budget' events per
+ * wakeup and for at most `read_budget_usec', so that other sockets get
+ * their turn */
+static void nfct_read(struct nfct_socket *sock, struct nfct_rbuf *rb)
+{
+	struct ulogd_pluginstance *upi = sock->upi;
+	unsigned int budget = read_budget_ce(upi->config_kset).u.value;
+	int usec = read_budget_usec_ce(upi->config_kset).u.value;
+	uint64_t deadline = 0;
+	unsigned int done = 0;
+
+	if (budget == 0)
+		budget = 1;
+	if (usec > 0)
+		deadline = now_usec() + usec;
+
+	while (done < budget) {
+		unsigned int want = budget - done;
+		int i, n;
+
+		if (want > NFCT_RECV_BATCH)
+			want = NFCT_RECV_BATCH;
+		for (i = 0; i < (int)want; i++)
+			rb->msgs[i].msg_hdr.msg_namelen = sizeof(rb->peer[i]);
+
+		n = recvmmsg(sock->fd.fd, rb->msgs, want, MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != ENOBUFS)
+				break;
+			nfct_recv_error(sock);
+			done++;
+			continue;
+		}
+
+		for (i = 0; i < n; i++) {
+			/* like nfnl_recv(), only accept messages from
+			 * the kernel */
+			if (rb->msgs[i].msg_hdr.msg_flags & MSG_TRUNC ||
+			    rb->peer[i].nl_pid != 0)
+				continue;
+			nfnl_process(nfct_nfnlh(sock->cth), rb->buf[i],
+				     rb->msgs[i].msg_len);
+		}
+		done += n;
+
+		if ((unsigned int)n < want)
+			break;
+		if (deadline && now_usec() >= deadline)
+			break;
+	}
+}
 
-static int do_purge(void *data1, void *data2)
+static int read_cb_nfct(int fd, unsigned int what, void *param)
 {
-	int ret;
-	struct ulogd_pluginstance *upi = data1;
-	struct ct_timestamp *ts = data2;
+	struct nfct_socket *sock = param;
 	struct nfct_pluginstance *cpi =
-				(struct nfct_pluginstance *) upi->private;
+			(struct nfct_pluginstance *) sock->upi->private;
 
-	/* if it is not in kernel anymore, purge it */
-	ret = nfct_query(cpi->pgh, NFCT_Q_GET, ts->ct);
-	if (ret == -1 && errno == ENOENT) {
-		do_propagate_ct(upi, ts->ct, NFCT_T_DESTROY, ts);
-		hashtable_del(cpi->ct_active, &ts->hashnode);
-		nfct_destroy(ts->ct);
-		free(ts);
-	}
+	if (!(what & ULOGD_FD_READ))
+		return 0;
 
+	nfct_read(sock, &cpi->rb);
 	return 0;
 }
 
+/* reader thread of an event socket, with several of them */
+static void *nfct_reader(void *data)
+{
+	struct nfct_socket *sock = data;
+	struct pollfd pfd[2] = {
+		{ .fd = sock->fd.fd, .events = POLLIN },
+		{ .fd = sock->stop_fd, .events = POLLIN },
+	};
+
+	if (sock->cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(sock->cpu, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			ulogd_log(ULOGD_ERROR, "NFCT: can't pin reader to "
+				  "CPU %d\n", sock->cpu);
+	}
+
+	while (1) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			ulogd_log(ULOGD_ERROR, "NFCT: poll on event socket: "
+				  "%s\n", strerror(errno));
+			break;
+		}
+		if (pfd[1].revents)
+			break;
+		if (pfd[0].revents)
+			nfct_read(sock, sock->rb);
+	}
+
+	return NULL;
+}
+
+static int do_free(void *data1, void *data2)
+{
+	struct ct_shard *sh = data1;
+
+	slab_free(sh->ts_slab, data2);
+	return 0;
+}
+
+
+/* is the flow due for an active_timeout record, active_timeout seconds
+ * after its last one? It is then copied to @rec as of the last dump, to
+ * be logged once its shard is unlocked, and accounted as logged. */
+static int active_due(struct ulogd_pluginstance *upi,
+		      struct ct_timestamp *ts, struct ct_timestamp *rec)
+{
+	struct nfct_pluginstance *cpi =
+				(struct nfct_pluginstance *) upi->private;
+	int timeout = active_timeout_ce(upi->config_kset).u.value;
+
+	if (timeout <= 0 ||
+	    cpi->active_now.tv_sec - ts->time[START].tv_sec < timeout)
+		return 0;
+
+	ts->time[STOP] = cpi->active_now;
+	*rec = *ts;
+
+	ts->exported = ts->cnt;
+	ts->time[START] = ts->time[STOP];
+	timerclear(&ts->time[STOP]);
+	return 1;
+}
+
+/* log what the flow did since its last record */
+static void active_export(struct ulogd_pluginstance *upi,
+			  struct ct_timestamp *rec)
+{
+	struct nfct_pluginstance *cpi =
+				(struct nfct_pluginstance *) upi->private;
+
+	ct_entry_to_ct(cpi->purge_ct, cpi->blank_ct, rec);
+	do_propagate_ct(upi, cpi->purge_ct, NFCT_T_UPDATE, rec);
+}
+
+static int do_sweep(void *data1, void *data2)
+{
+	struct ulogd_pluginstance *upi = data1;
+	struct ct_timestamp *ts = data2, rec;
+	struct nfct_pluginstance *cpi =
+				(struct nfct_pluginstance *) upi->private;
+
+	/* not in the kernel anymore */
+	if (ts->gen != cpi->gen) {
+		hashtable_del(cpi->shards[cpi->sweep_shard].ct_active,
+			      &ts->hashnode);
+		llist_add_tail(&ts->hashnode.head, &cpi->swept);
+		return 0;
+	}
+
+	/* the poll refreshed its counters, in event mode the dump logged
+	 * the flows due already. There are no reader threads to stall. */
+	if (cpi->pgh && active_due(upi, ts, &rec))
+		active_export(upi, &rec);
+	return 0;
+}
+
+/* log the flows of the snapshot found ended, then sweep a slice of the
+ * current shard: the flows gone are unlinked under its lock, and logged
+ * once it is released */
+static void sweep_timer_cb(struct ulogd_timer *t, void *data)
+{
+	struct ulogd_pluginstance *upi = data;
+	struct nfct_pluginstance *cpi =
+			(struct nfct_pluginstance *)upi->private;
+	struct ct_timestamp *ts, *tmp;
+	struct ct_shard *sh;
+
+	while (cpi->num_ended > 0) {
+		ts = cpi->ended[--cpi->num_ended];
+
+		ct_entry_to_ct(cpi->purge_ct, cpi->blank_ct, ts);
+		do_propagate_ct(upi, cpi->purge_ct, NFCT_T_DESTROY, ts);
+		sh = ct_shard(cpi, &ts->key);
+		pthread_mutex_lock(&sh->lock);
+		slab_free(sh->ts_slab, ts);
+		pthread_mutex_unlock(&sh->lock);
+	}
+	free(cpi->ended);
+	cpi->ended = NULL;
+
+	if (cpi->sweep_shard >= cpi->num_shards)
+		return;
+	sh = &cpi->shards[cpi->sweep_shard];
+
+	pthread_mutex_lock(&sh->lock);
+	/* positions change when the table is resized, start over: the
+	 * entries swept already are alive, sweeping them again is harmless */
+	if (cpi->sweep_pos == 0 ||
+	    hashtable_generation(sh->ct_active) != cpi->sweep_gen) {
+		cpi->sweep_pos = 0;
+		cpi->sweep_end = hashtable_buckets(sh->ct_active);
+		cpi->sweep_gen = hashtable_generation(sh->ct_active);
+	}
+	cpi->sweep_pos = hashtable_iterate_limit(sh->ct_active, upi,
+						 cpi->sweep_pos,
+						 NFCT_SWEEP_STEPS, do_sweep);
+	pthread_mutex_unlock(&sh->lock);
+
+	if (!llist_empty(&cpi->swept)) {
+		llist_for_each_entry(ts, &cpi->swept, hashnode.head) {
+			ct_entry_to_ct(cpi->purge_ct, cpi->blank_ct, ts);
+			do_propagate_ct(upi, cpi->purge_ct, NFCT_T_DESTROY,
+					ts);
+		}
+		pthread_mutex_lock(&sh->lock);
+		llist_for_each_entry_safe(ts, tmp, &cpi->swept,
+					  hashnode.head)
+			slab_free(sh->ts_slab, ts);
+		pthread_mutex_unlock(&sh->lock);
+		INIT_LLIST_HEAD(&cpi->swept);
+	}
+
+	if (cpi->sweep_pos >= cpi->sweep_end) {
+		cpi->sweep_shard++;
+		cpi->sweep_pos = 0;
+	}
+	if (cpi->sweep_shard < cpi->num_shards)
+		ulogd_add_timer(&cpi->sweep_timer, 0);
+}
+
+/* entries are marked as seen by the dump that follows */
+static void resync_begin(struct nfct_pluginstance *cpi)
+{
+	unsigned int i;
+
+	for (i = 0; i < cpi->num_shards; i++)
+		pthread_mutex_lock(&cpi->shards[i].lock);
+	cpi->gen++;
+	for (i = 0; i < cpi->num_shards; i++)
+		pthread_mutex_unlock(&cpi->shards[i].lock);
+	ulogd_del_timer(&cpi->sweep_timer);
+}
+
+/* the dump is complete, destroy the entries it didn't show */
+static void resync_end(struct nfct_pluginstance *cpi)
+{
+	gettimeofday(&cpi->active_now, NULL);
+	cpi->sweep_shard = 0;
+	cpi->sweep_pos = 0;
+	ulogd_add_timer(&cpi->sweep_timer, 0);
+}
+
+/* twice per active_timeout, refresh the counters with a dump, unless
+ * one is running already.  Flows missing from it are left to their
+ * destroy event, unlike after an overrun. */
+static void active_timer_cb(struct ulogd_timer *t, void *data)
+{
+	struct ulogd_pluginstance *upi = data;
+	struct nfct_pluginstance *cpi =
+			(struct nfct_pluginstance *)upi->private;
+	int timeout = active_timeout_ce(upi->config_kset).u.value;
+	int family = AF_UNSPEC;
+
+	if (cpi->ov_dump == NFCT_DUMP_NONE &&
+	    !ulogd_timer_pending(&cpi->ov_timer)) {
+		gettimeofday(&cpi->active_now, NULL);
+		if (nfct_send(cpi->ovh, NFCT_Q_DUMP, &family) != -1)
+			cpi->ov_dump = NFCT_DUMP_ACTIVE;
+	}
+	ulogd_add_timer(&cpi->active_timer, timeout > 1 ? timeout / 2 : 1);
+}
+
 static int overrun_handler(enum nf_conntrack_msg_type type,
 			   struct nf_conntrack *ct,
 			   void *data)
+{
+	struct ulogd_pluginstance *upi = data;
+	struct nfct_pluginstance *cpi =
+				(struct nfct_pluginstance *) upi->private;
+	struct ct_timestamp *ts, rec;
+	struct ct_shard *sh;
+	struct ct_key k;
+	int due = 0;
+
+	sh = ct_shard_lock(cpi, &k, ct);
+	ts = ct_lookup(cpi, sh, &k);
+	if (ts) {
+		ct_entry_update(ts, ct);
+		due = active_due(upi, ts, &rec);
+	} else if (cpi->ov_dump != NFCT_DUMP_ACTIVE) {
+		/* in an active dump, the events of the flows we don't
+		 * know are on their way */
+		ct_add(cpi, sh, &k, ct);
+	}
+	pthread_mutex_unlock(&sh->lock);
+
+	if (due)
+		active_export(upi, &rec);
+
+	return NFCT_CB_CONTINUE;
+}
+
+/* first dump after a snapshot was loaded: an entry of the snapshot with
+ * another conntrack id is a flow that ended while we were not running,
+ * and whose tuple has been reused since. It is logged with the others
+ * by the sweep, the stack isn't started yet. */
+static int restore_handler(enum nf_conntrack_msg_type type,
+			   struct nf_conntrack *ct,
+			   void *data)
 {
 	struct ulogd_pluginstance *upi = data;
 	struct nfct_pluginstance *cpi =
 				(struct nfct_pluginstance *) upi->private;
 	struct ct_timestamp *ts;
-	int id, ret;
+	struct ct_shard *sh;
+	struct ct_key k;
 
-	id = hashtable_hash(cpi->ct_active, ct);
-	ts = (struct ct_timestamp *)
-		hashtable_find(cpi->ct_active, ct, id);
-	if (ts == NULL) {
-		ts = calloc(sizeof(struct ct_timestamp), 1);
-		if (ts == NULL)
-			return NFCT_CB_CONTINUE;
+	sh = ct_shard_lock(cpi, &k, ct);
+	ts = restore_lookup(cpi, sh, &k, ct);
+	if (ts)
+		ct_entry_update(ts, ct);
+	else
+		ct_add(cpi, sh, &k, ct);
+	pthread_mutex_unlock(&sh->lock);
 
-		ts->ct = ct;
-		set_timestamp_from_ct(ts, ct, START);
+	return NFCT_CB_CONTINUE;
+}
 
-		ret = hashtable_add(cpi->ct_active, &ts->hashnode, id);
-		if (ret < 0) {
-			free(ts);
-			return NFCT_CB_CONTINUE;
-		}
-		return NFCT_CB_STOLEN;
+/* the dump on ovh is over, or failed: the rest of it, if any, is
+ * drained until its end */
+static void ov_dump_end(struct ulogd_pluginstance *upi, int ok)
+{
+	struct nfct_pluginstance *cpi =
+			(struct nfct_pluginstance *) upi->private;
+
+	if (cpi->ov_dump == NFCT_DUMP_RESYNC) {
+		if (ok)
+			resync_end(cpi);
+		/* the dump is incomplete, entries missing from it may
+		 * still be alive: try again */
+		else
+			schedule_resync(upi);
 	}
+	cpi->ov_dump = ok ? NFCT_DUMP_NONE : NFCT_DUMP_DRAIN;
+}
 
-	return NFCT_CB_CONTINUE;
+/* run the messages of a dump datagram through the callbacks of ovh */
+static void ov_dump_process(struct ulogd_pluginstance *upi,
+			    unsigned char *buf, int len)
+{
+	struct nfct_pluginstance *cpi =
+			(struct nfct_pluginstance *) upi->private;
+	struct nlmsghdr *nlh = (struct nlmsghdr *) buf;
+
+	for (; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+		switch (nlh->nlmsg_type) {
+		case NLMSG_DONE:
+			if (cpi->ov_dump != NFCT_DUMP_DRAIN)
+				ov_dump_end(upi, 1);
+			cpi->ov_dump = NFCT_DUMP_NONE;
+			return;
+		case NLMSG_ERROR:
+			/* ends the dump as well */
+			if (cpi->ov_dump != NFCT_DUMP_DRAIN)
+				ov_dump_end(upi, 0);
+			cpi->ov_dump = NFCT_DUMP_NONE;
+			return;
+		}
+		if (cpi->ov_dump != NFCT_DUMP_DRAIN)
+			nfnl_process(nfct_nfnlh(cpi->ovh),
+				     (unsigned char *) nlh, nlh->nlmsg_len);
+	}
 }
 
+/* nfct_catch() would read the whole dump at once, stalling the main
+ * loop on large tables: read it `read_budget' datagrams at a time, the
+ * events of the other sockets keep flowing meanwhile */
 static int read_cb_ovh(int fd, unsigned int what, void *param)
 {
 	struct nfct_pluginstance *cpi = (struct nfct_pluginstance *) param;
 	struct ulogd_pluginstance *upi = container_of(param,
 						      struct ulogd_pluginstance,
 						      private);
+	unsigned int budget = read_budget_ce(upi->config_kset).u.value;
+	int usec = read_budget_usec_ce(upi->config_kset).u.value;
+	uint64_t deadline = 0;
+	unsigned int done = 0;
 
 	if (!(what & ULOGD_FD_READ))
 		return 0;
 
-	/* handle the resync request, update our hashtable */
-	if (nfct_catch(cpi->ovh) == -1) {
-		/* enobufs in the overrun buffer? very rare */
-		if (errno == ENOBUFS) {
-			if (!ulogd_timer_pending(&cpi->ov_timer)) {
-				ulogd_add_timer(&cpi->ov_timer,
-						nlresynctimeout_ce(upi->config_kset).u.value);
+	if (budget == 0)
+		budget = 1;
+	if (usec > 0)
+		deadline = now_usec() + usec;
+
+	while (done < budget) {
+		unsigned int want = budget - done;
+		int i, n;
+
+		if (want > NFCT_RECV_BATCH)
+			want = NFCT_RECV_BATCH;
+		for (i = 0; i < (int)want; i++)
+			cpi->rb.msgs[i].msg_hdr.msg_namelen = sizeof(cpi->rb.peer[i]);
+
+		n = recvmmsg(fd, cpi->rb.msgs, want, MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			/* enobufs in the overrun buffer? very rare */
+			if (errno == ENOBUFS &&
+			    cpi->ov_dump != NFCT_DUMP_NONE &&
+			    cpi->ov_dump != NFCT_DUMP_DRAIN)
+				ov_dump_end(upi, 0);
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (cpi->rb.peer[i].nl_pid != 0)
+				continue;
+			/* a part of the dump is lost */
+			if (cpi->rb.msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				if (cpi->ov_dump != NFCT_DUMP_NONE &&
+				    cpi->ov_dump != NFCT_DUMP_DRAIN)
+					ov_dump_end(upi, 0);
+				continue;
 			}
+			if (cpi->ov_dump == NFCT_DUMP_NONE)
+				continue;
+			ov_dump_process(upi, cpi->rb.buf[i],
+					cpi->rb.msgs[i].msg_len);
 		}
-	}
+		done += n;
 
-	/* purge unexistent entries */
-	hashtable_iterate(cpi->ct_active, upi, do_purge);
+		if ((unsigned int)n < want)
+			break;
+		if (deadline && now_usec() >= deadline)
+			break;
+	}
 
 	return 0;
 }
@@ -960,55 +1762,77 @@ dump_reset_handler(enum nf_conntrack_msg_type type,
 	struct ulogd_pluginstance *upi = data;
 	struct nfct_pluginstance *cpi =
 			(struct nfct_pluginstance *)upi->private;
-	int ret = NFCT_CB_CONTINUE, rc, id;
-	struct ct_timestamp *ts;
+	struct ct_timestamp *ts = NULL;
+	struct ct_shard *sh = NULL;
+	struct ulogd_key *rec;
+	struct ct_key k;
 
 	switch(type) {
 	case NFCT_T_UPDATE:
-		id = hashtable_hash(cpi->ct_active, ct);
-		ts = (struct ct_timestamp *)
-			hashtable_find(cpi->ct_active, ct, id);
-		if (ts)
-			nfct_copy(ts->ct, ct, NFCT_CP_META);
-		else {
-			ts = calloc(sizeof(struct ct_timestamp), 1);
-			if (ts == NULL)
-				return NFCT_CB_CONTINUE;
-
-			ts->ct = ct;
-			set_timestamp_from_ct(ts, ct, START);
-
-			rc = hashtable_add(cpi->ct_active, &ts->hashnode, id);
-			if (rc < 0) {
-				free(ts);
-				return NFCT_CB_CONTINUE;
-			}
-			ret = NFCT_CB_STOLEN;
+		if (cpi->shards) {
+			sh = ct_shard_lock(cpi, &k, ct);
+			ts = ct_lookup(cpi, sh, &k);
+			if (ts)
+				ct_entry_update(ts, ct);
+			else
+				ts = ct_add(cpi, sh, &k, ct);
 		}
-		do_propagate_ct(upi, ct, type, ts);
-		break;
+		/* the records point to ct rather than to cpi->ct, it is
+		 * kept until the batch is propagated */
+		cpi->batch_ct[cpi->batch_len] = ct;
+		rec = cpi->records[cpi->batch_len++];
+		ulogd_init_record(upi, rec);
+		fill_ct(rec, ct, type, ts);
+		okey_set_ptr(&rec[NFCT_CT], ct);
+		/* the kernel counters start from zero again */
+		if (ts) {
+			memset(&ts->cnt, 0, sizeof(ts->cnt));
+			memset(&ts->exported, 0, sizeof(ts->exported));
+		}
+		if (sh)
+			pthread_mutex_unlock(&sh->lock);
+		if (cpi->batch_len == NFCT_BATCH_MAX)
+			do_propagate_batch(upi);
+		return NFCT_CB_STOLEN;
 	default:
 		ulogd_log(ULOGD_NOTICE, "unknown netlink message type\n");
 		break;
 	}
-	return ret;
+	return NFCT_CB_CONTINUE;
 }
 
 static void get_ctr_zero(struct ulogd_pluginstance *upi)
 {
+	struct nfct_pluginstance *cpi =
+			(struct nfct_pluginstance *)upi->private;
 	struct nfct_handle *h;
 	int family = AF_UNSPEC;
+	unsigned int i;
+
+	cpi->keys = calloc(NFCT_BATCH_MAX, sizeof(struct ulogd_key) *
+					   upi->output.num_keys);
+	if (cpi->keys == NULL) {
+		ulogd_log(ULOGD_FATAL, "Cannot dump and reset counters\n");
+		return;
+	}
+	for (i = 0; i < NFCT_BATCH_MAX; i++)
+		cpi->records[i] = &cpi->keys[i * upi->output.num_keys];
+	cpi->batch_len = 0;
 
 	h = nfct_open(CONNTRACK, 0);
 	if (h == NULL) {
 		ulogd_log(ULOGD_FATAL, "Cannot dump and reset counters\n");
-		return;
+		goto out;
 	}
 	nfct_callback_register(h, NFCT_T_ALL, &dump_reset_handler, upi);
 	if (nfct_query(h, NFCT_Q_DUMP_RESET, &family) == -1)
 		ulogd_log(ULOGD_FATAL, "Cannot dump and reset counters\n");
 
+	do_propagate_batch(upi);
 	nfct_close(h);
+out:
+	free(cpi->keys);
+	cpi->keys = NULL;
 }
 
 static void polling_timer_cb(struct ulogd_timer *t, void *data)
@@ -1018,8 +1842,12 @@ static void polling_timer_cb(struct ulogd_timer *t, void *data)
 			(struct nfct_pluginstance *)upi->private;
 	int family = AF_UNSPEC;
 
-	nfct_query(cpi->pgh, NFCT_Q_DUMP, &family);
-	hashtable_iterate(cpi->ct_active, upi, do_purge);
+	gettimeofday(&cpi->poll_now, NULL);
+	resync_begin(cpi);
+	if (nfct_query(cpi->pgh, NFCT_Q_DUMP, &family) == 0) {
+		resync_end(cpi);
+		cpi->restoring = 0;
+	}
 	ulogd_add_timer(&cpi->timer, pollint_ce(upi->config_kset).u.value);
 }
 
@@ -1042,7 +1870,15 @@ static void overrun_timeout(struct ulogd_timer *a, void *data)
 	struct nfct_pluginstance *cpi =
 			(struct nfct_pluginstance *)upi->private;
 
-	nfct_send(cpi->ovh, NFCT_Q_DUMP, &family);
+	/* one dump at a time on the handle */
+	if (cpi->ov_dump != NFCT_DUMP_NONE) {
+		ulogd_add_timer(&cpi->ov_timer, 1);
+		return;
+	}
+	resync_begin(cpi);
+	gettimeofday(&cpi->active_now, NULL);
+	if (nfct_send(cpi->ovh, NFCT_Q_DUMP, &family) != -1)
+		cpi->ov_dump = NFCT_DUMP_RESYNC;
 }
 
 
@@ -1222,13 +2058,12 @@ static int build_nfct_filter_proto(struct nfct_filter *filter, char* filter_stri
 }
 
 
-static int build_nfct_filter(struct ulogd_pluginstance *upi)
+static int build_nfct_filter(struct ulogd_pluginstance *upi,
+			     struct nfct_socket *sock)
 {
-	struct nfct_pluginstance *cpi =
-			(struct nfct_pluginstance *)upi->private;
 	struct nfct_filter *filter = NULL;
 
-	if (!cpi->cth) {
+	if (!sock->cth) {
 		ulogd_log(ULOGD_FATAL, "Refusing to attach NFCT filter to NULL handler\n");
 		goto err_init;
 	}
@@ -1265,7 +2100,7 @@ static int build_nfct_filter(struct ulogd_pluginstance *upi)
 	}
 
 	if (filter) {
-		if (nfct_filter_attach(nfct_fd(cpi->cth), filter) == -1) {
+		if (nfct_filter_attach(nfct_fd(sock->cth), filter) == -1) {
 			ulogd_log(ULOGD_FATAL, "nfct_filter_attach");
 		}
 
@@ -1281,91 +2116,776 @@ err_init:
 	return -1;
 }
 
-static int constructor_nfct_events(struct ulogd_pluginstance *upi)
+/* Kernel side partitioning of the events among the event sockets.
+ *
+ * The classic BPF program attached to each socket looks up the original
+ * tuple of the event with the netlink attribute extensions, folds its
+ * addresses and ports into a word, hashes it and only accepts the event
+ * if the hash falls into the partition of the socket. All the events of
+ * a flow thus land on the same socket, in order. Events without an
+ * original tuple go to the first socket. */
+
+#define NFCT_PART_INSNS		128
+
+/* scratch memory of the program */
+#define PART_M_ORIG	0	/* offset of CTA_TUPLE_ORIG */
+#define PART_M_NEST	1	/* offset of the nest being looked into */
+#define PART_M_HASH	2	/* folded tuple */
+#define PART_M_ATTR	3	/* offset of the attribute being folded */
+
+struct part_prog {
+	struct sock_filter insn[NFCT_PART_INSNS];
+	unsigned int len;
+	/* jumps to the end of the tuple, and to the fallback */
+	unsigned int to_hash[3], num_to_hash;
+	unsigned int to_fb[5], num_to_fb;
+};
+
+static void part_stmt(struct part_prog *p, uint16_t code, uint32_t k)
+{
+	struct sock_filter insn = BPF_STMT(code, k);
+
+	p->insn[p->len++] = insn;
+}
+
+/* A is the offset of a nest, or of the first top level attribute with
+ * SKF_AD_NLATTR. Leaves the offset of attribute type in A, and returns
+ * the index of the jump taken if it is missing. */
+static unsigned int part_find(struct part_prog *p, uint32_t ad, uint32_t type)
+{
+	struct sock_filter jeq = BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 0);
+
+	part_stmt(p, BPF_LDX | BPF_IMM, type);
+	part_stmt(p, BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + ad);
+	p->insn[p->len] = jeq;
+	return p->len++;
+}
+
+/* make the jump at index j land on the next instruction */
+static void part_label(struct part_prog *p, unsigned int j)
+{
+	p->insn[j].jt = p->len - j - 1;
+}
+
+/* xor the payload word at off of the attribute at A into the hash,
+ * shifted left by shift */
+static void part_fold(struct part_prog *p, uint16_t size, uint32_t off,
+		      uint32_t shift)
+{
+	part_stmt(p, BPF_LDX | BPF_MEM, PART_M_ATTR);
+	part_stmt(p, BPF_LD | size | BPF_IND, NLA_HDRLEN + off);
+	if (shift)
+		part_stmt(p, BPF_ALU | BPF_LSH | BPF_K, shift);
+	part_stmt(p, BPF_LDX | BPF_MEM, PART_M_HASH);
+	part_stmt(p, BPF_ALU | BPF_XOR | BPF_X, 0);
+	part_stmt(p, BPF_ST, PART_M_HASH);
+}
+
+static void build_part_prog(struct part_prog *p, unsigned int part,
+			    unsigned int num)
+{
+	struct sock_filter ja = BPF_JUMP(BPF_JMP | BPF_JA, 0, 0, 0);
+	struct sock_filter jpart = BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+					    part, 1, 0);
+	unsigned int v6, ports, i;
+
+	memset(p, 0, sizeof(*p));
+
+	part_stmt(p, BPF_LD | BPF_IMM, 0);
+	part_stmt(p, BPF_ST, PART_M_HASH);
+
+	/* addresses of the original direction */
+	part_stmt(p, BPF_LD | BPF_IMM,
+		  NLMSG_HDRLEN + NLMSG_ALIGN(sizeof(struct nfgenmsg)));
+	p->to_fb[p->num_to_fb++] = part_find(p, SKF_AD_NLATTR, CTA_TUPLE_ORIG);
+	part_stmt(p, BPF_ST, PART_M_ORIG);
+	p->to_fb[p->num_to_fb++] = part_find(p, SKF_AD_NLATTR_NEST,
+					     CTA_TUPLE_IP);
+	part_stmt(p, BPF_ST, PART_M_NEST);
+
+	v6 = part_find(p, SKF_AD_NLATTR_NEST, CTA_IP_V4_SRC);
+	part_stmt(p, BPF_ST, PART_M_ATTR);
+	part_fold(p, BPF_W, 0, 0);
+	part_stmt(p, BPF_LD | BPF_MEM, PART_M_NEST);
+	p->to_fb[p->num_to_fb++] = part_find(p, SKF_AD_NLATTR_NEST,
+					     CTA_IP_V4_DST);
+	part_stmt(p, BPF_ST, PART_M_ATTR);
+	part_fold(p, BPF_W, 0, 0);
+	ports = p->len;
+	p->insn[p->len++] = ja;
+
+	part_label(p, v6);
+	part_stmt(p, BPF_LD | BPF_MEM, PART_M_NEST);
+	p->to_fb[p->num_to_fb++] = part_find(p, SKF_AD_NLATTR_NEST,
+					     CTA_IP_V6_SRC);
+	part_stmt(p, BPF_ST, PART_M_ATTR);
+	for (i = 0; i < 4; i++)
+		part_fold(p, BPF_W, i * 4, 0);
+	part_stmt(p, BPF_LD | BPF_MEM, PART_M_NEST);
+	p->to_fb[p->num_to_fb++] = part_find(p, SKF_AD_NLATTR_NEST,
+					     CTA_IP_V6_DST);
+	part_stmt(p, BPF_ST, PART_M_ATTR);
+	for (i = 0; i < 4; i++)
+		part_fold(p, BPF_W, i * 4, 0);
+
+	/* ports, if the protocol has some */
+	p->insn[ports].k = p->len - ports - 1;
+	part_stmt(p, BPF_LD | BPF_MEM, PART_M_ORIG);
+	p->to_hash[p->num_to_hash++] = part_find(p, SKF_AD_NLATTR_NEST,
+						 CTA_TUPLE_PROTO);
+	part_stmt(p, BPF_ST, PART_M_NEST);
+	p->to_hash[p->num_to_hash++] = part_find(p, SKF_AD_NLATTR_NEST,
+						 CTA_PROTO_SRC_PORT);
+	part_stmt(p, BPF_ST, PART_M_ATTR);
+	part_fold(p, BPF_H, 0, 16);
+	part_stmt(p, BPF_LD | BPF_MEM, PART_M_NEST);
+	p->to_hash[p->num_to_hash++] = part_find(p, SKF_AD_NLATTR_NEST,
+						 CTA_PROTO_DST_PORT);
+	part_stmt(p, BPF_ST, PART_M_ATTR);
+	part_fold(p, BPF_H, 0, 0);
+
+	/* multiplicative hash, the middle bits are the best mixed */
+	for (i = 0; i < p->num_to_hash; i++)
+		part_label(p, p->to_hash[i]);
+	part_stmt(p, BPF_LD | BPF_MEM, PART_M_HASH);
+	part_stmt(p, BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1);
+	part_stmt(p, BPF_ALU | BPF_RSH | BPF_K, 16);
+	part_stmt(p, BPF_ALU | BPF_MOD | BPF_K, num);
+	p->insn[p->len++] = jpart;
+	part_stmt(p, BPF_RET | BPF_K, 0);
+	part_stmt(p, BPF_RET | BPF_K, 0xffffffff);
+
+	for (i = 0; i < p->num_to_fb; i++)
+		part_label(p, p->to_fb[i]);
+	part_stmt(p, BPF_RET | BPF_K, part == 0 ? 0xffffffff : 0);
+}
+
+static int attach_part_filter(struct nfct_socket *sock, unsigned int part,
+			      unsigned int num)
+{
+	struct part_prog p;
+	struct sock_fprog fprog;
+
+	build_part_prog(&p, part, num);
+	fprog.len = p.len;
+	fprog.filter = p.insn;
+
+	return setsockopt(nfct_fd(sock->cth), SOL_SOCKET, SO_ATTACH_FILTER,
+			  &fprog, sizeof(fprog));
+}
+
+/* the hashtable of flows and the allocator of its entries, in one shard
+ * per event socket, each sized for its share of the flows */
+static int ct_table_create(struct ulogd_pluginstance *upi)
+{
+	struct nfct_pluginstance *cpi =
+			(struct nfct_pluginstance *)upi->private;
+	unsigned int num = cpi->num_socks > 1 ? cpi->num_socks : 1;
+	int buckets = buckets_ce(upi->config_kset).u.value;
+	int max = maxentries_ce(upi->config_kset).u.value;
+	unsigned int i;
+
+	buckets = (buckets + num - 1) / num;
+	max = max > 0 ? (int)((max + num - 1) / num) : 0;
+
+	cpi->shards = calloc(num, sizeof(*cpi->shards));
+	if (!cpi->shards) {
+		ulogd_log(ULOGD_FATAL, "error allocating hash\n");
+		return -1;
+	}
+
+	for (i = 0; i < num; i++) {
+		struct ct_shard *sh = &cpi->shards[i];
+
+		sh->ct_active = hashtable_create_flags(buckets, max,
+				hash, compare,
+				openaddr_ce(upi->config_kset).u.value ?
+				HASHTABLE_F_OPEN : 0);
+		if (!sh->ct_active) {
+			ulogd_log(ULOGD_FATAL, "error allocating hash\n");
+			goto err_shards;
+		}
+
+		sh->ts_slab = slab_create_table(sizeof(struct ct_timestamp),
+						max, buckets);
+		if (!sh->ts_slab) {
+			ulogd_log(ULOGD_FATAL, "error allocating hash "
+				  "entries\n");
+			hashtable_destroy(sh->ct_active);
+			goto err_shards;
+		}
+		pthread_mutex_init(&sh->lock, NULL);
+		cpi->num_shards++;
+	}
+
+	cpi->purge_ct = nfct_new();
+	cpi->blank_ct = nfct_new();
+	if (!cpi->purge_ct || !cpi->blank_ct) {
+		ulogd_log(ULOGD_FATAL, "error allocating conntrack\n");
+		goto err_purge_ct;
+	}
+
+	INIT_LLIST_HEAD(&cpi->swept);
+	ulogd_init_timer(&cpi->sweep_timer, upi, sweep_timer_cb);
+	ulogd_init_timer(&cpi->active_timer, upi, active_timer_cb);
+
+	return 0;
+
+err_purge_ct:
+	if (cpi->purge_ct)
+		nfct_destroy(cpi->purge_ct);
+err_shards:
+	while (cpi->num_shards > 0) {
+		struct ct_shard *sh = &cpi->shards[--cpi->num_shards];
+
+		pthread_mutex_destroy(&sh->lock);
+		slab_destroy(sh->ts_slab);
+		hashtable_destroy(sh->ct_active);
+	}
+	free(cpi->shards);
+	cpi->shards = NULL;
+	return -1;
+}
+
+static void ct_table_destroy(struct ulogd_pluginstance *upi)
 {
 	struct nfct_pluginstance *cpi =
 			(struct nfct_pluginstance *)upi->private;
 
+	ulogd_del_timer(&cpi->sweep_timer);
+	ulogd_del_timer(&cpi->active_timer);
+	while (cpi->num_ended > 0) {
+		struct ct_timestamp *ts = cpi->ended[--cpi->num_ended];
+
+		slab_free(ct_shard(cpi, &ts->key)->ts_slab, ts);
+	}
+	free(cpi->ended);
+	cpi->ended = NULL;
+	while (cpi->num_shards > 0) {
+		struct ct_shard *sh = &cpi->shards[--cpi->num_shards];
+
+		hashtable_iterate(sh->ct_active, sh, do_free);
+		hashtable_destroy(sh->ct_active);
+		slab_destroy(sh->ts_slab);
+		pthread_mutex_destroy(&sh->lock);
+	}
+	free(cpi->shards);
+	cpi->shards = NULL;
+	nfct_destroy(cpi->purge_ct);
+	nfct_destroy(cpi->blank_ct);
+}
+
+/* Snapshot of the hash, written when ulogd is stopped and loaded when it
+ * starts again, so that flows keep their start time and counters across
+ * a restart.  The file is only meant for the same build on the same
+ * boot of the same machine: it is in host byte order, and discarded if
+ * the layout of the entries or the boot id differ. */
+
+#define CT_SNAPSHOT_MAGIC	0x54434c55	/* "ULCT" */
+#define CT_SNAPSHOT_VERSION	1
+#define CT_BOOT_ID_LEN		40
+
+struct ct_snapshot_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t entry_size;
+	uint32_t count;
+	uint32_t pad;
+	char boot_id[CT_BOOT_ID_LEN];
+};
+
+struct ct_snapshot_entry {
+	struct ct_key key;
+	uint32_t id;
+	uint32_t mark;
+	struct ct_counters cnt;
+	struct ct_counters exported;
+	int64_t start_sec;
+	int64_t start_usec;
+};
+
+static void get_boot_id(char *id)
+{
+	FILE *f;
+
+	memset(id, 0, CT_BOOT_ID_LEN);
+	f = fopen("/proc/sys/kernel/random/boot_id", "r");
+	if (f == NULL)
+		return;
+	if (fgets(id, CT_BOOT_ID_LEN, f) == NULL)
+		memset(id, 0, CT_BOOT_ID_LEN);
+	fclose(f);
+}
+
+struct ct_snapshot_ctx {
+	FILE *f;
+	uint32_t count;
+};
+
+static int do_snapshot(void *data1, void *data2)
+{
+	struct ct_snapshot_ctx *ctx = data1;
+	struct ct_timestamp *ts = data2;
+	struct ct_snapshot_entry e;
+
+	memset(&e, 0, sizeof(e));
+	e.key = ts->key;
+	e.id = ts->id;
+	e.mark = ts->mark;
+	e.cnt = ts->cnt;
+	e.exported = ts->exported;
+	e.start_sec = ts->time[START].tv_sec;
+	e.start_usec = ts->time[START].tv_usec;
+
+	if (fwrite(&e, sizeof(e), 1, ctx->f) != 1)
+		return -1;
+	ctx->count++;
+	return 0;
+}
+
+static void ct_table_save(struct ulogd_pluginstance *upi)
+{
+	struct nfct_pluginstance *cpi =
+			(struct nfct_pluginstance *)upi->private;
+	const char *path = snapshot_ce(upi->config_kset).u.string;
+	struct ct_snapshot_ctx ctx = { .count = 0 };
+	struct ct_snapshot_hdr hdr;
+	char tmp[PATH_MAX];
+	unsigned int i;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+		ulogd_log(ULOGD_ERROR, "NFCT: snapshot path too long\n");
+		return;
+	}
+	ctx.f = fopen(tmp, "w");
+	if (ctx.f == NULL) {
+		ulogd_log(ULOGD_ERROR, "NFCT: cannot write snapshot `%s': "
+			  "%s\n", tmp, strerror(errno));
+		return;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CT_SNAPSHOT_MAGIC;
+	hdr.version = CT_SNAPSHOT_VERSION;
+	hdr.entry_size = sizeof(struct ct_snapshot_entry);
+	get_boot_id(hdr.boot_id);
+
+	/* the header is written again once the entries are counted */
+	if (fwrite(&hdr, sizeof(hdr), 1, ctx.f) != 1)
+		goto err;
+	for (i = 0; i < cpi->num_shards; i++) {
+		struct ct_shard *sh = &cpi->shards[i];
+		int ret;
+
+		pthread_mutex_lock(&sh->lock);
+		ret = hashtable_iterate(sh->ct_active, &ctx, do_snapshot);
+		pthread_mutex_unlock(&sh->lock);
+		if (ret < 0)
+			goto err;
+	}
+	hdr.count = ctx.count;
+	if (fseek(ctx.f, 0, SEEK_SET) < 0 ||
+	    fwrite(&hdr, sizeof(hdr), 1, ctx.f) != 1 ||
+	    fflush(ctx.f) != 0 || fsync(fileno(ctx.f)) < 0)
+		goto err;
+	if (fclose(ctx.f) != 0) {
+		ctx.f = NULL;
+		goto err;
+	}
+	if (rename(tmp, path) < 0) {
+		ctx.f = NULL;
+		goto err;
+	}
 
-	cpi->cth = nfct_open(NFNL_SUBSYS_CTNETLINK,
-			     eventmask_ce(upi->config_kset).u.value);
-	if (!cpi->cth) {
+	ulogd_log(ULOGD_NOTICE, "NFCT: %u flows saved to `%s'\n",
+		  ctx.count, path);
+	return;
+
+err:
+	ulogd_log(ULOGD_ERROR, "NFCT: cannot write snapshot `%s': %s\n",
+		  tmp, strerror(errno));
+	if (ctx.f)
+		fclose(ctx.f);
+	unlink(tmp);
+}
+
+/* load the snapshot into the (empty) hash, the entries it holds are
+ * found again or swept by the next dump. Returns the number of flows
+ * loaded. The file is removed, it is outdated as soon as events are
+ * handled. */
+static unsigned int ct_table_load(struct ulogd_pluginstance *upi)
+{
+	struct nfct_pluginstance *cpi =
+			(struct nfct_pluginstance *)upi->private;
+	const char *path = snapshot_ce(upi->config_kset).u.string;
+	const struct ct_snapshot_hdr *hdr;
+	const struct ct_snapshot_entry *e;
+	char boot_id[CT_BOOT_ID_LEN];
+	unsigned int loaded = 0;
+	struct stat st;
+	void *map;
+	uint32_t i;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			ulogd_log(ULOGD_ERROR, "NFCT: cannot read snapshot "
+				  "`%s': %s\n", path, strerror(errno));
+		return 0;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		goto out;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		goto out;
+
+	hdr = map;
+	get_boot_id(boot_id);
+	if (hdr->magic != CT_SNAPSHOT_MAGIC ||
+	    hdr->version != CT_SNAPSHOT_VERSION ||
+	    hdr->entry_size != sizeof(*e) ||
+	    (uint64_t)st.st_size != sizeof(*hdr) +
+				    (uint64_t)hdr->count * sizeof(*e)) {
+		ulogd_log(ULOGD_NOTICE, "NFCT: snapshot `%s' ignored, not "
+			  "written by this version\n", path);
+		goto out_unmap;
+	}
+	if (memcmp(hdr->boot_id, boot_id, sizeof(boot_id)) != 0) {
+		ulogd_log(ULOGD_NOTICE, "NFCT: snapshot `%s' ignored, the "
+			  "system was restarted\n", path);
+		goto out_unmap;
+	}
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	e = (const struct ct_snapshot_entry *)(hdr + 1);
+	for (i = 0; i < hdr->count; i++, e++) {
+		struct ct_shard *sh = ct_shard(cpi, &e->key);
+		struct ct_timestamp *ts = slab_alloc(sh->ts_slab);
+
+		if (ts == NULL)
+			break;
+		ts->key = e->key;
+		ts->id = e->id;
+		ts->mark = e->mark;
+		ts->gen = cpi->gen;
+		ts->cnt = e->cnt;
+		ts->exported = e->exported;
+		ts->time[START].tv_sec = e->start_sec;
+		ts->time[START].tv_usec = e->start_usec;
+		if (hashtable_add(sh->ct_active, &ts->hashnode,
+				  e->key.hash) < 0) {
+			slab_free(sh->ts_slab, ts);
+			break;
+		}
+		loaded++;
+	}
+	if (loaded < hdr->count)
+		ulogd_log(ULOGD_ERROR, "NFCT: only %u of %u flows of the "
+			  "snapshot fit, consider rising `hash_max_entries'\n",
+			  loaded, hdr->count);
+	else
+		ulogd_log(ULOGD_NOTICE, "NFCT: %u flows loaded from `%s'\n",
+			  loaded, path);
+
+out_unmap:
+	munmap(map, st.st_size);
+out:
+	unlink(path);
+	return loaded;
+}
+
+static int nfct_socket_open(struct ulogd_pluginstance *upi,
+			    struct nfct_socket *sock, unsigned int part)
+{
+	struct nfct_pluginstance *cpi =
+			(struct nfct_pluginstance *)upi->private;
+
+	sock->upi = upi;
+	sock->cth = nfct_open(NFNL_SUBSYS_CTNETLINK,
+			      eventmask_ce(upi->config_kset).u.value);
+	if (!sock->cth) {
 		ulogd_log(ULOGD_FATAL, "error opening ctnetlink\n");
-		goto err_cth;
+		return -1;
 	}
 
-	if ((strlen(src_filter_ce(upi->config_kset).u.string) != 0) ||
+	if (cpi->num_socks > 1) {
+		if (attach_part_filter(sock, part, cpi->num_socks) < 0) {
+			ulogd_log(ULOGD_FATAL, "error attaching NFCT "
+				  "partition filter: %s\n", strerror(errno));
+			goto err;
+		}
+	} else if ((strlen(src_filter_ce(upi->config_kset).u.string) != 0) ||
 		(strlen(dst_filter_ce(upi->config_kset).u.string) != 0) ||
 		(strlen(proto_filter_ce(upi->config_kset).u.string) != 0)
 	   ) {
-		if (build_nfct_filter(upi) != 0) {
+		if (build_nfct_filter(upi, sock) != 0) {
 			ulogd_log(ULOGD_FATAL, "error creating NFCT filter\n");
-			goto err_cth;
+			goto err;
 		}
 	}
 
-
 	if (usehash_ce(upi->config_kset).u.value != 0) {
-		nfct_callback_register(cpi->cth, NFCT_T_ALL,
-				&event_handler_hashtable, upi);
+		nfct_callback_register(sock->cth, NFCT_T_ALL,
+				&event_handler_hashtable, sock);
 	} else {
-		nfct_callback_register(cpi->cth, NFCT_T_ALL,
-				       &event_handler_no_hashtable, upi);
+		nfct_callback_register(sock->cth, NFCT_T_ALL,
+				       &event_handler_no_hashtable, sock);
 	}
 
-	if (nlsockbufsize_ce(upi->config_kset).u.value) {
-		setnlbufsiz(upi, nlsockbufsize_ce(upi->config_kset).u.value);
-		ulogd_log(ULOGD_NOTICE, "NFCT netlink buffer size has been "
-					"set to %d\n", cpi->nlbufsiz);
-	}
+	if (nlsockbufsize_ce(upi->config_kset).u.value)
+		setnlbufsiz(sock, nlsockbufsize_ce(upi->config_kset).u.value);
 
 	if (reliable_ce(upi->config_kset).u.value != 0) {
 		int on = 1;
 
-		setsockopt(nfct_fd(cpi->cth), SOL_NETLINK,
+		setsockopt(nfct_fd(sock->cth), SOL_NETLINK,
 				NETLINK_BROADCAST_SEND_ERROR, &on, sizeof(int));
-		setsockopt(nfct_fd(cpi->cth), SOL_NETLINK,
+		setsockopt(nfct_fd(sock->cth), SOL_NETLINK,
 				NETLINK_NO_ENOBUFS, &on, sizeof(int));
+	}
+
+	sock->fd.fd = nfct_fd(sock->cth);
+	sock->fd.cb = &read_cb_nfct;
+	sock->fd.data = sock;
+	sock->fd.when = ULOGD_FD_READ;
+
+	/* several sockets get reader threads, once the hash is filled */
+	if (cpi->num_socks == 1)
+		ulogd_register_fd(&sock->fd);
+	return 0;
+
+err:
+	nfct_close(sock->cth);
+	sock->cth = NULL;
+	return -1;
+}
+
+static void nfct_rbuf_init(struct nfct_rbuf *rb)
+{
+	int i;
+
+	for (i = 0; i < NFCT_RECV_BATCH; i++) {
+		rb->iov[i].iov_base = rb->buf[i];
+		rb->iov[i].iov_len = sizeof(rb->buf[i]);
+		rb->msgs[i].msg_hdr.msg_iov = &rb->iov[i];
+		rb->msgs[i].msg_hdr.msg_iovlen = 1;
+		rb->msgs[i].msg_hdr.msg_name = &rb->peer[i];
+	}
+}
+
+/* have sock read on a thread of its own */
+static int start_reader(struct ulogd_pluginstance *upi,
+			struct nfct_socket *sock)
+{
+	sigset_t all, old;
+	int ret;
+
+	sock->rb = calloc(1, sizeof(*sock->rb));
+	if (!sock->rb)
+		return -1;
+	nfct_rbuf_init(sock->rb);
+
+	sock->rec = calloc(upi->output.num_keys, sizeof(struct ulogd_key));
+	if (!sock->rec)
+		goto out_rb;
+	ulogd_init_record(upi, sock->rec);
+
+	sock->feed = ulogd_feed_create(upi,
+			reader_queue_size_ce(upi->config_kset).u.value);
+	if (!sock->feed)
+		goto out_rec;
+
+	sock->stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (sock->stop_fd < 0)
+		goto out_feed;
+
+	/* signals are handled by the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&sock->thread, NULL, nfct_reader, sock);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		ulogd_log(ULOGD_ERROR, "NFCT: can't start reader: %s\n",
+			  strerror(ret));
+		goto out_fd;
+	}
+
+	return 0;
+
+out_fd:
+	close(sock->stop_fd);
+out_feed:
+	ulogd_feed_destroy(sock->feed);
+	sock->feed = NULL;
+out_rec:
+	free(sock->rec);
+out_rb:
+	free(sock->rb);
+	return -1;
+}
+
+static void stop_reader(struct nfct_socket *sock)
+{
+	uint64_t one = 1;
+
+	if (write(sock->stop_fd, &one, sizeof(one)) == sizeof(one))
+		pthread_join(sock->thread, NULL);
+	close(sock->stop_fd);
+	ulogd_feed_destroy(sock->feed);
+	sock->feed = NULL;
+	free(sock->rec);
+	free(sock->rb);
+}
+
+/* start a reader thread per event socket, with the overruns they hit
+ * reported to the main loop */
+static int start_readers(struct ulogd_pluginstance *upi)
+{
+	struct nfct_pluginstance *cpi =
+			(struct nfct_pluginstance *)upi->private;
+	int cpu = reader_cpu_ce(upi->config_kset).u.value;
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int i;
+
+	if (usehash_ce(upi->config_kset).u.value != 0) {
+		cpi->ov_notify.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (cpi->ov_notify.fd < 0) {
+			ulogd_log(ULOGD_FATAL, "NFCT: eventfd: %s\n",
+				  strerror(errno));
+			return -1;
+		}
+		cpi->ov_notify.cb = &read_cb_notify;
+		cpi->ov_notify.data = upi;
+		cpi->ov_notify.when = ULOGD_FD_READ;
+		ulogd_register_fd(&cpi->ov_notify);
+	}
+
+	for (i = 0; i < cpi->num_socks; i++) {
+		struct nfct_socket *sock = &cpi->socks[i];
+
+		sock->cpu = -1;
+		if (cpu >= 0 && ncpus > 0)
+			sock->cpu = (cpu + i) % ncpus;
+		if (start_reader(upi, sock) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int nfct_sockets_close(struct nfct_pluginstance *cpi)
+{
+	unsigned int i;
+	int rc = 0;
+
+	for (i = 0; i < cpi->num_socks; i++) {
+		struct nfct_socket *sock = &cpi->socks[i];
+
+		if (sock->feed)
+			stop_reader(sock);
+		else if (sock->cth && cpi->num_socks == 1)
+			ulogd_unregister_fd(&sock->fd);
+	}
+	if (cpi->ov_notify.fd >= 0) {
+		ulogd_unregister_fd(&cpi->ov_notify);
+		close(cpi->ov_notify.fd);
+		cpi->ov_notify.fd = -1;
+	}
+
+	for (i = 0; i < cpi->num_socks; i++) {
+		if (cpi->socks[i].cth == NULL)
+			continue;
+		if (nfct_close(cpi->socks[i].cth) < 0)
+			rc = -1;
+	}
+	free(cpi->socks);
+	cpi->socks = NULL;
+	return rc;
+}
+
+static int constructor_nfct_events(struct ulogd_pluginstance *upi)
+{
+	struct nfct_pluginstance *cpi =
+			(struct nfct_pluginstance *)upi->private;
+	int num = event_sockets_ce(upi->config_kset).u.value;
+	int i;
+
+	if (num < 1 || num > NFCT_SOCKETS_MAX) {
+		ulogd_log(ULOGD_FATAL, "NFCT event_sockets must be between "
+			  "1 and %d\n", NFCT_SOCKETS_MAX);
+		return -1;
+	}
+	if (num > 1 &&
+	    ((strlen(src_filter_ce(upi->config_kset).u.string) != 0) ||
+	     (strlen(dst_filter_ce(upi->config_kset).u.string) != 0) ||
+	     (strlen(proto_filter_ce(upi->config_kset).u.string) != 0))) {
+		ulogd_log(ULOGD_FATAL, "NFCT accept_*_filter can't be used "
+			  "with several event_sockets\n");
+		return -1;
+	}
+
+	cpi->ov_notify.fd = -1;
+	cpi->socks = calloc(num, sizeof(*cpi->socks));
+	if (cpi->socks == NULL) {
+		ulogd_log(ULOGD_FATAL, "out of memory\n");
+		return -1;
+	}
+	cpi->num_socks = num;
+
+	for (i = 0; i < num; i++) {
+		if (nfct_socket_open(upi, &cpi->socks[i], i) < 0)
+			goto err_cth;
+	}
+
+	if (nlsockbufsize_ce(upi->config_kset).u.value) {
+		ulogd_log(ULOGD_NOTICE, "NFCT netlink buffer size has been "
+					"set to %d\n", cpi->socks[0].nlbufsiz);
+	}
+	if (reliable_ce(upi->config_kset).u.value != 0) {
 		ulogd_log(ULOGD_NOTICE, "NFCT reliable logging "
 					"has been enabled.");
 	}
-	cpi->nfct_fd.fd = nfct_fd(cpi->cth);
-	cpi->nfct_fd.cb = &read_cb_nfct;
-	cpi->nfct_fd.data = cpi;
-	cpi->nfct_fd.when = ULOGD_FD_READ;
-
-	ulogd_register_fd(&cpi->nfct_fd);
+	nfct_rbuf_init(&cpi->rb);
 
 	cpi->ct = nfct_new();
 	if (cpi->ct == NULL)
-		goto err_nfctobj;
+		goto err_cth;
 
 	if (usehash_ce(upi->config_kset).u.value != 0) {
 		int family = AF_UNSPEC;
 		struct nfct_handle *h;
 
 		/* we use a hashtable to cache entries in userspace. */
-		cpi->ct_active =
-		     hashtable_create(buckets_ce(upi->config_kset).u.value,
-				      maxentries_ce(upi->config_kset).u.value,
-				      hash,
-				      compare);
-		if (!cpi->ct_active) {
-			ulogd_log(ULOGD_FATAL, "error allocating hash\n");
+		if (ct_table_create(upi) < 0)
 			goto err_hashtable;
-		}
 
 		/* populate the hashtable: we use a disposable handler, we
-		 * may hit overrun if we use cpi->cth. This ensures that the
+		 * may hit overrun if we use an event socket. This ensures that the
 		 * initial dump is successful. */
 		h = nfct_open(CONNTRACK, 0);
 		if (!h) {
 			ulogd_log(ULOGD_FATAL, "error opening ctnetlink\n");
 			goto err_ovh;
 		}
-		nfct_callback_register(h, NFCT_T_ALL,
-				       &event_handler_hashtable, upi);
-		nfct_query(h, NFCT_Q_DUMP, &family);
+		/* flows of the snapshot not in the dump have ended while
+		 * we weren't running, they are logged by the sweep */
+		if (strlen(snapshot_ce(upi->config_kset).u.string) != 0 &&
+		    ct_table_load(upi) > 0) {
+			nfct_callback_register(h, NFCT_T_ALL,
+					       &restore_handler, upi);
+			resync_begin(cpi);
+			if (nfct_query(h, NFCT_Q_DUMP, &family) == 0)
+				resync_end(cpi);
+		} else {
+			/* only NFCT_T_UPDATE messages, nothing is logged */
+			nfct_callback_register(h, NFCT_T_ALL,
+					       &event_handler_hashtable,
+					       &cpi->socks[0]);
+			nfct_query(h, NFCT_Q_DUMP, &family);
+		}
 		nfct_close(h);
 
 		/* the overrun handler only make sense with the hashtable,
@@ -1388,28 +2908,44 @@ static int constructor_nfct_events(struct ulogd_pluginstance *upi)
 
 		ulogd_register_fd(&cpi->nfct_ov);
 
-		/* we use this to purge old entries during overruns.*/
-		cpi->pgh = nfct_open(NFNL_SUBSYS_CTNETLINK, 0);
-		if (!cpi->pgh) {
-			ulogd_log(ULOGD_FATAL, "error opening ctnetlink\n");
-			goto err_pgh;
-		}
+		/* events don't tell the counters of flows reaching
+		 * active_timeout, dumps do */
+		if (active_timeout_ce(upi->config_kset).u.value > 0)
+			ulogd_add_timer(&cpi->active_timer, 1);
+	} else if (active_timeout_ce(upi->config_kset).u.value > 0) {
+		ulogd_log(ULOGD_NOTICE, "NFCT active_timeout requires "
+					"the hashtable, ignored\n");
+	}
+
+	/* the hash is filled, events may come in concurrently now */
+	if (num > 1) {
+		if (start_readers(upi) < 0)
+			goto err_readers;
+		ulogd_log(ULOGD_NOTICE, "NFCT events partitioned among "
+					"%d sockets, on reader threads\n", num);
 	}
 
 	ulogd_log(ULOGD_NOTICE, "NFCT plugin working in event mode\n");
 	return 0;
 
-err_pgh:
-	ulogd_unregister_fd(&cpi->nfct_ov);
-	nfct_close(cpi->ovh);
+err_readers:
+	nfct_sockets_close(cpi);
+	if (cpi->ovh) {
+		ulogd_del_timer(&cpi->ov_timer);
+		ulogd_unregister_fd(&cpi->nfct_ov);
+		nfct_close(cpi->ovh);
+		cpi->ovh = NULL;
+	}
+	if (cpi->shards)
+		ct_table_destroy(upi);
+	nfct_destroy(cpi->ct);
+	return -1;
 err_ovh:
-	hashtable_destroy(cpi->ct_active);
+	ct_table_destroy(upi);
 err_hashtable:
 	nfct_destroy(cpi->ct);
-err_nfctobj:
-	ulogd_unregister_fd(&cpi->nfct_fd);
-	nfct_close(cpi->cth);
 err_cth:
+	nfct_sockets_close(cpi);
 	return -1;
 }
 
@@ -1431,15 +2967,12 @@ static int constructor_nfct_polling(struct ulogd_pluginstance *upi)
 	}
 	nfct_callback_register(cpi->pgh, NFCT_T_ALL, &polling_handler, upi);
 
-	cpi->ct_active =
-	     hashtable_create(buckets_ce(upi->config_kset).u.value,
-			      maxentries_ce(upi->config_kset).u.value,
-			      hash,
-			      compare);
-	if (!cpi->ct_active) {
-		ulogd_log(ULOGD_FATAL, "error allocating hash\n");
+	if (ct_table_create(upi) < 0)
 		goto err_hashtable;
-	}
+	/* reconciled by the first poll */
+	if (strlen(snapshot_ce(upi->config_kset).u.string) != 0 &&
+	    ct_table_load(upi) > 0)
+		cpi->restoring = 1;
 
 	cpi->ct = nfct_new();
 	if (cpi->ct == NULL)
@@ -1454,7 +2987,7 @@ static int constructor_nfct_polling(struct ulogd_pluginstance *upi)
 	return 0;
 
 err_ct_cache:
-	hashtable_destroy(cpi->ct_active);
+	ct_table_destroy(upi);
 err_hashtable:
 	nfct_close(cpi->pgh);
 err:
@@ -1480,9 +3013,7 @@ static int destructor_nfct_events(struct ulogd_pluginstance *upi)
 	struct nfct_pluginstance *cpi = (void *) upi->private;
 	int rc;
 
-	ulogd_unregister_fd(&cpi->nfct_fd);
-
-	rc = nfct_close(cpi->cth);
+	rc = nfct_sockets_close(cpi);
 	if (rc < 0)
 		return rc;
 
@@ -1496,12 +3027,7 @@ static int destructor_nfct_events(struct ulogd_pluginstance *upi)
 		if (rc < 0)
 			return rc;
 
-		rc = nfct_close(cpi->pgh);
-		if (rc < 0)
-			return rc;
-
-		hashtable_iterate(cpi->ct_active, NULL, do_free);
-		hashtable_destroy(cpi->ct_active);
+		ct_table_destroy(upi);
 	}
 	return 0;
 }
@@ -1515,6 +3041,10 @@ static int destructor_nfct_polling(struct ulogd_pluginstance *upi)
 	if (rc < 0)
 		return rc;
 
+	ulogd_del_timer(&cpi->timer);
+	nfct_destroy(cpi->ct);
+	ct_table_destroy(upi);
+
 	return 0;
 }
 
@@ -1532,10 +3062,56 @@ static int destructor_nfct(struct ulogd_pluginstance *upi)
 
 static void signal_nfct(struct ulogd_pluginstance *pi, int signal)
 {
+	struct nfct_pluginstance *cpi =
+			(struct nfct_pluginstance *)pi->private;
+	unsigned int i;
+
 	switch (signal) {
 	case SIGUSR2:
+		if (cpi->shards) {
+			struct hashtable_stats st, all;
+			unsigned int flows = 0, chunks = 0;
+			unsigned long long dropped = 0;
+			int j;
+
+			/* the shards add up */
+			memset(&all, 0, sizeof(all));
+			for (i = 0; i < cpi->num_shards; i++) {
+				struct ct_shard *sh = &cpi->shards[i];
+
+				pthread_mutex_lock(&sh->lock);
+				hashtable_stats(sh->ct_active, &st);
+				flows += hashtable_counter(sh->ct_active);
+				dropped += sh->ct_dropped;
+				chunks += sh->ts_slab->chunks;
+				pthread_mutex_unlock(&sh->lock);
+
+				all.buckets += st.buckets;
+				all.used += st.used;
+				for (j = 0; j < HASHTABLE_CHAINS; j++)
+					all.chains[j] += st.chains[j];
+				if (st.max_chain > all.max_chain)
+					all.max_chain = st.max_chain;
+			}
+			ulogd_log(ULOGD_NOTICE, "NFCT: %u flows, %llu "
+				  "not tracked, %u chunks of %zu KB mapped\n",
+				  flows, dropped, chunks,
+				  cpi->shards[0].ts_slab->chunk_size / 1024);
+			ulogd_log(ULOGD_NOTICE, "NFCT: %u of %u buckets used, "
+				  "chains of 1: %u, 2: %u, 3: %u, more: %u, "
+				  "longest %u\n", all.used, all.buckets,
+				  all.chains[0], all.chains[1], all.chains[2],
+				  all.chains[3], all.max_chain);
+		}
 		get_ctr_zero(pi);
 		break;
+	case SIGTERM:
+	case SIGINT:
+		/* ulogd is stopping, keep the flows for the next start */
+		if (cpi->shards &&
+		    strlen(snapshot_ce(pi->config_kset).u.string) != 0)
+			ct_table_save(pi);
+		break;
 	}
 }
 
@@ -3,13 +3,27 @@
  * (C) 2004-2005 by Harald Welte <laforge@gnumonks.org>
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	/* pthread_setaffinity_np(), recvmmsg() */
+#endif
+
 #include <unistd.h>
 #include <stdlib.h>
+#include <time.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/eventfd.h>
 
 #include <ulogd/ulogd.h>
+#include <ulogd/timer.h>
 #include <libnfnetlink/libnfnetlink.h>
 #include <libnetfilter_log/libnetfilter_log.h>
 #ifdef BUILD_NFCT
@@ -28,19 +42,92 @@ struct nf_conntrack;
  * RMEM_DEFAULT size.  */
 #define NFLOG_BUFSIZE_DEFAULT	150000
 
-struct nflog_input {
+/* Maximum number of messages handled per wakeup.  */
+#define NFLOG_READ_BUDGET_DEFAULT	64
+
+/* Number of messages fetched by one recvmmsg() call, each of them has a
+ * buffer of `bufsize' bytes.  */
+#define NFLOG_RECV_BATCH	8
+
+/* Copy range of copy_range=-1 when only header parsers read the packets:
+ * an IPv6 header with a few extension headers and a TCP header with
+ * options.  */
+#define NFLOG_COPY_HEADERS	256
+
+/* Bounds and period of the netlink_qautotune controller.  */
+#define NFLOG_QTHRESH_MAX	128
+#define NFLOG_QTUNE_INTERVAL	1000000	/* usec */
+
+/* loss and volume counters of a group */
+struct nflog_stats {
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t lost;		/* sequence gaps */
+	uint64_t overruns;	/* ENOBUFS */
+};
+
+/* the counters are only written by the thread reading the group, other
+ * threads load them atomically */
+#define STAT_ADD(g, field, n) \
+	__atomic_store_n(&(g)->stats.field, (g)->stats.field + (n), \
+			 __ATOMIC_RELAXED)
+#define STAT_GET(g, field) \
+	__atomic_load_n(&(g)->stats.field, __ATOMIC_RELAXED)
+
+/* a netlink socket bound to one log group */
+struct nflog_group {
+	struct ulogd_pluginstance *upi;
 	struct nflog_handle *nful_h;
 	struct nflog_g_handle *nful_gh;
 	unsigned char *nfulog_buf;
+	struct mmsghdr msgs[NFLOG_RECV_BATCH];
+	struct iovec iov[NFLOG_RECV_BATCH];
+	unsigned int batch;
 	struct ulogd_fd nful_fd;
 	int nlbufsiz;
 	bool nful_overrun_warned;
+	unsigned int num;
+
+	/* with netlink_qautotune, only touched by the thread reading
+	 * the group */
+	bool qtune;
+	uint32_t qthresh;
+	uint32_t qtimeout;		/* in 10ms */
+	uint64_t qtune_next;
+	unsigned int qtune_pkts;
+	unsigned int qtune_msgs;
+	unsigned int qtune_overruns;
+	unsigned int qtune_latency;	/* max in the period, in ms */
+
+	/* copy range in use, 0 for metadata only, and the one to switch to,
+	 * set by the main loop with copy_range=-1 */
+	int copy_range;
+	int copy_want;
+
+	struct nflog_stats stats;
+	struct nflog_stats stats_last;	/* at the last summary record */
+	uint32_t seq_next;
+	bool seq_known;
+
+	/* with reader_threads */
+	pthread_t thread;
+	int stop_fd;
+	int cpu;
+	struct ulogd_key *rec;
+	struct ulogd_feed *feed;
+};
+
+struct nflog_input {
+	struct nflog_group *groups;
+	unsigned int num_groups;
+	struct ulogd_timer stats_timer;
+	struct ulogd_timer copy_timer;
 };
 
 /* configuration entries */
 
 static struct config_keyset libulog_kset = {
-	.num_ces = 12,
+	.num_ces = 22,
 	.ces = {
 		{
 			.key 	 = "bufsize",
@@ -115,6 +202,66 @@ static struct config_keyset libulog_kset = {
 			.options = CONFIG_OPT_NONE,
 			.u.value = 0,
 		},
+		{
+			.key     = "num_groups",
+			.type    = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 1,
+		},
+		{
+			.key     = "reader_threads",
+			.type    = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 0,
+		},
+		{
+			.key     = "reader_cpu",
+			.type    = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = -1,
+		},
+		{
+			.key     = "reader_queue_size",
+			.type    = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 4096,
+		},
+		{
+			.key     = "read_budget",
+			.type    = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = NFLOG_READ_BUDGET_DEFAULT,
+		},
+		{
+			.key     = "read_budget_usec",
+			.type    = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 0,
+		},
+		{
+			.key     = "netlink_qautotune",
+			.type    = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 0,
+		},
+		{
+			.key     = "netlink_qautotune_latency",
+			.type    = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 100,
+		},
+		{
+			.key     = "stats_interval",
+			.type    = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 0,
+		},
+		{
+			.key     = "copy_range",
+			.type    = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 0xffff,
+		},
 	}
 };
 
@@ -130,6 +277,16 @@ static struct config_keyset libulog_kset = {
 #define nlthreshold_ce(x) (x->ces[9])
 #define nltimeout_ce(x) (x->ces[10])
 #define attach_conntrack_ce(x) (x->ces[11])
+#define num_groups_ce(x) (x->ces[12])
+#define reader_threads_ce(x) (x->ces[13])
+#define reader_cpu_ce(x) (x->ces[14])
+#define reader_queue_size_ce(x) (x->ces[15])
+#define read_budget_ce(x) (x->ces[16])
+#define read_budget_usec_ce(x) (x->ces[17])
+#define qautotune_ce(x) (x->ces[18])
+#define qautotune_latency_ce(x) (x->ces[19])
+#define stats_interval_ce(x) (x->ces[20])
+#define copy_range_ce(x) (x->ces[21])
 
 enum nflog_keys {
 	NFLOG_KEY_RAW_MAC = 0,
@@ -156,6 +313,11 @@ enum nflog_keys {
 	NFLOG_KEY_RAW_MAC_ADDRLEN,
 	NFLOG_KEY_RAW,
 	NFLOG_KEY_RAW_CT,
+	NFLOG_KEY_GROUP,
+	NFLOG_KEY_STATS_PACKETS,
+	NFLOG_KEY_STATS_BYTES,
+	NFLOG_KEY_STATS_LOST,
+	NFLOG_KEY_STATS_OVERRUNS,
 };
 
 static struct ulogd_key output_keys[] = {
@@ -332,9 +494,49 @@ static struct ulogd_key output_keys[] = {
 		.flags = ULOGD_RETF_NONE,
 		.name = "ct",
 	},
+	[NFLOG_KEY_GROUP] = {
+		.type = ULOGD_RET_UINT16,
+		.flags = ULOGD_RETF_NONE,
+		.name = "nflog.group",
+	},
+	[NFLOG_KEY_STATS_PACKETS] = {
+		.type = ULOGD_RET_UINT64,
+		.flags = ULOGD_RETF_NONE,
+		.name = "nflog.stats.packets",
+	},
+	[NFLOG_KEY_STATS_BYTES] = {
+		.type = ULOGD_RET_UINT64,
+		.flags = ULOGD_RETF_NONE,
+		.name = "nflog.stats.bytes",
+	},
+	[NFLOG_KEY_STATS_LOST] = {
+		.type = ULOGD_RET_UINT64,
+		.flags = ULOGD_RETF_NONE,
+		.name = "nflog.stats.lost",
+	},
+	[NFLOG_KEY_STATS_OVERRUNS] = {
+		.type = ULOGD_RET_UINT64,
+		.flags = ULOGD_RETF_NONE,
+		.name = "nflog.stats.overruns",
+	},
 };
 
-struct nf_conntrack *build_ct(struct nfgenmsg *nfmsg)
+/* is the ct key resolved by a plugin of a stack of upi? */
+static bool ct_needed(struct ulogd_pluginstance *upi)
+{
+	struct ulogd_pluginstance *npi;
+
+	if (upi->output.keys[NFLOG_KEY_RAW_CT].flags & ULOGD_RETF_NEEDED)
+		return true;
+	llist_for_each_entry(npi, &upi->plist, plist) {
+		if (npi->output.keys[NFLOG_KEY_RAW_CT].flags &
+		    ULOGD_RETF_NEEDED)
+			return true;
+	}
+	return false;
+}
+
+static struct nf_conntrack *build_ct(struct nfgenmsg *nfmsg)
 {
 #ifdef BUILD_NFCT
 	struct nlmsghdr *nlh =
@@ -370,12 +572,12 @@ struct nf_conntrack *build_ct(struct nfgenmsg *nfmsg)
 #endif
 }
 
+/* fill ret, laid out like the output keys of upi, from a message */
 static inline int
-interp_packet(struct ulogd_pluginstance *upi, uint8_t pf_family,
-	      struct nflog_data *ldata, struct nf_conntrack *ct)
+interp_packet(struct ulogd_pluginstance *upi, struct ulogd_key *ret,
+	      uint8_t pf_family, struct nflog_data *ldata,
+	      struct nf_conntrack *ct)
 {
-	struct ulogd_key *ret = upi->output.keys;
-
 	struct nfulnl_msg_packet_hdr *ph = nflog_get_msg_packet_hdr(ldata);
 	struct nfulnl_msg_packet_hw *hw = nflog_get_packet_hw(ldata);
 	char *payload;
@@ -403,6 +605,8 @@ interp_packet(struct ulogd_pluginstance *upi, uint8_t pf_family,
 	if (nflog_get_msg_packet_hwhdrlen(ldata)) {
 		okey_set_ptr(&ret[NFLOG_KEY_RAW_MAC], 
 			     nflog_get_msg_packet_hwhdr(ldata));
+		ret[NFLOG_KEY_RAW_MAC].len =
+			nflog_get_msg_packet_hwhdrlen(ldata);
 		okey_set_u16(&ret[NFLOG_KEY_RAW_MAC_LEN],
 			     nflog_get_msg_packet_hwhdrlen(ldata));
 		okey_set_u16(&ret[NFLOG_KEY_RAW_TYPE], nflog_get_hwtype(ldata));
@@ -410,6 +614,7 @@ interp_packet(struct ulogd_pluginstance *upi, uint8_t pf_family,
 
 	if (hw) {
 		okey_set_ptr(&ret[NFLOG_KEY_RAW_MAC_SADDR], hw->hw_addr);
+		ret[NFLOG_KEY_RAW_MAC_SADDR].len = ntohs(hw->hw_addrlen);
 		okey_set_u16(&ret[NFLOG_KEY_RAW_MAC_ADDRLEN], 
 			     ntohs(hw->hw_addrlen));
 	}
@@ -417,6 +622,7 @@ interp_packet(struct ulogd_pluginstance *upi, uint8_t pf_family,
 	if (payload_len >= 0) {
 		/* include pointer to raw packet */
 		okey_set_ptr(&ret[NFLOG_KEY_RAW_PCKT], payload);
+		ret[NFLOG_KEY_RAW_PCKT].len = payload_len;
 		okey_set_u32(&ret[NFLOG_KEY_RAW_PCKTLEN], payload_len);
 	}
 
@@ -456,16 +662,14 @@ interp_packet(struct ulogd_pluginstance *upi, uint8_t pf_family,
 	if (ct != NULL)
 		okey_set_ptr(&ret[NFLOG_KEY_RAW_CT], ct);
 
-	ulogd_propagate_results(upi);
 	return 0;
 }
 
-static int setnlbufsiz(struct ulogd_pluginstance *upi, int size)
+static int setnlbufsiz(struct ulogd_pluginstance *upi,
+		       struct nflog_group *g, int size)
 {
-	struct nflog_input *ui = (struct nflog_input *)upi->private;
-
 	if (size < nlsockbufmaxsize_ce(upi->config_kset).u.value) {
-		ui->nlbufsiz = nfnl_rcvbufsiz(nflog_nfnlh(ui->nful_h), size);
+		g->nlbufsiz = nfnl_rcvbufsiz(nflog_nfnlh(g->nful_h), size);
 		return 1;
 	}
 
@@ -473,74 +677,336 @@ static int setnlbufsiz(struct ulogd_pluginstance *upi, int size)
 				"reached. Please, consider rising "
 				"`netlink_socket_buffer_size` and "
 				"`netlink_socket_buffer_maxsize` "
-				"clauses.\n", ui->nlbufsiz);
+				"clauses.\n", g->nlbufsiz);
 	return 0;
 }
 
+static void nful_recv_error(struct nflog_group *g)
+{
+	struct ulogd_pluginstance *upi = g->upi;
+
+	if (errno != ENOBUFS || g->nful_overrun_warned)
+		return;
+
+	if (nlsockbufmaxsize_ce(upi->config_kset).u.value) {
+		int s = g->nlbufsiz * 2;
+		if (setnlbufsiz(upi, g, s)) {
+			ulogd_log(ULOGD_NOTICE,
+				  "We are losing events, "
+				  "increasing buffer size "
+				  "to %d\n", g->nlbufsiz);
+		} else {
+			/* we have reached the maximum buffer
+			 * limit size, don't perform any
+			 * further treatments on overruns. */
+			g->nful_overrun_warned = true;
+		}
+	} else {
+		ulogd_log(ULOGD_NOTICE,
+			  "We are losing events. Please, "
+			  "consider using the clauses "
+			  "`netlink_socket_buffer_size' and "
+			  "`netlink_socket_buffer_maxsize'\n");
+		/* display the previous log message once. */
+		g->nful_overrun_warned = true;
+	}
+}
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void qtune_set(struct nflog_group *g, uint32_t qthresh,
+		      uint32_t qtimeout)
+{
+	if (qthresh != g->qthresh &&
+	    nflog_set_qthresh(g->nful_gh, qthresh) >= 0)
+		g->qthresh = qthresh;
+	if (qtimeout != g->qtimeout &&
+	    nflog_set_timeout(g->nful_gh, qtimeout) >= 0)
+		g->qtimeout = qtimeout;
+}
+
+/* adjust the kernel batching of group g to the traffic of the last
+ * period: grow the queue threshold while batches come full or we
+ * overrun, as long as a batch still fills within
+ * netlink_qautotune_latency, shrink it otherwise or when packets were
+ * seen waiting longer than that. Partial batches are flushed after the
+ * time a batch takes to fill, bounded by the latency too. */
+static void qtune(struct nflog_group *g, uint64_t now)
+{
+	struct ulogd_pluginstance *upi = g->upi;
+	unsigned int latency = qautotune_latency_ce(upi->config_kset).u.value;
+	uint64_t elapsed = now - (g->qtune_next - NFLOG_QTUNE_INTERVAL);
+	uint64_t budget = (uint64_t)latency * 1000;	/* usec */
+	uint32_t qthresh = g->qthresh, qtimeout;
+	uint64_t rate;
+
+	rate = (uint64_t)g->qtune_pkts * 1000000 / (elapsed ? elapsed : 1);
+
+#define FILL_USEC(q)	((uint64_t)(q) * 1000000 / rate)
+	if (rate == 0 || g->qtune_latency > latency ||
+	    FILL_USEC(qthresh) > budget) {
+		qthresh /= 2;
+	} else if ((g->qtune_overruns ||
+		    g->qtune_pkts >= g->qtune_msgs * qthresh * 3 / 4) &&
+		   FILL_USEC(qthresh * 2) <= budget) {
+		qthresh *= 2;
+	}
+	if (qthresh < 1)
+		qthresh = 1;
+	if (qthresh > NFLOG_QTHRESH_MAX)
+		qthresh = NFLOG_QTHRESH_MAX;
+
+	/* in 10ms units */
+	qtimeout = latency / 10;
+	if (rate && FILL_USEC(qthresh) / 10000 < qtimeout)
+		qtimeout = FILL_USEC(qthresh) / 10000;
+	if (qtimeout < 1)
+		qtimeout = 1;
+#undef FILL_USEC
+
+	if (qthresh != g->qthresh || qtimeout != g->qtimeout) {
+		qtune_set(g, qthresh, qtimeout);
+		ulogd_log(ULOGD_INFO, "NFLOG group %u: qthreshold %u, "
+			  "qtimeout %u (%llu pkt/s, %u pkt/msg, %u overruns, "
+			  "%u ms max latency)\n", g->num, g->qthresh,
+			  g->qtimeout, (unsigned long long)rate,
+			  g->qtune_msgs ? g->qtune_pkts / g->qtune_msgs : 0,
+			  g->qtune_overruns, g->qtune_latency);
+	}
+
+	g->qtune_next = now + NFLOG_QTUNE_INTERVAL;
+	g->qtune_pkts = 0;
+	g->qtune_msgs = 0;
+	g->qtune_overruns = 0;
+	g->qtune_latency = 0;
+}
+
+/* account packet nfa of group g for netlink_qautotune */
+static void qtune_account(struct nflog_group *g, struct nflog_data *nfa)
+{
+	struct timeval ts, now;
+	long ms;
+
+	g->qtune_pkts++;
+
+	/* only stamped packets tell how long they waited */
+	if (nflog_get_timestamp(nfa, &ts) != 0 || ts.tv_sec == 0)
+		return;
+	gettimeofday(&now, NULL);
+	ms = (now.tv_sec - ts.tv_sec) * 1000 +
+	     (now.tv_usec - ts.tv_usec) / 1000;
+	if (ms > (long)g->qtune_latency)
+		g->qtune_latency = ms;
+}
+
+/* switch group g to the copy range chosen by the main loop */
+static void copy_apply(struct nflog_group *g)
+{
+	int range = __atomic_load_n(&g->copy_want, __ATOMIC_RELAXED);
+
+	if (range == g->copy_range)
+		return;
+
+	if (nflog_set_mode(g->nful_gh, range ? NFULNL_COPY_PACKET :
+					       NFULNL_COPY_META, range) < 0) {
+		ulogd_log(ULOGD_ERROR, "NFLOG group %u: can't set copy "
+			  "range to %d\n", g->num, range);
+		/* don't retry, keep the range we have */
+		__atomic_store_n(&g->copy_want, g->copy_range,
+				 __ATOMIC_RELAXED);
+		return;
+	}
+	g->copy_range = range;
+
+	if (range)
+		ulogd_log(ULOGD_NOTICE, "NFLOG group %u: copying the first "
+			  "%d bytes of packets\n", g->num, range);
+	else
+		ulogd_log(ULOGD_NOTICE, "NFLOG group %u: copying packet "
+			  "metadata only\n", g->num);
+}
+
+/* read the messages pending on group g, up to `read_budget' of them and
+ * for at most `read_budget_usec', returns the number of messages read */
+static int nful_read(struct nflog_group *g)
+{
+	struct ulogd_pluginstance *upi = g->upi;
+	unsigned int budget = read_budget_ce(upi->config_kset).u.value;
+	int usec = read_budget_usec_ce(upi->config_kset).u.value;
+	uint64_t deadline = 0;
+	unsigned int done = 0;
+
+	if (budget == 0)
+		budget = 1;
+	if (usec > 0)
+		deadline = now_usec() + usec;
+
+	copy_apply(g);
+
+	while (done < budget) {
+		unsigned int want = budget - done;
+		int i, n;
+
+		if (want > g->batch)
+			want = g->batch;
+
+		n = recvmmsg(g->nful_fd.fd, g->msgs, want, MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != ENOBUFS)
+				break;
+			/* some messages were lost, the socket is readable
+			 * again but the overrun counts against the budget */
+			nful_recv_error(g);
+			STAT_ADD(g, overruns, 1);
+			g->qtune_overruns++;
+			done++;
+			continue;
+		}
+
+		for (i = 0; i < n; i++) {
+			STAT_ADD(g, bytes, g->msgs[i].msg_len);
+			nflog_handle_packet(g->nful_h, g->iov[i].iov_base,
+					    g->msgs[i].msg_len);
+		}
+		done += n;
+		g->qtune_msgs += n;
+
+		/* the socket is empty */
+		if ((unsigned int)n < want)
+			break;
+		if (deadline && now_usec() >= deadline)
+			break;
+	}
+
+	if (g->qtune) {
+		uint64_t now = now_usec();
+
+		if (now >= g->qtune_next)
+			qtune(g, now);
+	}
+
+	return done;
+}
+
 /* callback called from ulogd core when fd is readable */
 static int nful_read_cb(int fd, unsigned int what, void *param)
 {
-	struct ulogd_pluginstance *upi = (struct ulogd_pluginstance *)param;
-	struct nflog_input *ui = (struct nflog_input *)upi->private;
-	int len;
+	struct nflog_group *g = param;
 
 	if (!(what & ULOGD_FD_READ))
 		return 0;
 
-	/* we don't have a while loop here, since we don't want to
+	/* we don't drain the socket here, since we don't want to
 	 * grab all the processing time just for us.  there might be other
-	 * sockets that have pending work */
-	len = recv(fd, ui->nfulog_buf, bufsiz_ce(upi->config_kset).u.value, 0);
-	if (len < 0) {
-		if (errno == ENOBUFS && !ui->nful_overrun_warned) {
-			if (nlsockbufmaxsize_ce(upi->config_kset).u.value) {
-				int s = ui->nlbufsiz * 2;
-				if (setnlbufsiz(upi, s)) {
-					ulogd_log(ULOGD_NOTICE,
-						  "We are losing events, "
-						  "increasing buffer size "
-						  "to %d\n", ui->nlbufsiz);
-				} else {
-					/* we have reached the maximum buffer
-					 * limit size, don't perform any
-					 * further treatments on overruns. */
-					ui->nful_overrun_warned = true;
-				}
-			} else {
-				ulogd_log(ULOGD_NOTICE,
-					  "We are losing events. Please, "
-					  "consider using the clauses "
-					  "`netlink_socket_buffer_size' and "
-					  "`netlink_socket_buffer_maxsize'\n");
-				/* display the previous log message once. */
-				ui->nful_overrun_warned = true;
-			}
+	 * sockets that have pending work, the budget bounds what we take */
+	nful_read(g);
+	return 0;
+}
+
+/* reader thread of a group, if reader_threads is set */
+static void *nful_reader(void *data)
+{
+	struct nflog_group *g = data;
+	struct pollfd pfd[2] = {
+		{ .fd = g->nful_fd.fd, .events = POLLIN },
+		{ .fd = g->stop_fd, .events = POLLIN },
+	};
+
+	if (g->cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(g->cpu, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			ulogd_log(ULOGD_ERROR, "can't pin reader of group %u "
+				  "to CPU %d\n", g->num, g->cpu);
+	}
+
+	while (1) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			ulogd_log(ULOGD_ERROR, "poll on group %u: %s\n",
+				  g->num, strerror(errno));
+			break;
 		}
-		return len;
+		if (pfd[1].revents)
+			break;
+		if (pfd[0].revents)
+			nful_read(g);
 	}
 
-	nflog_handle_packet(ui->nful_h, (char *)ui->nfulog_buf, len);
+	return NULL;
+}
 
-	return 0;
+/* count packet nfa of group g, and the ones the kernel couldn't send
+ * us before it according to the local sequence number */
+static void account_packet(struct nflog_group *g, struct nflog_data *nfa)
+{
+	uint32_t seq, gap;
+
+	STAT_ADD(g, packets, 1);
+
+	if (nflog_get_seq(nfa, &seq) != 0)
+		return;
+	gap = seq - g->seq_next;
+	/* a large gap backwards is a restarted kernel instance */
+	if (g->seq_known && gap != 0 && gap < 0x80000000)
+		STAT_ADD(g, lost, gap);
+	g->seq_next = seq + 1;
+	g->seq_known = true;
 }
 
 /* callback called by libnfnetlink* for every nlmsg */
 static int msg_cb(struct nflog_g_handle *gh, struct nfgenmsg *nfmsg,
 		  struct nflog_data *nfa, void *data)
 {
-	struct ulogd_pluginstance *upi = data;
+	struct nflog_group *g = data;
+	struct ulogd_pluginstance *upi = g->upi;
 	struct ulogd_pluginstance *npi = NULL;
-	void *ct = build_ct(nfmsg);
+	struct nf_conntrack *ct = NULL;
 	int ret = 0;
 
-	/* since we support the re-use of one instance in several 
+	account_packet(g, nfa);
+	if (g->qtune)
+		qtune_account(g, nfa);
+
+	/* on a reader thread: the core runs the record in the main loop,
+	 * for the instances sharing this one, too. The ct key doesn't
+	 * make it through the queue. */
+	if (g->feed) {
+		ret = interp_packet(upi, g->rec, nfmsg->nfgen_family, nfa,
+				    NULL);
+		ulogd_feed_push(g->feed, g->rec);
+		return ret;
+	}
+
+	/* parsing the conntrack attached to the packet is costly, only do
+	 * it if the ct key is used */
+	if (ct_needed(upi))
+		ct = build_ct(nfmsg);
+
+	/* since we support the re-use of one instance in several
 	 * different stacks, we duplicate the message to let them know */
 	llist_for_each_entry(npi, &upi->plist, plist) {
-		ret = interp_packet(npi, nfmsg->nfgen_family, nfa, ct);
+		ret = interp_packet(npi, npi->output.keys,
+				    nfmsg->nfgen_family, nfa, ct);
 		if (ret != 0)
 			goto release_ct;
+		ulogd_propagate_results(npi);
 	}
-	ret = interp_packet(upi, nfmsg->nfgen_family, nfa, ct);
+	ret = interp_packet(upi, upi->output.keys, nfmsg->nfgen_family,
+			    nfa, ct);
+	if (ret == 0)
+		ulogd_propagate_results(upi);
 
 release_ct:
 #ifdef BUILD_NFCT
@@ -561,15 +1027,14 @@ static int configure(struct ulogd_pluginstance *upi,
 	return 0;
 }
 
-static int become_system_logging(struct ulogd_pluginstance *upi, uint8_t pf)
+static int become_system_logging(struct nflog_handle *h, uint8_t pf,
+				 struct ulogd_pluginstance *upi)
 {
-	struct nflog_input *ui = (struct nflog_input *) upi->private;
-
 	if (unbind_ce(upi->config_kset).u.value > 0) {
 		ulogd_log(ULOGD_NOTICE, "forcing unbind of existing log "
 				"handler for protocol %d\n",
 				pf);
-		if (nflog_unbind_pf(ui->nful_h, pf) < 0) {
+		if (nflog_unbind_pf(h, pf) < 0) {
 			ulogd_log(ULOGD_ERROR, "unable to force-unbind "
 					"existing log handler for protocol %d\n",
 					pf);
@@ -578,7 +1043,7 @@ static int become_system_logging(struct ulogd_pluginstance *upi, uint8_t pf)
 	}
 
 	ulogd_log(ULOGD_DEBUG, "binding to protocol family %d\n", pf);
-	if (nflog_bind_pf(ui->nful_h, pf) < 0) {
+	if (nflog_bind_pf(h, pf) < 0) {
 		ulogd_log(ULOGD_ERROR, "unable to bind to"
 				" protocol family %d\n", pf);
 		return -1;
@@ -586,51 +1051,83 @@ static int become_system_logging(struct ulogd_pluginstance *upi, uint8_t pf)
 	return 0;
 }
 
-static int start(struct ulogd_pluginstance *upi)
+/* open the socket of group g, the first one also binds the protocol
+ * families if requested */
+static int open_group(struct ulogd_pluginstance *upi, struct nflog_group *g,
+		      int first)
 {
-	struct nflog_input *ui = (struct nflog_input *) upi->private;
-	unsigned int flags;
-
-	ui->nfulog_buf = malloc(bufsiz_ce(upi->config_kset).u.value);
-	if (!ui->nfulog_buf)
+	int bufsiz = bufsiz_ce(upi->config_kset).u.value;
+	unsigned int flags, i;
+	int range;
+
+	g->batch = read_budget_ce(upi->config_kset).u.value;
+	if (g->batch == 0)
+		g->batch = 1;
+	if (g->batch > NFLOG_RECV_BATCH)
+		g->batch = NFLOG_RECV_BATCH;
+
+	g->nfulog_buf = malloc((size_t)bufsiz * g->batch);
+	if (!g->nfulog_buf)
 		goto out_buf;
 
+	for (i = 0; i < g->batch; i++) {
+		g->iov[i].iov_base = g->nfulog_buf + (size_t)bufsiz * i;
+		g->iov[i].iov_len = bufsiz;
+		g->msgs[i].msg_hdr.msg_iov = &g->iov[i];
+		g->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
 	ulogd_log(ULOGD_DEBUG, "opening nfnetlink socket\n");
-	ui->nful_h = nflog_open();
-	if (!ui->nful_h)
+	g->nful_h = nflog_open();
+	if (!g->nful_h)
 		goto out_handle;
 
 	/* This is the system logging (conntrack, ...) facility */
-	if ((group_ce(upi->config_kset).u.value == 0) ||
-			(bind_ce(upi->config_kset).u.value > 0)) {
-		if (become_system_logging(upi, AF_INET) == -1)
+	if (first && ((group_ce(upi->config_kset).u.value == 0) ||
+		      (bind_ce(upi->config_kset).u.value > 0))) {
+		if (become_system_logging(g->nful_h, AF_INET, upi) == -1)
 			goto out_handle;
-		if (become_system_logging(upi, AF_INET6) == -1)
+		if (become_system_logging(g->nful_h, AF_INET6, upi) == -1)
 			goto out_handle;
-		if (become_system_logging(upi, AF_BRIDGE) == -1)
+		if (become_system_logging(g->nful_h, AF_BRIDGE, upi) == -1)
 			goto out_handle;
 	}
 
-	ulogd_log(ULOGD_DEBUG, "binding to log group %d\n",
-		  group_ce(upi->config_kset).u.value);
-	ui->nful_gh = nflog_bind_group(ui->nful_h,
-				       group_ce(upi->config_kset).u.value);
-	if (!ui->nful_gh) {
+	ulogd_log(ULOGD_DEBUG, "binding to log group %d\n", g->num);
+	g->nful_gh = nflog_bind_group(g->nful_h, g->num);
+	if (!g->nful_gh) {
 		ulogd_log(ULOGD_ERROR, "unable to bind to log group %d\n",
-			  group_ce(upi->config_kset).u.value);
+			  g->num);
 		goto out_bind;
 	}
 
-	nflog_set_mode(ui->nful_gh, NFULNL_COPY_PACKET, 0xffff);
+	/* with copy_range=-1, start with whole packets, the main loop
+	 * reduces it once all stacks are built */
+	range = copy_range_ce(upi->config_kset).u.value;
+	if (range < 0 || range > 0xffff)
+		range = 0xffff;
+	nflog_set_mode(g->nful_gh, NFULNL_COPY_PACKET, range);
+	g->copy_range = g->copy_want = range;
 
 	if (nlsockbufsize_ce(upi->config_kset).u.value) {
-		setnlbufsiz(upi, nlsockbufsize_ce(upi->config_kset).u.value);
+		setnlbufsiz(upi, g, nlsockbufsize_ce(upi->config_kset).u.value);
 		ulogd_log(ULOGD_NOTICE, "NFLOG netlink buffer size has been "
-					"set to %d\n", ui->nlbufsiz);
+					"set to %d\n", g->nlbufsiz);
 	}
 
-	if (nlthreshold_ce(upi->config_kset).u.value) {
-		if (nflog_set_qthresh(ui->nful_gh,
+	g->qtune = qautotune_ce(upi->config_kset).u.value != 0;
+	if (g->qtune) {
+		/* start from the configured values, or from the lowest
+		 * latency, the controller takes over at the first read */
+		g->qthresh = nlthreshold_ce(upi->config_kset).u.value ? : 1;
+		g->qtimeout = nltimeout_ce(upi->config_kset).u.value ? : 1;
+		g->qtune_next = now_usec() + NFLOG_QTUNE_INTERVAL;
+		nflog_set_qthresh(g->nful_gh, g->qthresh);
+		nflog_set_timeout(g->nful_gh, g->qtimeout);
+		ulogd_log(ULOGD_NOTICE, "NFLOG netlink queue auto-tuning "
+			  "enabled on group %u\n", g->num);
+	} else if (nlthreshold_ce(upi->config_kset).u.value) {
+		if (nflog_set_qthresh(g->nful_gh,
 				  nlthreshold_ce(upi->config_kset).u.value)
 				>= 0)
 			ulogd_log(ULOGD_NOTICE,
@@ -644,8 +1141,8 @@ static int start(struct ulogd_pluginstance *upi)
 				  nlthreshold_ce(upi->config_kset).u.value);
 	}
 
-	if (nltimeout_ce(upi->config_kset).u.value) {
-		if (nflog_set_timeout(ui->nful_gh,
+	if (!g->qtune && nltimeout_ce(upi->config_kset).u.value) {
+		if (nflog_set_timeout(g->nful_gh,
 				      nltimeout_ce(upi->config_kset).u.value)
 			>= 0)
 			ulogd_log(ULOGD_NOTICE,
@@ -661,54 +1158,338 @@ static int start(struct ulogd_pluginstance *upi)
 
 	/* set log flags based on configuration */
 	flags = 0;
-	if (seq_ce(upi->config_kset).u.value != 0)
+	if (seq_ce(upi->config_kset).u.value != 0 ||
+	    stats_interval_ce(upi->config_kset).u.value > 0)
 		flags = NFULNL_CFG_F_SEQ;
 	if (seq_global_ce(upi->config_kset).u.value != 0)
 		flags |= NFULNL_CFG_F_SEQ_GLOBAL;
 	if (attach_conntrack_ce(upi->config_kset).u.value != 0)
 		flags |= NFULNL_CFG_F_CONNTRACK;
 	if (flags) {
-		if (nflog_set_flags(ui->nful_gh, flags) < 0)
+		if (nflog_set_flags(g->nful_gh, flags) < 0)
 			ulogd_log(ULOGD_ERROR, "unable to set flags 0x%x\n",
 				  flags);
 	}
 
-	nflog_callback_register(ui->nful_gh, &msg_cb, upi);
-
-	ui->nful_fd.fd = nflog_fd(ui->nful_h);
-	ui->nful_fd.cb = &nful_read_cb;
-	ui->nful_fd.data = upi;
-	ui->nful_fd.when = ULOGD_FD_READ;
-
-	if (ulogd_register_fd(&ui->nful_fd) < 0)
-		goto out_bind;
+	nflog_callback_register(g->nful_gh, &msg_cb, g);
 
-	ui->nful_overrun_warned = false;
+	g->upi = upi;
+	g->nful_fd.fd = nflog_fd(g->nful_h);
+	g->nful_fd.cb = &nful_read_cb;
+	g->nful_fd.data = g;
+	g->nful_fd.when = ULOGD_FD_READ;
+	g->nful_overrun_warned = false;
 
 	return 0;
 
 out_bind:
-	if (group_ce(upi->config_kset).u.value == 0) {
-		nflog_unbind_pf(ui->nful_h, AF_INET);
-		nflog_unbind_pf(ui->nful_h, AF_INET6);
-		nflog_unbind_pf(ui->nful_h, AF_BRIDGE);
+	if (first && group_ce(upi->config_kset).u.value == 0) {
+		nflog_unbind_pf(g->nful_h, AF_INET);
+		nflog_unbind_pf(g->nful_h, AF_INET6);
+		nflog_unbind_pf(g->nful_h, AF_BRIDGE);
 	}
-	nflog_close(ui->nful_h);
+	nflog_close(g->nful_h);
 out_handle:
-	free(ui->nfulog_buf);
+	free(g->nfulog_buf);
 out_buf:
 	return -1;
 }
 
+static void close_group(struct nflog_group *g)
+{
+	nflog_unbind_group(g->nful_gh);
+	nflog_close(g->nful_h);
+	free(g->nfulog_buf);
+}
+
+/* have group g read on a thread of its own */
+static int start_reader(struct ulogd_pluginstance *upi, struct nflog_group *g)
+{
+	sigset_t all, old;
+	int ret;
+
+	g->rec = calloc(upi->output.num_keys, sizeof(struct ulogd_key));
+	if (!g->rec)
+		return -1;
+	ulogd_init_record(upi, g->rec);
+
+	g->feed = ulogd_feed_create(upi,
+			reader_queue_size_ce(upi->config_kset).u.value);
+	if (!g->feed)
+		goto out_rec;
+
+	g->stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (g->stop_fd < 0)
+		goto out_feed;
+
+	/* as in the main loop, so that netlink_qautotune requests never
+	 * block waiting for an acknowledgement that was lost */
+	fcntl(g->nful_fd.fd, F_SETFL,
+	      fcntl(g->nful_fd.fd, F_GETFL) | O_NONBLOCK);
+
+	/* signals are handled by the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&g->thread, NULL, nful_reader, g);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		ulogd_log(ULOGD_ERROR, "can't start reader of group %u: %s\n",
+			  g->num, strerror(ret));
+		goto out_fd;
+	}
+
+	return 0;
+
+out_fd:
+	close(g->stop_fd);
+out_feed:
+	ulogd_feed_destroy(g->feed);
+	g->feed = NULL;
+out_rec:
+	free(g->rec);
+	return -1;
+}
+
+static void stop_reader(struct nflog_group *g)
+{
+	uint64_t one = 1;
+
+	if (write(g->stop_fd, &one, sizeof(one)) == sizeof(one))
+		pthread_join(g->thread, NULL);
+	close(g->stop_fd);
+	ulogd_feed_destroy(g->feed);
+	g->feed = NULL;
+	free(g->rec);
+}
+
+static void stats_get(struct nflog_group *g, struct nflog_stats *st)
+{
+	st->packets = STAT_GET(g, packets);
+	st->bytes = STAT_GET(g, bytes);
+	st->lost = STAT_GET(g, lost);
+	st->overruns = STAT_GET(g, overruns);
+}
+
+/* does the stack of pi resolve a key of the summary records, with no
+ * filter expecting packets? Such a filter would see an empty one. */
+static bool stats_needed(struct ulogd_pluginstance *pi)
+{
+	struct ulogd_key *ret = pi->output.keys;
+	struct ulogd_pluginstance *p;
+
+	if (!((ret[NFLOG_KEY_STATS_PACKETS].flags |
+	       ret[NFLOG_KEY_STATS_BYTES].flags |
+	       ret[NFLOG_KEY_STATS_LOST].flags |
+	       ret[NFLOG_KEY_STATS_OVERRUNS].flags) & ULOGD_RETF_NEEDED))
+		return false;
+
+	llist_for_each_entry(p, &pi->stack->list, list) {
+		if (p == pi || p->plugin->output.type & ULOGD_DTYPE_SINK)
+			continue;
+		if (p->plugin->input.type &
+		    (ULOGD_DTYPE_RAW | ULOGD_DTYPE_PACKET))
+			return false;
+	}
+	return true;
+}
+
+/* propagate a summary record of group g through the stack of pi */
+static void stats_propagate(struct ulogd_pluginstance *pi,
+			    struct nflog_group *g, struct nflog_stats *st,
+			    struct timeval *tv)
+{
+	struct ulogd_key *ret = pi->output.keys;
+
+	okey_set_u32(&ret[NFLOG_KEY_OOB_TIME_SEC], tv->tv_sec);
+	okey_set_u32(&ret[NFLOG_KEY_OOB_TIME_USEC], tv->tv_usec);
+	okey_set_u16(&ret[NFLOG_KEY_GROUP], g->num);
+	okey_set_u64(&ret[NFLOG_KEY_STATS_PACKETS], st->packets);
+	okey_set_u64(&ret[NFLOG_KEY_STATS_BYTES], st->bytes);
+	okey_set_u64(&ret[NFLOG_KEY_STATS_LOST], st->lost);
+	okey_set_u64(&ret[NFLOG_KEY_STATS_OVERRUNS], st->overruns);
+	ulogd_propagate_results(pi);
+}
+
+/* every stats_interval, send one record per group with the counters
+ * of the period */
+static void stats_timer_cb(struct ulogd_timer *t, void *data)
+{
+	struct ulogd_pluginstance *upi = data;
+	struct nflog_input *ui = (struct nflog_input *) upi->private;
+	struct ulogd_pluginstance *npi;
+	struct timeval now;
+	unsigned int i;
+
+	gettimeofday(&now, NULL);
+
+	for (i = 0; i < ui->num_groups; i++) {
+		struct nflog_group *g = &ui->groups[i];
+		struct nflog_stats cur, period;
+
+		stats_get(g, &cur);
+		period.packets = cur.packets - g->stats_last.packets;
+		period.bytes = cur.bytes - g->stats_last.bytes;
+		period.lost = cur.lost - g->stats_last.lost;
+		period.overruns = cur.overruns - g->stats_last.overruns;
+		g->stats_last = cur;
+
+		llist_for_each_entry(npi, &upi->plist, plist) {
+			if (stats_needed(npi))
+				stats_propagate(npi, g, &period, &now);
+		}
+		if (stats_needed(upi))
+			stats_propagate(upi, g, &period, &now);
+	}
+
+	ulogd_add_timer(&ui->stats_timer,
+			stats_interval_ce(upi->config_kset).u.value);
+}
+
+/* smallest copy range serving the stacks of pi: none if neither the
+ * packet nor its length is read, the headers if only header parsers
+ * read it.  raw.pktlen is only set when some payload is copied. */
+static int copy_range_needed(struct ulogd_pluginstance *pi)
+{
+	struct ulogd_key *ret = pi->output.keys;
+
+	if ((ret[NFLOG_KEY_RAW_PCKT].flags | ret[NFLOG_KEY_RAW].flags) &
+	    ULOGD_RETF_PAYLOAD)
+		return 0xffff;
+	if ((ret[NFLOG_KEY_RAW_PCKT].flags | ret[NFLOG_KEY_RAW].flags |
+	     ret[NFLOG_KEY_RAW_PCKTLEN].flags) & ULOGD_RETF_NEEDED)
+		return NFLOG_COPY_HEADERS;
+	return 0;
+}
+
+/* run once from the main loop, when the keys of all stacks sharing the
+ * instance have been resolved */
+static void copy_timer_cb(struct ulogd_timer *t, void *data)
+{
+	struct ulogd_pluginstance *upi = data;
+	struct nflog_input *ui = (struct nflog_input *) upi->private;
+	struct ulogd_pluginstance *npi;
+	int range = copy_range_needed(upi);
+	unsigned int i;
+
+	llist_for_each_entry(npi, &upi->plist, plist) {
+		int r = copy_range_needed(npi);
+
+		if (r > range)
+			range = r;
+	}
+
+	for (i = 0; i < ui->num_groups; i++) {
+		struct nflog_group *g = &ui->groups[i];
+
+		__atomic_store_n(&g->copy_want, range, __ATOMIC_RELAXED);
+		/* reader threads switch at their next read */
+		if (!g->feed)
+			copy_apply(g);
+	}
+}
+
+static void signal_nflog(struct ulogd_pluginstance *upi, int signal)
+{
+	struct nflog_input *ui = (struct nflog_input *) upi->private;
+	unsigned int i;
+
+	if (signal != SIGUSR2)
+		return;
+
+	for (i = 0; i < ui->num_groups; i++) {
+		struct nflog_stats st;
+
+		stats_get(&ui->groups[i], &st);
+		ulogd_log(ULOGD_NOTICE, "NFLOG group %u: %llu packets, "
+			  "%llu bytes, %llu lost, %llu overruns\n",
+			  ui->groups[i].num,
+			  (unsigned long long)st.packets,
+			  (unsigned long long)st.bytes,
+			  (unsigned long long)st.lost,
+			  (unsigned long long)st.overruns);
+	}
+}
+
+static int start(struct ulogd_pluginstance *upi)
+{
+	struct nflog_input *ui = (struct nflog_input *) upi->private;
+	int threads = reader_threads_ce(upi->config_kset).u.value;
+	int cpu = reader_cpu_ce(upi->config_kset).u.value;
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int i;
+
+	ui->num_groups = num_groups_ce(upi->config_kset).u.value;
+	if (ui->num_groups == 0)
+		ui->num_groups = 1;
+	ui->groups = calloc(ui->num_groups, sizeof(struct nflog_group));
+	if (!ui->groups)
+		return -1;
+
+	for (i = 0; i < ui->num_groups; i++) {
+		struct nflog_group *g = &ui->groups[i];
+
+		g->num = group_ce(upi->config_kset).u.value + i;
+		g->cpu = -1;
+		if (cpu >= 0 && ncpus > 0)
+			g->cpu = (cpu + i) % ncpus;
+
+		if (open_group(upi, g, i == 0) < 0)
+			goto err;
+
+		if (threads ? start_reader(upi, g) < 0 :
+			      ulogd_register_fd(&g->nful_fd) < 0) {
+			close_group(g);
+			goto err;
+		}
+	}
+
+	ulogd_init_timer(&ui->copy_timer, upi, copy_timer_cb);
+	if (copy_range_ce(upi->config_kset).u.value < 0)
+		ulogd_add_timer(&ui->copy_timer, 0);
+
+	ulogd_init_timer(&ui->stats_timer, upi, stats_timer_cb);
+	if (stats_interval_ce(upi->config_kset).u.value > 0)
+		ulogd_add_timer(&ui->stats_timer,
+				stats_interval_ce(upi->config_kset).u.value);
+
+	if (ui->num_groups > 1 || threads)
+		ulogd_log(ULOGD_NOTICE, "NFLOG reading groups %u-%u%s\n",
+			  ui->groups[0].num,
+			  ui->groups[ui->num_groups - 1].num,
+			  threads ? " on reader threads" : "");
+
+	return 0;
+
+err:
+	while (i-- > 0) {
+		if (ui->groups[i].feed)
+			stop_reader(&ui->groups[i]);
+		else
+			ulogd_unregister_fd(&ui->groups[i].nful_fd);
+		close_group(&ui->groups[i]);
+	}
+	free(ui->groups);
+	return -1;
+}
+
 static int stop(struct ulogd_pluginstance *pi)
 {
 	struct nflog_input *ui = (struct nflog_input *)pi->private;
+	unsigned int i;
 
-	ulogd_unregister_fd(&ui->nful_fd);
-	nflog_unbind_group(ui->nful_gh);
-	nflog_close(ui->nful_h);
+	ulogd_del_timer(&ui->stats_timer);
+	ulogd_del_timer(&ui->copy_timer);
 
-	free(ui->nfulog_buf);
+	for (i = 0; i < ui->num_groups; i++) {
+		struct nflog_group *g = &ui->groups[i];
+
+		if (g->feed)
+			stop_reader(g);
+		else
+			ulogd_unregister_fd(&g->nful_fd);
+		close_group(g);
+	}
+	free(ui->groups);
 
 	return 0;
 }
@@ -727,6 +1508,7 @@ struct ulogd_plugin libulog_plugin = {
 	.configure 	= &configure,
 	.start 		= &start,
 	.stop 		= &stop,
+	.signal 	= &signal_nflog,
 	.config_kset 	= &libulog_kset,
 	.version	= VERSION,
 };
@@ -191,6 +191,7 @@ static int interp_packet(struct ulogd_pluginstance *ip, ulog_packet_msg_t *pkt)
 
 	if (pkt->mac_len) {
 		okey_set_ptr(&ret[ULOG_KEY_RAW_MAC], pkt->mac);
+		ret[ULOG_KEY_RAW_MAC].len = pkt->mac_len;
 		okey_set_u16(&ret[ULOG_KEY_RAW_MAC_LEN], pkt->mac_len);
 	}
 
@@ -198,6 +199,7 @@ static int interp_packet(struct ulogd_pluginstance *ip, ulog_packet_msg_t *pkt)
 
 	/* include pointer to raw ipv4 packet */
 	okey_set_ptr(&ret[ULOG_KEY_RAW_PCKT], pkt->payload);
+	ret[ULOG_KEY_RAW_PCKT].len = pkt->data_len;
 	okey_set_u32(&ret[ULOG_KEY_RAW_PCKTLEN], pkt->data_len);
 	okey_set_u32(&ret[ULOG_KEY_RAW_PCKTCOUNT], 1);
 
@@ -24,6 +24,9 @@
 #include <libmnl/libmnl.h>
 #include <libnetfilter_acct/libnetfilter_acct.h>
 
+/* maximum number of counters propagated in one batch */
+#define NFACCT_BATCH_MAX	64
+
 struct nfacct_pluginstance {
 	struct mnl_socket	*nl;
 	uint32_t		portid;
@@ -31,6 +34,11 @@ struct nfacct_pluginstance {
 	struct ulogd_fd		ufd;
 	struct ulogd_timer	timer;
 	struct timeval tv;
+	/* counters received but not yet propagated */
+	struct nfacct		*batch[NFACCT_BATCH_MAX];
+	struct ulogd_key	*records[NFACCT_BATCH_MAX];
+	struct ulogd_key	*keys;
+	unsigned int		batch_len;
 };
 
 static struct config_keyset nfacct_kset = {
@@ -103,9 +111,9 @@ static struct ulogd_key nfacct_okeys[] = {
 };
 
 static void
-propagate_nfacct(struct ulogd_pluginstance *upi, struct nfacct *nfacct)
+fill_nfacct(struct ulogd_pluginstance *upi, struct ulogd_key *ret,
+	    struct nfacct *nfacct)
 {
-	struct ulogd_key *ret = upi->output.keys;
 	struct nfacct_pluginstance *cpi = (struct nfacct_pluginstance *) upi->private;
 
 	okey_set_ptr(&ret[ULOGD_NFACCT_NAME],
@@ -120,27 +128,35 @@ propagate_nfacct(struct ulogd_pluginstance *upi, struct nfacct *nfacct)
 		okey_set_u32(&ret[ULOGD_NFACCT_TIME_SEC], cpi->tv.tv_sec);
 		okey_set_u32(&ret[ULOGD_NFACCT_TIME_USEC], cpi->tv.tv_usec);
 	}
-
-	ulogd_propagate_results(upi);
 }
 
-static void
-do_propagate_nfacct(struct ulogd_pluginstance *upi, struct nfacct *nfacct)
+static void do_propagate_nfacct(struct ulogd_pluginstance *upi)
 {
+	struct nfacct_pluginstance *cpi =
+		(struct nfacct_pluginstance *) upi->private;
 	struct ulogd_pluginstance *npi = NULL;
+	unsigned int i;
+
+	if (cpi->batch_len == 0)
+		return;
 
 	llist_for_each_entry(npi, &upi->plist, plist)
-		propagate_nfacct(npi, nfacct);
+		ulogd_propagate_batch(npi, cpi->records, cpi->batch_len);
 
-	propagate_nfacct(upi, nfacct);
+	ulogd_propagate_batch(upi, cpi->records, cpi->batch_len);
 
-	nfacct_free(nfacct);
+	for (i = 0; i < cpi->batch_len; i++)
+		nfacct_free(cpi->batch[i]);
+	cpi->batch_len = 0;
 }
 
 static int nfacct_cb(const struct nlmsghdr *nlh, void *data)
 {
 	struct nfacct *nfacct;
 	struct ulogd_pluginstance *upi = data;
+	struct nfacct_pluginstance *cpi =
+		(struct nfacct_pluginstance *) upi->private;
+	struct ulogd_key *rec;
 
 	nfacct = nfacct_alloc();
 	if (nfacct == NULL) {
@@ -150,10 +166,17 @@ static int nfacct_cb(const struct nlmsghdr *nlh, void *data)
 
 	if (nfacct_nlmsg_parse_payload(nlh, nfacct) < 0) {
 		ulogd_log(ULOGD_ERROR, "Error parsing nfacct message");
+		nfacct_free(nfacct);
 		goto err;
 	}
 
-	do_propagate_nfacct(upi, nfacct);
+	rec = cpi->records[cpi->batch_len];
+	ulogd_init_record(upi, rec);
+	fill_nfacct(upi, rec, nfacct);
+	cpi->batch[cpi->batch_len++] = nfacct;
+
+	if (cpi->batch_len == NFACCT_BATCH_MAX)
+		do_propagate_nfacct(upi);
 
 err:
 	return MNL_CB_OK;
@@ -174,6 +197,8 @@ static int nfacct_read_cb(int fd, unsigned int what, void *param)
 	if (ret > 0) {
 		ret = mnl_cb_run(buf, ret, cpi->seq,
 				 cpi->portid, nfacct_cb, upi);
+		/* all counters of this message go down the stack at once */
+		do_propagate_nfacct(upi);
 	}
 	return ret;
 }
@@ -236,10 +261,20 @@ static int constructor_nfacct(struct ulogd_pluginstance *upi)
 {
 	struct nfacct_pluginstance *cpi =
 		(struct nfacct_pluginstance *)upi->private;
+	unsigned int i;
 
 	if (pollint_ce(upi->config_kset).u.value == 0)
 		return -1;
 
+	cpi->keys = calloc(NFACCT_BATCH_MAX, sizeof(struct ulogd_key) *
+					     upi->output.num_keys);
+	if (cpi->keys == NULL) {
+		ulogd_log(ULOGD_FATAL, "OOM\n");
+		return -1;
+	}
+	for (i = 0; i < NFACCT_BATCH_MAX; i++)
+		cpi->records[i] = &cpi->keys[i * upi->output.num_keys];
+
 	cpi->nl = mnl_socket_open(NETLINK_NETFILTER);
 	if (cpi->nl == NULL) {
 		ulogd_log(ULOGD_FATAL, "cannot open netlink socket\n");
@@ -272,6 +307,7 @@ static int destructor_nfacct(struct ulogd_pluginstance *upi)
 	ulogd_del_timer(&cpi->timer);
 	ulogd_unregister_fd(&cpi->ufd);
 	mnl_socket_close(cpi->nl);
+	free(cpi->keys);
 
 	return 0;
 }
@@ -138,7 +138,8 @@ sqlite3_interp(struct ulogd_pluginstance *pi)
 	tailq_for_each(f, priv->fields, link) {
 		struct ulogd_key *k_ret = f->key->u.source;
 
-		if (f->key == NULL || !IS_VALID(*k_ret)) {
+		if (f->key == NULL ||
+		    !ulogd_input_valid(pi, f->key - pi->input.keys)) {
 			sqlite3_bind_null(priv->p_stmt, i);
 			i++;
 			continue;
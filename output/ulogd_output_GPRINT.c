@@ -75,10 +75,25 @@ static struct config_keyset gprint_kset = {
         ((unsigned char *)&addr)[2], \
         ((unsigned char *)&addr)[3]
 
-static int gprint_interp(struct ulogd_pluginstance *upi)
+/* index of the next valid key at or after i, in rec or in the inputs */
+static int gprint_next(struct ulogd_pluginstance *upi, struct ulogd_key *rec,
+		       unsigned int i)
+{
+	if (!rec)
+		return ulogd_next_valid_input(upi, i);
+
+	for (; i < upi->input.num_keys; i++) {
+		if (IS_VALID(rec[i]))
+			return i;
+	}
+	return -1;
+}
+
+/* print one line, if rec is NULL the input keys are resolved as usual */
+static void gprint_line(struct ulogd_pluginstance *upi, struct ulogd_key *rec)
 {
 	struct gprint_priv *opi = (struct gprint_priv *) &upi->private;
-	unsigned int i;
+	int i;
 	char buf[4096];
 	int rem = sizeof(buf), size = 0, ret;
 
@@ -94,19 +109,15 @@ static int gprint_interp(struct ulogd_pluginstance *upi)
 				1900 + tm.tm_year, tm.tm_mon + 1, tm.tm_mday,
 				tm.tm_hour, tm.tm_min, tm.tm_sec);
 		if (ret < 0)
-			return ULOGD_IRET_OK;
+			return;
 		rem -= ret;
 		size += ret;
 	}
 
-	for (i = 0; i < upi->input.num_keys; i++) {
-		struct ulogd_key *key = upi->input.keys[i].u.source;
-
-		if (!key)
-			continue;
-
-		if (!IS_VALID(*key))
-			continue;
+	for (i = gprint_next(upi, rec, 0); i >= 0;
+	     i = gprint_next(upi, rec, i + 1)) {
+		struct ulogd_key *key = rec ? &rec[i] :
+					      upi->input.keys[i].u.source;
 
 		switch (key->type) {
 		case ULOGD_RET_STRING:
@@ -177,6 +188,29 @@ static int gprint_interp(struct ulogd_pluginstance *upi)
 	}
 	buf[size-1]='\0';
 	fprintf(opi->of, "%s\n", buf);
+}
+
+static int gprint_interp(struct ulogd_pluginstance *upi)
+{
+	struct gprint_priv *opi = (struct gprint_priv *) &upi->private;
+
+	gprint_line(upi, NULL);
+
+	if (upi->config_kset->ces[GPRINT_CONF_SYNC].u.value != 0)
+		fflush(opi->of);
+
+	return ULOGD_IRET_OK;
+}
+
+/* with sync=1, flush once per batch rather than once per line */
+static int gprint_interp_batch(struct ulogd_pluginstance *upi,
+			       struct ulogd_key **records, unsigned int num)
+{
+	struct gprint_priv *opi = (struct gprint_priv *) &upi->private;
+	unsigned int i;
+
+	for (i = 0; i < num; i++)
+		gprint_line(upi, records[i]);
 
 	if (upi->config_kset->ces[GPRINT_CONF_SYNC].u.value != 0)
 		fflush(opi->of);
@@ -256,6 +290,7 @@ static struct ulogd_plugin gprint_plugin = {
 	},
 	.configure = &gprint_configure,
 	.interp	= &gprint_interp,
+	.interp_batch = &gprint_interp_batch,
 	.start 	= &gprint_init,
 	.stop	= &gprint_fini,
 	.signal = &sighup_handler_print,
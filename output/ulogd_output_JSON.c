@@ -276,7 +276,7 @@ static int json_interp_file(struct ulogd_pluginstance *upi, char *buf)
 static int json_interp(struct ulogd_pluginstance *upi)
 {
 	struct json_priv *opi = (struct json_priv *) &upi->private;
-	unsigned int i;
+	int i;
 	char *buf, *tmp;
 	size_t buflen;
 	json_t *msg;
@@ -340,16 +340,10 @@ static int json_interp(struct ulogd_pluginstance *upi)
 		json_object_set_new(msg, "dvc", json_string(dvc));
 	}
 
-	for (i = 0; i < upi->input.num_keys; i++) {
+	ulogd_for_each_valid_input(upi, i) {
 		struct ulogd_key *key = upi->input.keys[i].u.source;
 		char *field_name;
 
-		if (!key)
-			continue;
-
-		if (!IS_VALID(*key))
-			continue;
-
 		field_name = key->cim_name ? key->cim_name : key->name;
 
 		switch (key->type) {
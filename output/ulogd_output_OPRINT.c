@@ -50,19 +50,12 @@ struct oprint_priv {
 static int oprint_interp(struct ulogd_pluginstance *upi)
 {
 	struct oprint_priv *opi = (struct oprint_priv *) &upi->private;
-	unsigned int i;
+	int i;
 	
 	fprintf(opi->of, "===>PACKET BOUNDARY\n");
-	for (i = 0; i < upi->input.num_keys; i++) {
+	ulogd_for_each_valid_input(upi, i) {
 		struct ulogd_key *ret = upi->input.keys[i].u.source;
 
-		if (!ret)
-			ulogd_log(ULOGD_NOTICE, "no result for %s ?!?\n",
-				  upi->input.keys[i].name);
-		
-		if (!IS_VALID(*ret))
-			continue;
-
 		fprintf(opi->of,"%s=", ret->name);
 		switch (ret->type) {
 			case ULOGD_RET_STRING:
@@ -24,111 +24,644 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* buckets moved per lookup or insertion while resizing, and how many
+ * empty ones may be skipped for each */
+#define REHASH_STEPS	4
+#define REHASH_EMPTY	10
+
+/*
+ * Instead of returning hash % size (implying a divide) we return the high
+ * 32 bits of the (hash * size) that will give results between [0 and
+ * size-1] and same hash distribution, but using a multiply, less
+ * expensive than a divide. See:
+ * http://www.mail-archive.com/netdev@vger.kernel.org/msg56623.html
+ */
+static inline uint32_t bucket_of(uint32_t hash, uint32_t size)
+{
+	return ((uint64_t)hash * size) >> 32;
+}
+
+/* buckets come zeroed from calloc() and are only initialized once used,
+ * so that a large table is not written all at once */
+static inline int bucket_empty(const struct llist_head *b)
+{
+	return b->next == NULL || llist_empty(b);
+}
+
+static inline struct llist_head *bucket_get(struct llist_head *b)
+{
+	if (b->next == NULL)
+		INIT_LLIST_HEAD(b);
+	return b;
+}
+
+/*
+ * HASHTABLE_F_OPEN: slots are probed by groups of GROUP, in triangular
+ * order from the group the low bits of the hash point to, which visits
+ * all groups of a power of two sized table.  The control byte of a slot
+ * holds the 7 high bits of the hash of its node, or tells that the slot
+ * is empty or was deleted.  A lookup stops at the first group with an
+ * empty slot, so a slot is only emptied again if its group has one
+ * already: no probe can have gone past such a group.
+ */
+#define GROUP		16
+#define CTRL_EMPTY	0x00	/* as left by calloc() */
+#define CTRL_DELETED	0x01
+#define CTRL_FULL	0x80
+
+static inline uint8_t ctrl_of(uint32_t hash)
+{
+	return CTRL_FULL | hash >> 25;
+}
+
+static inline uint32_t group_next(uint32_t pos, uint32_t i, uint32_t size)
+{
+	return (pos + (i + 1) * GROUP) & (size - 1);
+}
+
+#ifdef __SSE2__
+static inline uint32_t group_match(const uint8_t *g, uint8_t c)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *)g);
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
+
+static inline uint32_t group_full(const uint8_t *g)
+{
+	return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)g));
+}
+#else
+static inline uint32_t group_match(const uint8_t *g, uint8_t c)
+{
+	uint32_t i, m = 0;
+
+	for (i = 0; i < GROUP; i++)
+		if (g[i] == c)
+			m |= 1U << i;
+	return m;
+}
+
+static inline uint32_t group_full(const uint8_t *g)
+{
+	uint32_t i, m = 0;
+
+	for (i = 0; i < GROUP; i++)
+		if (g[i] & CTRL_FULL)
+			m |= 1U << i;
+	return m;
+}
+#endif
+
+static struct hashtable_node *
+oa_find(const struct hashtable *table, const uint8_t *ctrl,
+	struct hashtable_node **slots, uint32_t size,
+	const void *data, uint32_t hash)
+{
+	uint32_t i, m, pos = hash & (size - 1) & ~(GROUP - 1);
+	struct hashtable_node *n;
+
+	for (i = 0; i < size / GROUP; i++) {
+		m = group_match(ctrl + pos, ctrl_of(hash));
+		while (m) {
+			n = slots[pos + __builtin_ctz(m)];
+			if (n->hash == hash && table->compare(n, data))
+				return n;
+			m &= m - 1;
+		}
+		if (group_match(ctrl + pos, CTRL_EMPTY))
+			break;
+		pos = group_next(pos, i, size);
+	}
+	return NULL;
+}
+
+/* the slot of @n, or -1 */
+static int64_t oa_slot(const uint8_t *ctrl, struct hashtable_node **slots,
+		       uint32_t size, const struct hashtable_node *n)
+{
+	uint32_t i, m, pos = n->hash & (size - 1) & ~(GROUP - 1);
+
+	for (i = 0; i < size / GROUP; i++) {
+		m = group_match(ctrl + pos, ctrl_of(n->hash));
+		while (m) {
+			if (slots[pos + __builtin_ctz(m)] == n)
+				return pos + __builtin_ctz(m);
+			m &= m - 1;
+		}
+		if (group_match(ctrl + pos, CTRL_EMPTY))
+			break;
+		pos = group_next(pos, i, size);
+	}
+	return -1;
+}
+
+/* 1 if an empty slot was taken, 0 if a deleted one, -1 if full */
+static int oa_insert(uint8_t *ctrl, struct hashtable_node **slots,
+		     uint32_t size, struct hashtable_node *n)
+{
+	uint32_t i, m, j, pos = n->hash & (size - 1) & ~(GROUP - 1);
+	int empty;
+
+	for (i = 0; i < size / GROUP; i++) {
+		m = ~group_full(ctrl + pos) & ((1U << GROUP) - 1);
+		if (m) {
+			j = pos + __builtin_ctz(m);
+			empty = ctrl[j] == CTRL_EMPTY;
+			ctrl[j] = ctrl_of(n->hash);
+			slots[j] = n;
+			return empty;
+		}
+		pos = group_next(pos, i, size);
+	}
+	return -1;
+}
+
+/* 1 if the slot is empty again, 0 if it is marked deleted */
+static int oa_erase(uint8_t *ctrl, uint32_t j)
+{
+	if (group_match(ctrl + (j & ~(GROUP - 1)), CTRL_EMPTY)) {
+		ctrl[j] = CTRL_EMPTY;
+		return 1;
+	}
+	ctrl[j] = CTRL_DELETED;
+	return 0;
+}
+
+static int oa_alloc(uint32_t size, uint8_t **ctrl,
+		    struct hashtable_node ***slots)
+{
+	*ctrl = calloc(size, 1);
+	/* only read where the control byte tells a node is there */
+	*slots = malloc(size * sizeof(struct hashtable_node *));
+	if (*ctrl == NULL || *slots == NULL) {
+		free(*ctrl);
+		free(*slots);
+		return -1;
+	}
+	return 0;
+}
 
 struct hashtable *
-hashtable_create(int hashsize, int limit,
-		 uint32_t (*hash)(const void *data,
-		 		  const struct hashtable *table),
-		 int (*compare)(const void *data1, const void *data2))
+hashtable_create_flags(int hashsize, int limit,
+		       uint32_t (*hash)(const void *data,
+					const struct hashtable *table),
+		       int (*compare)(const void *data1, const void *data2),
+		       uint32_t flags)
 {
-	int i;
 	struct hashtable *h;
-	int size = sizeof(struct hashtable)
-		   + hashsize * sizeof(struct llist_head);
 
-	h = (struct hashtable *) calloc(size, 1);
+	if (hashsize <= 0)
+		hashsize = 1;
+
+	h = (struct hashtable *) calloc(sizeof(struct hashtable), 1);
 	if (h == NULL) {
 		errno = ENOMEM;
 		return NULL;
 	}
 
-	for (i=0; i<hashsize; i++)
-		INIT_LLIST_HEAD(&h->members[i]);
+	if (flags & HASHTABLE_F_OPEN) {
+		uint32_t size = GROUP;
+
+		while (size < (uint32_t)hashsize && size < 1U << 30)
+			size <<= 1;
+		hashsize = size;
+		if (oa_alloc(size, &h->ctrl, &h->slots) < 0) {
+			free(h);
+			errno = ENOMEM;
+			return NULL;
+		}
+	} else {
+		h->members = calloc(hashsize, sizeof(struct llist_head));
+		if (h->members == NULL) {
+			free(h);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
 
 	h->hashsize = hashsize;
-	h->limit = limit;
+	h->min_size = hashsize;
+	h->limit = limit > 0 ? limit : 0;
+	h->flags = flags;
 	h->hash = hash;
 	h->compare = compare;
 
 	return h;
 }
 
+struct hashtable *
+hashtable_create(int hashsize, int limit,
+		 uint32_t (*hash)(const void *data,
+		 		  const struct hashtable *table),
+		 int (*compare)(const void *data1, const void *data2))
+{
+	return hashtable_create_flags(hashsize, limit, hash, compare, 0);
+}
+
 void hashtable_destroy(struct hashtable *h)
 {
+	free(h->old);
+	free(h->members);
+	free(h->old_ctrl);
+	free(h->old_slots);
+	free(h->ctrl);
+	free(h->slots);
 	free(h);
 }
 
-int hashtable_hash(const struct hashtable *table, const void *data)
+static void oa_resize(struct hashtable *table, uint32_t size)
+{
+	uint8_t *ctrl;
+	struct hashtable_node **slots;
+
+	if (table->old_ctrl || table->iterating)
+		return;
+	if (oa_alloc(size, &ctrl, &slots) < 0)
+		return;
+
+	table->old_ctrl = table->ctrl;
+	table->old_slots = table->slots;
+	table->old_size = table->hashsize;
+	table->rehash_idx = 0;
+	table->ctrl = ctrl;
+	table->slots = slots;
+	table->hashsize = size;
+	table->used = 0;
+	table->generation++;
+}
+
+/* moved slots are marked deleted, so that the probes of the ones left
+ * still reach them */
+static void oa_rehash(struct hashtable *table, unsigned int steps)
+{
+	unsigned int empty = steps > UINT_MAX / REHASH_EMPTY ?
+			     UINT_MAX : steps * REHASH_EMPTY;
+	uint32_t m, j;
+	int ret;
+
+	if (table->old_ctrl == NULL || table->iterating)
+		return;
+
+	while (steps > 0 && table->rehash_idx < table->old_size) {
+		m = group_full(table->old_ctrl + table->rehash_idx);
+		if (m == 0) {
+			table->rehash_idx += GROUP;
+			if (--empty == 0)
+				break;
+			continue;
+		}
+		while (m) {
+			j = table->rehash_idx + __builtin_ctz(m);
+			ret = oa_insert(table->ctrl, table->slots,
+					table->hashsize, table->old_slots[j]);
+			if (ret < 0)
+				return;
+			table->used += ret;
+			table->old_ctrl[j] = CTRL_DELETED;
+			m &= m - 1;
+		}
+		table->rehash_idx += GROUP;
+		steps--;
+	}
+
+	if (table->rehash_idx == table->old_size) {
+		free(table->old_ctrl);
+		free(table->old_slots);
+		table->old_ctrl = NULL;
+		table->old_slots = NULL;
+		table->old_size = 0;
+		table->generation++;
+	}
+}
+
+static struct hashtable_node *
+oa_lookup(struct hashtable *table, const void *data, uint32_t hash)
+{
+	struct hashtable_node *n;
+
+	oa_rehash(table, REHASH_STEPS);
+
+	if (table->old_ctrl) {
+		n = oa_find(table, table->old_ctrl, table->old_slots,
+			    table->old_size, data, hash);
+		if (n)
+			return n;
+	}
+	return oa_find(table, table->ctrl, table->slots, table->hashsize,
+		       data, hash);
+}
+
+static int oa_add(struct hashtable *table, struct hashtable_node *n)
+{
+	int ret;
+
+	oa_rehash(table, REHASH_STEPS);
+
+	/* at most 7 slots of 8 used, deleted ones included */
+	if ((uint64_t)(table->used + 1) * 8 > (uint64_t)table->hashsize * 7) {
+		/* a resize in progress is finished first */
+		oa_rehash(table, table->old_size);
+		/* grow if the table is mostly full rather than deleted */
+		if ((uint64_t)table->count * 16 >= (uint64_t)table->hashsize * 7 &&
+		    table->hashsize < 1U << 30)
+			oa_resize(table, table->hashsize * 2);
+		else
+			oa_resize(table, table->hashsize);
+	}
+
+	ret = oa_insert(table->ctrl, table->slots, table->hashsize, n);
+	if (ret < 0) {
+		errno = ENOSPC;
+		return -1;
+	}
+	table->used += ret;
+	return 0;
+}
+
+static void oa_del(struct hashtable *table, struct hashtable_node *n)
+{
+	int64_t j;
+
+	j = oa_slot(table->ctrl, table->slots, table->hashsize, n);
+	if (j >= 0) {
+		table->used -= oa_erase(table->ctrl, j);
+	} else if (table->old_ctrl) {
+		j = oa_slot(table->old_ctrl, table->old_slots,
+			    table->old_size, n);
+		if (j >= 0)
+			oa_erase(table->old_ctrl, j);
+	}
+}
+
+/* start moving the entries to @size buckets */
+static void resize(struct hashtable *table, uint32_t size)
+{
+	struct llist_head *members;
+
+	if (table->flags & HASHTABLE_F_OPEN) {
+		oa_resize(table, size);
+		return;
+	}
+
+	/* one resize at a time, and none under an iterator */
+	if (table->old || table->iterating)
+		return;
+
+	members = calloc(size, sizeof(struct llist_head));
+	if (members == NULL)
+		return;		/* keep the current size */
+
+	table->old = table->members;
+	table->old_size = table->hashsize;
+	table->rehash_idx = 0;
+	table->members = members;
+	table->hashsize = size;
+	table->generation++;
+}
+
+void hashtable_rehash(struct hashtable *table, unsigned int steps)
+{
+	unsigned int empty = steps * REHASH_EMPTY;
+	struct llist_head *e, *tmp, *b;
+	struct hashtable_node *n;
+
+	if (table->flags & HASHTABLE_F_OPEN) {
+		oa_rehash(table, steps);
+		return;
+	}
+
+	if (table->old == NULL || table->iterating)
+		return;
+
+	while (steps > 0 && table->rehash_idx < table->old_size) {
+		b = &table->old[table->rehash_idx++];
+		if (bucket_empty(b)) {
+			if (--empty == 0)
+				break;
+			continue;
+		}
+		llist_for_each_safe(e, tmp, b) {
+			n = llist_entry(e, struct hashtable_node, head);
+			llist_del(e);
+			llist_add(e, bucket_get(&table->members[
+				  bucket_of(n->hash, table->hashsize)]));
+		}
+		steps--;
+	}
+
+	if (table->rehash_idx == table->old_size) {
+		free(table->old);
+		table->old = NULL;
+		table->old_size = 0;
+		table->generation++;
+	}
+}
+
+uint32_t hashtable_hash(const struct hashtable *table, const void *data)
 {
 	return table->hash(data, table);
 }
 
-struct hashtable_node *
-hashtable_find(const struct hashtable *table, const void *data, int id)
+static struct hashtable_node *
+find_in(const struct hashtable *table, struct llist_head *b,
+	const void *data, uint32_t hash)
 {
 	struct llist_head *e;
 	struct hashtable_node *n;
 
-	llist_for_each(e, &table->members[id]) {
+	if (b->next == NULL)
+		return NULL;
+
+	llist_for_each(e, b) {
 		n = llist_entry(e, struct hashtable_node, head);
-		if (table->compare(n, data)) {
+		if (n->hash == hash && table->compare(n, data))
 			return n;
-		}
 	}
-	errno = ENOENT;
 	return NULL;
 }
 
-int hashtable_add(struct hashtable *table, struct hashtable_node *n, int id)
+struct hashtable_node *
+hashtable_find(struct hashtable *table, const void *data, uint32_t hash)
+{
+	struct hashtable_node *n;
+	uint32_t id;
+
+	if (table->flags & HASHTABLE_F_OPEN) {
+		n = oa_lookup(table, data, hash);
+		if (n == NULL)
+			errno = ENOENT;
+		return n;
+	}
+
+	hashtable_rehash(table, REHASH_STEPS);
+
+	if (table->old) {
+		id = bucket_of(hash, table->old_size);
+		if (id >= table->rehash_idx) {
+			n = find_in(table, &table->old[id], data, hash);
+			if (n)
+				return n;
+		}
+	}
+
+	n = find_in(table, &table->members[bucket_of(hash, table->hashsize)],
+		    data, hash);
+	if (n == NULL)
+		errno = ENOENT;
+	return n;
+}
+
+int hashtable_add(struct hashtable *table, struct hashtable_node *n,
+		  uint32_t hash)
 {
 	/* hash table is full */
-	if (table->count >= table->limit) {
+	if (table->limit && table->count >= table->limit) {
 		errno = ENOSPC;
 		return -1;
 	}
-	llist_add(&n->head, &table->members[id]);
+
+	n->hash = hash;
+	if (table->flags & HASHTABLE_F_OPEN) {
+		if (oa_add(table, n) < 0)
+			return -1;
+		table->count++;
+		return 0;
+	}
+
+	hashtable_rehash(table, REHASH_STEPS);
+	if (table->count >= table->hashsize && table->hashsize < 1U << 30)
+		resize(table, table->hashsize * 2);
+
+	llist_add(&n->head, bucket_get(&table->members[
+				bucket_of(hash, table->hashsize)]));
 	table->count++;
 	return 0;
 }
 
 void hashtable_del(struct hashtable *table, struct hashtable_node *n)
 {
-	llist_del(&n->head);
+	if (table->flags & HASHTABLE_F_OPEN)
+		oa_del(table, n);
+	else
+		llist_del(&n->head);
 	table->count--;
+
+	if (table->hashsize > table->min_size &&
+	    table->count < table->hashsize / 8) {
+		uint32_t size = table->hashsize / 2;
+
+		resize(table, size > table->min_size ? size : table->min_size);
+	}
 }
 
-int hashtable_flush(struct hashtable *table)
+static void flush_buckets(struct llist_head *members, uint32_t size)
 {
 	uint32_t i;
 	struct llist_head *e, *tmp;
 	struct hashtable_node *n;
 
-	for (i=0; i < table->hashsize; i++) {
-		llist_for_each_safe(e, tmp, &table->members[i]) {
+	for (i=0; i < size; i++) {
+		if (members[i].next == NULL)
+			continue;
+		llist_for_each_safe(e, tmp, &members[i]) {
 			n = llist_entry(e, struct hashtable_node, head);
 			free(n);
 		}
+		INIT_LLIST_HEAD(&members[i]);
+	}
+}
+
+static void oa_flush(uint8_t *ctrl, struct hashtable_node **slots,
+		     uint32_t size)
+{
+	uint32_t i;
+
+	for (i = 0; i < size; i++) {
+		if (ctrl[i] & CTRL_FULL)
+			free(slots[i]);
 	}
+	memset(ctrl, CTRL_EMPTY, size);
+}
+
+int hashtable_flush(struct hashtable *table)
+{
+	if (table->flags & HASHTABLE_F_OPEN) {
+		if (table->old_ctrl)
+			oa_flush(table->old_ctrl, table->old_slots,
+				 table->old_size);
+		oa_flush(table->ctrl, table->slots, table->hashsize);
+		table->used = 0;
+		table->count = 0;
+		return 0;
+	}
+
+	if (table->old)
+		flush_buckets(table->old, table->old_size);
+	flush_buckets(table->members, table->hashsize);
+	table->count = 0;
 	return 0;
 }
 
+/* positions run through the buckets of the previous size first, while
+ * resizing, they only stay valid as long as hashtable_generation() does:
+ * a walk in slices has to start over when it changes, or it may skip
+ * entries. Between the two, entries being moved may be seen twice. */
 int
 hashtable_iterate_limit(struct hashtable *table, void *data,
 			uint32_t from, uint32_t steps,
 		        int (*iterate)(void *data1, void *n))
 {
-	uint32_t i;
-	struct llist_head *e, *tmp;
+	uint32_t i, end;
+	struct llist_head *e, *tmp, *b;
 	struct hashtable_node *n;
+	int ret = 0;
+
+	/* entries must not move while being walked */
+	table->iterating++;
+
+	end = table->old_size + table->hashsize;
+	for (i=from; i < end && i - from < steps; i++) {
+		if (table->flags & HASHTABLE_F_OPEN) {
+			const uint8_t *ctrl = table->ctrl;
+			struct hashtable_node **slots = table->slots;
+			uint32_t j = i - table->old_size;
 
-	for (i=from; i < table->hashsize && i < from+steps; i++) {
-		llist_for_each_safe(e, tmp, &table->members[i]) {
+			if (i < table->old_size) {
+				ctrl = table->old_ctrl;
+				slots = table->old_slots;
+				j = i;
+			}
+			if (!(ctrl[j] & CTRL_FULL))
+				continue;
+			if (iterate(data, slots[j]) == -1) {
+				ret = -1;
+				goto out;
+			}
+			continue;
+		}
+		if (i < table->old_size)
+			b = &table->old[i];
+		else
+			b = &table->members[i - table->old_size];
+		if (b->next == NULL)
+			continue;
+		llist_for_each_safe(e, tmp, b) {
 			n = llist_entry(e, struct hashtable_node, head);
-			if (iterate(data, n) == -1)
-				return -1;
+			if (iterate(data, n) == -1) {
+				ret = -1;
+				goto out;
+			}
 		}
 	}
-	return i;
+	ret = i;
+out:
+	table->iterating--;
+	return ret;
 }
 
 int hashtable_iterate(struct hashtable *table, void *data,
@@ -141,3 +674,76 @@ unsigned int hashtable_counter(const struct hashtable *table)
 {
 	return table->count;
 }
+
+/* the positions hashtable_iterate_limit() runs through */
+uint32_t hashtable_buckets(const struct hashtable *table)
+{
+	return table->old_size + table->hashsize;
+}
+
+/* changes whenever a resize starts or completes, which is when the
+ * positions of hashtable_iterate_limit() change */
+uint32_t hashtable_generation(const struct hashtable *table)
+{
+	return table->generation;
+}
+
+static void stats_buckets(const struct llist_head *members, uint32_t size,
+			  struct hashtable_stats *stats)
+{
+	const struct llist_head *e;
+	uint32_t i, len;
+
+	for (i = 0; i < size; i++) {
+		if (members[i].next == NULL)
+			continue;
+		len = 0;
+		llist_for_each(e, &members[i])
+			len++;
+		if (len == 0)
+			continue;
+		stats->used++;
+		if (len > stats->max_chain)
+			stats->max_chain = len;
+		stats->chains[len > HASHTABLE_CHAINS ?
+			      HASHTABLE_CHAINS - 1 : len - 1]++;
+	}
+}
+
+static void oa_stats(const uint8_t *ctrl, struct hashtable_node **slots,
+		     uint32_t size, struct hashtable_stats *stats)
+{
+	uint32_t i, j, pos;
+
+	for (j = 0; j < size; j++) {
+		if (!(ctrl[j] & CTRL_FULL))
+			continue;
+		stats->used++;
+		/* the number of groups probed to find it */
+		pos = slots[j]->hash & (size - 1) & ~(GROUP - 1);
+		for (i = 0; pos != (j & ~(GROUP - 1)); i++)
+			pos = group_next(pos, i, size);
+		if (i + 1 > stats->max_chain)
+			stats->max_chain = i + 1;
+		stats->chains[i >= HASHTABLE_CHAINS ?
+			      HASHTABLE_CHAINS - 1 : i]++;
+	}
+}
+
+/* walks the whole table */
+void hashtable_stats(const struct hashtable *table,
+		     struct hashtable_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->buckets = table->hashsize + table->old_size;
+	if (table->flags & HASHTABLE_F_OPEN) {
+		if (table->old_ctrl)
+			oa_stats(table->old_ctrl, table->old_slots,
+				 table->old_size, stats);
+		oa_stats(table->ctrl, table->slots, table->hashsize, stats);
+		return;
+	}
+	if (table->old)
+		stats_buckets(table->old, table->old_size, stats);
+	stats_buckets(table->members, table->hashsize, stats);
+}
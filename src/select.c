@@ -14,18 +14,68 @@
  *  You should have received a copy of the GNU General Public License
  *  along with this program; if not, write to the Free Software
  *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ * Description:
+ *  The file descriptors registered by the plugins are multiplexed with
+ *  epoll(7), so each wakeup only costs as much as the number of ready
+ *  descriptors and there is no FD_SETSIZE limit.  Descriptors flagged
+ *  with ULOGD_FD_DRAIN are armed edge-triggered if requested via
+ *  ulogd_select_edge_triggered(), the rest always stays level-triggered.
  */
 
 #include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
 #include <ulogd/ulogd.h>
 #include <ulogd/linuxlist.h>
 
-static int maxfd = 0;
-static fd_set readset, writeset, exceptset;
+#define ULOGD_EPOLL_EVENTS	64
+
+static int epfd = -1;
+static int edge_triggered = 0;
 static LLIST_HEAD(ulogd_fds);
 
+/* events returned by the last epoll_wait() that are being dispatched */
+static struct epoll_event events[ULOGD_EPOLL_EVENTS];
+static int nevents = 0;
+
+static uint32_t ufd_to_epoll(const struct ulogd_fd *ufd)
+{
+	uint32_t ev = 0;
+
+	if (ufd->when & ULOGD_FD_READ)
+		ev |= EPOLLIN;
+
+	if (ufd->when & ULOGD_FD_WRITE)
+		ev |= EPOLLOUT;
+
+	if (ufd->when & ULOGD_FD_EXCEPT)
+		ev |= EPOLLPRI;
+
+	if (edge_triggered && (ufd->when & ULOGD_FD_DRAIN))
+		ev |= EPOLLET;
+
+	return ev;
+}
+
+static int epoll_setup(void)
+{
+	if (epfd >= 0)
+		return 0;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		ulogd_log(ULOGD_FATAL, "can't create epoll descriptor: %s\n",
+			  strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
 int ulogd_register_fd(struct ulogd_fd *fd)
 {
+	struct epoll_event ev;
 	int flags;
 
 	/* make FD nonblocking */
@@ -37,19 +87,20 @@ int ulogd_register_fd(struct ulogd_fd *fd)
 	if (flags < 0)
 		return -1;
 
-	if (fd->when & ULOGD_FD_READ)
-		FD_SET(fd->fd, &readset);
-
-	if (fd->when & ULOGD_FD_WRITE)
-		FD_SET(fd->fd, &writeset);
+	if (epoll_setup() < 0)
+		return -1;
 
-	if (fd->when & ULOGD_FD_EXCEPT)
-		FD_SET(fd->fd, &exceptset);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = ufd_to_epoll(fd);
+	ev.data.ptr = fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd->fd, &ev) < 0) {
+		ulogd_log(ULOGD_ERROR, "can't register fd %d: %s\n",
+			  fd->fd, strerror(errno));
+		return -1;
+	}
 
 	/* Register FD */
-	if (fd->fd > maxfd)
-		maxfd = fd->fd;
-
+	fd->owner = ulogd_callback_owner();
 	llist_add_tail(&fd->list, &ulogd_fds);
 
 	return 0;
@@ -57,53 +108,95 @@ int ulogd_register_fd(struct ulogd_fd *fd)
 
 void ulogd_unregister_fd(struct ulogd_fd *fd)
 {
-	if (fd->when & ULOGD_FD_READ)
-		FD_CLR(fd->fd, &readset);
-
-	if (fd->when & ULOGD_FD_WRITE)
-		FD_CLR(fd->fd, &writeset);
+	int i;
 
-	if (fd->when & ULOGD_FD_EXCEPT)
-		FD_CLR(fd->fd, &exceptset);
+	/* the descriptor may already be closed, nothing to do then */
+	if (epfd >= 0)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, fd->fd, NULL);
 
 	llist_del(&fd->list);
 
-	/* Improvement: recalculate maxfd iif fd->fd == maxfd */
-	maxfd = -1;
-	llist_for_each_entry(fd, &ulogd_fds, list) {
-		if (fd->fd > maxfd)
-			maxfd = fd->fd;
+	/* we may be called from a callback while the events of the
+	 * current round are dispatched: forget pending events for it. */
+	for (i = 0; i < nevents; i++) {
+		if (events[i].data.ptr == fd)
+			events[i].data.ptr = NULL;
 	}
 }
 
-int ulogd_select_main(struct timeval *tv)
+/* switch descriptors flagged with ULOGD_FD_DRAIN to edge-triggered mode */
+void ulogd_select_edge_triggered(int enable)
 {
 	struct ulogd_fd *ufd;
-	fd_set rds_tmp, wrs_tmp, exs_tmp;
-	int i;
 
-	rds_tmp = readset;
-	wrs_tmp = writeset;
-	exs_tmp = exceptset;
+	if (edge_triggered == !!enable)
+		return;
 
-	i = select(maxfd+1, &rds_tmp, &wrs_tmp, &exs_tmp, tv);
-	if (i > 0) {
-		/* call registered callback functions */
-		llist_for_each_entry(ufd, &ulogd_fds, list) {
-			int flags = 0;
+	edge_triggered = !!enable;
 
-			if (FD_ISSET(ufd->fd, &rds_tmp))
-				flags |= ULOGD_FD_READ;
+	llist_for_each_entry(ufd, &ulogd_fds, list) {
+		struct epoll_event ev;
 
-			if (FD_ISSET(ufd->fd, &wrs_tmp))
-				flags |= ULOGD_FD_WRITE;
+		if (!(ufd->when & ULOGD_FD_DRAIN))
+			continue;
 
-			if (FD_ISSET(ufd->fd, &exs_tmp))
-				flags |= ULOGD_FD_EXCEPT;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = ufd_to_epoll(ufd);
+		ev.data.ptr = ufd;
+		if (epoll_ctl(epfd, EPOLL_CTL_MOD, ufd->fd, &ev) < 0)
+			ulogd_log(ULOGD_ERROR, "can't modify fd %d: %s\n",
+				  ufd->fd, strerror(errno));
+	}
+}
 
-			if (flags)
-				ufd->cb(ufd->fd, flags, ufd->data);
-		}
+int ulogd_select_main(struct timeval *tv)
+{
+	int timeout = -1;
+	int i, n;
+
+	if (epoll_setup() < 0)
+		return -1;
+
+	if (tv)
+		timeout = tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+
+	n = epoll_wait(epfd, events, ULOGD_EPOLL_EVENTS, timeout);
+	if (n <= 0)
+		return n;
+
+	/* call registered callback functions */
+	nevents = n;
+	for (i = 0; i < n; i++) {
+		struct ulogd_fd *ufd = events[i].data.ptr;
+		struct ulogd_pluginstance *owner, *prev;
+		uint32_t ev = events[i].events;
+		unsigned int flags = 0;
+
+		/* unregistered by a previous callback in this round */
+		if (ufd == NULL)
+			continue;
+
+		/* select() reports errors and hangups as readable */
+		if (ev & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			flags |= ULOGD_FD_READ;
+
+		if (ev & (EPOLLOUT | EPOLLERR))
+			flags |= ULOGD_FD_WRITE;
+
+		if (ev & EPOLLPRI)
+			flags |= ULOGD_FD_EXCEPT;
+
+		flags &= ufd->when;
+		if (!flags)
+			continue;
+
+		/* the callback may unregister and free ufd */
+		owner = ufd->owner;
+		prev = ulogd_callback_enter(owner);
+		ufd->cb(ufd->fd, flags, ufd->data);
+		ulogd_callback_leave(owner, prev);
 	}
-	return i;
+	nevents = 0;
+
+	return n;
 }
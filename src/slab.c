@@ -0,0 +1,192 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Description: fixed-size object allocator.  Objects live in chunks of
+ * anonymous memory, so that long-lived tables of many small entries
+ * don't fragment the heap, and memory goes back to the system as soon
+ * as a chunk is empty.  Each object is preceded by a pointer to its
+ * chunk, free objects are linked through their first word.
+ */
+
+#include "ulogd/slab.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* object header, keeps the payload aligned for any type */
+#define SLAB_HDR	16
+
+struct slab_chunk {
+	struct llist_head list;
+	uint32_t used;
+	uint32_t carved;		/* objects ever handed out */
+	void *free;			/* free list of released objects */
+	char objs[] __attribute__((aligned(SLAB_HDR)));
+};
+
+#define SLAB_DEFAULT_PER_CHUNK	256
+
+struct slab *slab_create(size_t objsize, uint32_t per_chunk, uint32_t limit)
+{
+	struct slab *s;
+	long page = sysconf(_SC_PAGESIZE);
+
+	if (objsize < sizeof(void *))
+		objsize = sizeof(void *);
+	if (per_chunk == 0)
+		per_chunk = SLAB_DEFAULT_PER_CHUNK;
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	s->objsize = (SLAB_HDR + objsize + SLAB_HDR - 1) & ~(SLAB_HDR - 1);
+	s->chunk_size = sizeof(struct slab_chunk) + per_chunk * s->objsize;
+	s->chunk_size = (s->chunk_size + page - 1) & ~(page - 1);
+	/* fill the slack of the last page */
+	s->per_chunk = (s->chunk_size - sizeof(struct slab_chunk)) /
+		       s->objsize;
+	s->limit = limit;
+	INIT_LLIST_HEAD(&s->partial);
+	INIT_LLIST_HEAD(&s->full);
+
+	return s;
+}
+
+/* allocator for the entries of a table holding at most limit of them,
+ * any number if limit is 0 or less: chunks hold a 64th of the limit, or
+ * of the expected size without one, but no less than 64 entries */
+struct slab *slab_create_table(size_t objsize, int limit, int size)
+{
+	int per_chunk = (limit > 0 ? limit : size) / 64;
+
+	if (limit < 0)
+		limit = 0;
+	if (per_chunk < 64)
+		per_chunk = 64;
+
+	return slab_create(objsize, per_chunk, limit);
+}
+
+static struct slab_chunk *chunk_map(struct slab *s)
+{
+	struct slab_chunk *c;
+
+	c = mmap(NULL, s->chunk_size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (c == MAP_FAILED) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	c->used = 0;
+	c->carved = 0;
+	c->free = NULL;
+	s->chunks++;
+	return c;
+}
+
+static void chunk_unmap(struct slab *s, struct slab_chunk *c)
+{
+	munmap(c, s->chunk_size);
+	s->chunks--;
+}
+
+void slab_destroy(struct slab *s)
+{
+	struct slab_chunk *c, *tmp;
+
+	llist_for_each_entry_safe(c, tmp, &s->partial, list)
+		chunk_unmap(s, c);
+	llist_for_each_entry_safe(c, tmp, &s->full, list)
+		chunk_unmap(s, c);
+	if (s->spare)
+		chunk_unmap(s, s->spare);
+	free(s);
+}
+
+void *slab_alloc(struct slab *s)
+{
+	struct slab_chunk *c;
+	char *obj;
+
+	if (s->limit && s->count >= s->limit) {
+		errno = ENOSPC;
+		return NULL;
+	}
+
+	if (llist_empty(&s->partial)) {
+		c = s->spare;
+		s->spare = NULL;
+		if (c == NULL)
+			c = chunk_map(s);
+		if (c == NULL)
+			return NULL;
+		llist_add(&c->list, &s->partial);
+	} else
+		c = llist_entry(s->partial.next, struct slab_chunk, list);
+
+	if (c->free) {
+		obj = c->free;
+		c->free = *(void **)(obj + SLAB_HDR);
+	} else {
+		/* never used objects are only touched now, so that a
+		 * large chunk doesn't get faulted in at once */
+		obj = c->objs + (size_t)c->carved++ * s->objsize;
+		*(struct slab_chunk **)obj = c;
+	}
+
+	if (++c->used == s->per_chunk) {
+		llist_del(&c->list);
+		llist_add(&c->list, &s->full);
+	}
+	s->count++;
+
+	memset(obj + SLAB_HDR, 0, s->objsize - SLAB_HDR);
+	return obj + SLAB_HDR;
+}
+
+void slab_free(struct slab *s, void *ptr)
+{
+	char *obj = (char *)ptr - SLAB_HDR;
+	struct slab_chunk *c = *(struct slab_chunk **)obj;
+
+	/* a chunk with room goes first, to fill it up again */
+	if (c->used-- == s->per_chunk) {
+		llist_del(&c->list);
+		llist_add(&c->list, &s->partial);
+	}
+	*(void **)ptr = c->free;
+	c->free = obj;
+	s->count--;
+
+	if (c->used > 0)
+		return;
+
+	/* keep one empty chunk to absorb oscillations around a chunk
+	 * boundary, give the others back */
+	llist_del(&c->list);
+	if (s->spare == NULL) {
+		c->carved = 0;
+		c->free = NULL;
+		s->spare = c;
+	} else
+		chunk_unmap(s, c);
+}
+
+size_t slab_mapped(const struct slab *s)
+{
+	return (size_t)s->chunks * s->chunk_size;
+}
@@ -26,6 +26,9 @@
  *  so that the daemon only wakes up when there are timers expired to run.
  *  This approach is more simple than the previous signal-based implementation
  *  that could wake up the daemon while running at any part of the code.
+ *  The earliest timer is programmed into a timerfd that is registered like
+ *  any other file descriptor, so the main loop never has to compute the
+ *  timeout itself; the timerfd is only re-armed when the head changes.
  *
  * TODO:
  *  - This piece of code has been extracted from conntrackd. Probably
@@ -34,12 +37,74 @@
  *    quite straight forward.
  */
 
+#include <ulogd/ulogd.h>
 #include <ulogd/timer.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
 
 static struct rb_root alarm_root = RB_ROOT;
 
+static int timer_fd_cb(int fd, unsigned int what, void *data);
+static struct ulogd_fd timer_ufd = {
+	.fd = -1,
+	.when = ULOGD_FD_READ | ULOGD_FD_DRAIN,
+	.cb = &timer_fd_cb,
+};
+
+/* program the timerfd to fire when the first timer in the tree expires */
+static void timer_fd_arm(void)
+{
+	struct itimerspec its = {};
+	struct rb_node *node;
+
+	if (timer_ufd.fd < 0) {
+		timer_ufd.fd = timerfd_create(CLOCK_REALTIME,
+					      TFD_NONBLOCK | TFD_CLOEXEC);
+		if (timer_ufd.fd < 0) {
+			ulogd_log(ULOGD_FATAL, "can't create timerfd: %s\n",
+				  strerror(errno));
+			return;
+		}
+		if (ulogd_register_fd(&timer_ufd) < 0) {
+			close(timer_ufd.fd);
+			timer_ufd.fd = -1;
+			return;
+		}
+	}
+
+	node = rb_first(&alarm_root);
+	if (node) {
+		struct ulogd_timer *this;
+
+		this = container_of(node, struct ulogd_timer, node);
+		its.it_value.tv_sec = this->tv.tv_sec;
+		its.it_value.tv_nsec = this->tv.tv_usec * 1000;
+		/* a zero it_value disarms the timer, so fire as soon
+		 * as possible instead */
+		if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+			its.it_value.tv_nsec = 1;
+	}
+
+	if (timerfd_settime(timer_ufd.fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		ulogd_log(ULOGD_ERROR, "can't arm timerfd: %s\n",
+			  strerror(errno));
+}
+
+static int timer_fd_cb(int fd, unsigned int what, void *data)
+{
+	struct timeval next;
+	uint64_t expirations;
+
+	/* nothing to read if the timer has been re-armed meanwhile */
+	while (read(fd, &expirations, sizeof(expirations)) > 0);
+
+	ulogd_do_timer_run(&next);
+	return 0;
+}
+
 void ulogd_init_timer(struct ulogd_timer *t,
 		      void *data,
 		      void (*cb)(struct ulogd_timer *a, void *data))
@@ -49,6 +114,7 @@ void ulogd_init_timer(struct ulogd_timer *t,
 	timerclear(&t->tv);
 	t->data = data;
 	t->cb = cb;
+	t->owner = ulogd_callback_owner();
 }
 
 static void __add_timer(struct ulogd_timer *alarm)
@@ -70,6 +136,10 @@ static void __add_timer(struct ulogd_timer *alarm)
 
 	rb_link_node(&alarm->node, parent, new);
 	rb_insert_color(&alarm->node, &alarm_root);
+
+	/* new head of the tree, the timerfd needs to fire earlier */
+	if (rb_first(&alarm_root) == &alarm->node)
+		timer_fd_arm();
 }
 
 void ulogd_add_timer(struct ulogd_timer *alarm, unsigned long sc)
@@ -88,8 +158,12 @@ void ulogd_del_timer(struct ulogd_timer *alarm)
 {
 	/* don't remove a non-inserted node */
 	if (!RB_EMPTY_NODE(&alarm->node)) {
+		int was_first = rb_first(&alarm_root) == &alarm->node;
+
 		rb_erase(&alarm->node, &alarm_root);
 		RB_CLEAR_NODE(&alarm->node);
+		if (was_first)
+			timer_fd_arm();
 	}
 }
 
@@ -155,10 +229,16 @@ struct timeval *ulogd_do_timer_run(struct timeval *next_run)
 	}
 
 	llist_for_each_entry(this, &alarm_run_queue, list) {
+		struct ulogd_pluginstance *prev;
+
 		rb_erase(&this->node, &alarm_root);
 		RB_CLEAR_NODE(&this->node);
+		prev = ulogd_callback_enter(this->owner);
 		this->cb(this, this->data);
+		ulogd_callback_leave(this->owner, prev);
 	}
 
+	timer_fd_arm();
+
 	return ulogd_get_next_timer_run(next_run);
 }
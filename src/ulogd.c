@@ -64,8 +64,10 @@
 #include <syslog.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
 #include <sched.h>
 #include <limits.h>
+#include <pthread.h>
 #include <ulogd/conffile.h>
 #include <ulogd/ulogd.h>
 #ifdef DEBUG
@@ -110,7 +112,7 @@ static void signal_handler_task(int signal);
 
 static int  signal_channel_callback(int fd, unsigned int what, void *data);
 static struct ulogd_fd	signal_channel_ulogfd = {
-	.when = ULOGD_FD_READ,
+	.when = ULOGD_FD_READ | ULOGD_FD_DRAIN,
 	.cb = &signal_channel_callback,
 	.data = &signal_channel_ulogfd,
 };
@@ -128,7 +130,7 @@ static int logfile_open(const char *name);
 static void cleanup_pidfile();
 
 static struct config_keyset ulogd_kset = {
-	.num_ces = 4,
+	.num_ces = 7,
 	.ces = {
 		{
 			.key = "logfile",
@@ -154,6 +156,24 @@ static struct config_keyset ulogd_kset = {
 			.options = CONFIG_OPT_MULTI,
 			.u.parser = &create_stack,
 		},
+		{
+			.key = "edge_triggered",
+			.type = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 0,
+		},
+		{
+			.key = "stack_threads",
+			.type = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 0,
+		},
+		{
+			.key = "stack_queue_size",
+			.type = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 4096,
+		},
 	},
 };
 
@@ -161,6 +181,9 @@ static struct config_keyset ulogd_kset = {
 #define plugin_ce	ulogd_kset.ces[1]
 #define loglevel_ce	ulogd_kset.ces[2]
 #define stack_ce	ulogd_kset.ces[3]
+#define edge_ce		ulogd_kset.ces[4]
+#define threads_ce	ulogd_kset.ces[5]
+#define queue_size_ce	ulogd_kset.ces[6]
 
 /***********************************************************************
  * UTILITY FUNCTIONS FOR PLUGINS
@@ -242,8 +265,15 @@ int ulogd_wildcard_inputkeys(struct ulogd_pluginstance *upi)
 	llist_for_each_entry(pi_cur, &stack->list, list) {
 		unsigned int i;
 
-		for (i = 0; i < pi_cur->plugin->output.num_keys; i++)
-			upi->input.keys[index++] = pi_cur->output.keys[i];
+		for (i = 0; i < pi_cur->plugin->output.num_keys; i++) {
+			struct ulogd_key *key = &upi->input.keys[index++];
+
+			*key = pi_cur->output.keys[i];
+			/* sinks taking all keys print values, none of them
+			 * dumps raw buffers */
+			if (key->type == ULOGD_RET_RAW)
+				key->flags |= ULOGD_KEYF_HEADERS;
+		}
 	}
 
 	upi->input.num_keys = num_keys;
@@ -434,213 +464,1460 @@ static void call_signal_handler_tasks(int sig)
 	}
 }
 
-static int signal_channel_callback(int fd, unsigned int what, void *data)
+static int signal_channel_callback(int fd, unsigned int what, void *data)
+{
+	int	ret;
+	unsigned char c;
+
+	while ((ret = read(fd, &c, 1)) > 0) {
+		call_signal_handler_tasks((int)c);
+	}
+	return 0;
+}
+
+static int create_signal_channel(void)
+{
+	int	ret;
+	long	flags;
+
+	if ((ret = pipe(signal_channel)) < 0)
+		return ret;
+
+	/* SIGNAL_RX_FD, channel[0] */
+	if ((flags = fcntl(SIGNAL_RX_FD, F_GETFL)) < 0)
+		goto err_exit;
+	flags |= O_NONBLOCK;
+	if ( fcntl(SIGNAL_RX_FD, F_SETFL, flags) < 0 )
+		goto err_exit;
+
+	/* SIGNAL_TX_FD, channel[1] */
+	if ((flags = fcntl(SIGNAL_TX_FD, F_GETFL)) < 0)
+		goto err_exit;
+	flags |= O_NONBLOCK;
+	if ( fcntl(SIGNAL_TX_FD, F_SETFL, flags) < 0 )
+		goto err_exit;
+
+	/* register SIGNAL_RX_FD to ulogd */
+	signal_channel_ulogfd.fd = SIGNAL_RX_FD;
+	ulogd_register_fd(&signal_channel_ulogfd);
+
+	return 0;
+
+err_exit:
+	if (SIGNAL_RX_FD >= 0) {
+		(void)close(SIGNAL_RX_FD);
+		SIGNAL_RX_FD = -1;
+	}
+	if (SIGNAL_TX_FD >= 0) {
+		(void)close(SIGNAL_TX_FD);
+		SIGNAL_TX_FD = -1;
+	}
+	return -1;
+}
+
+
+/***********************************************************************
+ * MAIN PROGRAM
+ ***********************************************************************/
+
+static inline int ulogd2syslog_level(int level)
+{
+	int syslog_level = LOG_WARNING;
+
+	switch (level) {
+		case ULOGD_DEBUG:
+			syslog_level = LOG_DEBUG;
+			break;
+		case ULOGD_INFO:
+			syslog_level = LOG_INFO;
+			break;
+		case ULOGD_NOTICE:
+			syslog_level = LOG_NOTICE;
+			break;
+		case ULOGD_ERROR:
+			syslog_level = LOG_ERR;
+			break;
+		case ULOGD_FATAL:
+			syslog_level = LOG_CRIT;
+			break;
+	}
+
+	return syslog_level;
+}
+
+/* stack worker threads log, too */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* log message to the logfile */
+void __ulogd_log(int level, char *file, int line, const char *format, ...)
+{
+	char *timestr;
+	va_list ap;
+	time_t tm;
+	FILE *outfd;
+
+	/* log only messages which have level at least as high as loglevel */
+	if (level < loglevel_ce.u.value)
+		return;
+
+	pthread_mutex_lock(&log_lock);
+	if (logfile == syslog_dummy) {
+		/* FIXME: this omits the 'file' string */
+		va_start(ap, format);
+		vsyslog(ulogd2syslog_level(level), format, ap);
+		va_end(ap);
+	} else {
+		if (logfile)
+			outfd = logfile;
+		else
+			outfd = stderr;
+
+		tm = time(NULL);
+		timestr = ctime(&tm);
+		timestr[strlen(timestr)-1] = '\0';
+		fprintf(outfd, "%s <%1.1d> %s:%d ", timestr, level, file, line);
+		if (verbose && outfd != stderr)
+			fprintf(stderr, "%s <%1.1d> %s:%d ", timestr, level, file, line);
+
+
+		va_start(ap, format);
+		vfprintf(outfd, format, ap);
+		va_end(ap);
+		/* flush glibc's buffer */
+		fflush(outfd);
+
+		if (verbose && outfd != stderr) {
+			va_start(ap, format);
+			vfprintf(stderr, format, ap);
+			va_end(ap);
+			fflush(stderr);
+		}
+
+	}
+	pthread_mutex_unlock(&log_lock);
+}
+
+static void warn_and_exit(int daemonize)
+{
+	cleanup_pidfile();
+
+	if (!daemonize) {
+		if (logfile && !verbose) {
+			fprintf(stderr, "Fatal error, check logfile \"%s\""
+				" or use '-v' flag.\n",
+				ulogd_logfile);
+
+		} else
+			fprintf(stderr, "Fatal error.\n");
+	}
+exit(1);
+}
+
+/* a stack flattened into arrays by create_stack_compile() */
+struct ulogd_plan_step {
+	int (*interp)(struct ulogd_pluginstance *instance);
+	struct ulogd_pluginstance *pi;
+};
+
+struct ulogd_plan {
+	/* plugins following the source, in stack order */
+	struct ulogd_plan_step *steps;
+	unsigned int num_steps;
+	/* output keys of all plugins of the stack */
+	struct ulogd_key **keys;
+	unsigned int num_keys;
+	/* the ones set by the record in flight */
+	struct ulogd_keylog dirty;
+	/* validity bitmap of the sink inputs, see fill_valid_inputs() */
+	struct ulogd_pluginstance *sink;
+	uint64_t *valid;
+	unsigned int valid_words;
+	/* an output key feeds several sink inputs, sink_idx won't do */
+	int valid_scan;
+};
+
+static void clean_key(struct ulogd_key *key)
+{
+	if (!(key->flags & ULOGD_RETF_VALID))
+		return;
+
+	if (key->flags & ULOGD_RETF_FREE) {
+		free(key->u.value.ptr);
+		key->u.value.ptr = NULL;
+	}
+	memset(&key->u.value, 0, sizeof(key->u.value));
+	key->flags &= ~ULOGD_RETF_VALID;
+}
+
+/* clean results (set all values to 0 and free pointers) */
+static void ulogd_clean_results(struct ulogd_pluginstance *pi)
+{
+	struct ulogd_plan *plan = pi->stack->plan;
+	struct ulogd_keylog *log = &plan->dirty;
+	unsigned int i;
+
+	DEBUGP("cleaning up results\n");
+
+	/* only the keys set by okey_set_*() need to be cleaned */
+	if (!log->overflow) {
+		for (i = 0; i < log->num; i++)
+			clean_key(log->keys[i]);
+	} else {
+		for (i = 0; i < plan->num_keys; i++)
+			clean_key(plan->keys[i]);
+		log->overflow = 0;
+	}
+	log->num = 0;
+}
+
+/* compute the validity bitmap of the sink inputs for the current record
+ * from the keys that were set on the way down */
+static void fill_valid_inputs(struct ulogd_plan *plan)
+{
+	struct ulogd_keylog *log = &plan->dirty;
+	unsigned int i;
+
+	memset(plan->valid, 0, plan->valid_words * sizeof(uint64_t));
+
+	if (plan->valid_scan || log->overflow) {
+		for (i = 0; i < plan->sink->input.num_keys; i++) {
+			if (pp_is_valid(plan->sink->input.keys, i))
+				plan->valid[i / 64] |= 1ULL << (i % 64);
+		}
+		return;
+	}
+
+	for (i = 0; i < log->num; i++) {
+		struct ulogd_key *key = log->keys[i];
+
+		if (key->sink_idx < 0 || !(key->flags & ULOGD_RETF_VALID))
+			continue;
+		plan->valid[key->sink_idx / 64] |= 1ULL << (key->sink_idx % 64);
+	}
+}
+
+/* run the steps of the plan from index first on, stopping before plugin
+ * stop (or at the end of the stack if stop is NULL). Returns 0 if the
+ * record went through, -1 if a plugin aborted the iteration. */
+static int propagate_steps(struct ulogd_plan *plan, unsigned int first,
+			   struct ulogd_pluginstance *stop)
+{
+	unsigned int i;
+
+	for (i = first; i < plan->num_steps; i++) {
+		struct ulogd_plan_step *step = &plan->steps[i];
+		int ret;
+
+		if (step->pi == stop)
+			break;
+
+		if (step->pi == plan->sink)
+			fill_valid_inputs(plan);
+
+		ret = step->interp(step->pi);
+		if (ret == ULOGD_IRET_OK)
+			continue;
+
+		switch (ret) {
+		case ULOGD_IRET_ERR:
+			ulogd_log(ULOGD_NOTICE,
+				  "error during propagate_results\n");
+			break;
+		case ULOGD_IRET_STOP:
+			/* we shall abort further iteration of the stack */
+			break;
+		default:
+			ulogd_log(ULOGD_NOTICE,
+				  "unknown return value `%d' from plugin %s\n",
+				  ret, step->pi->plugin->name);
+			break;
+		}
+		return -1;
+	}
+
+	return 0;
+}
+
+/* run the plugins following the source pi in its stack, up to stop */
+static int propagate_upto(struct ulogd_pluginstance *pi,
+			  struct ulogd_pluginstance *stop)
+{
+	return propagate_steps(pi->stack->plan, 0, stop);
+}
+
+static void worker_push(struct ulogd_pluginstance *pi);
+
+/* propagate results to all downstream plugins in the stack */
+void ulogd_propagate_results(struct ulogd_pluginstance *pi)
+{
+	/* the stack runs on its own thread: just hand the record over */
+	if (pi->stack->worker) {
+		worker_push(pi);
+		return;
+	}
+
+	propagate_upto(pi, NULL);
+	ulogd_clean_results(pi);
+}
+
+/* is key an output key of the plugins from step first on? */
+static int key_from_step(struct ulogd_plan *plan, unsigned int first,
+			 struct ulogd_key *key)
+{
+	unsigned int i;
+
+	for (i = first; i < plan->num_steps; i++) {
+		struct ulogd_pluginstance *pi = plan->steps[i].pi;
+
+		if (key >= pi->output.keys &&
+		    key < pi->output.keys + pi->output.num_keys)
+			return 1;
+	}
+	return 0;
+}
+
+/* clean the output keys of the plugins from step first on, leaving the
+ * ones of the record in flight upstream alone */
+static void clean_results_from(struct ulogd_plan *plan, unsigned int first)
+{
+	struct ulogd_keylog *log = &plan->dirty;
+	unsigned int i, j, n = 0;
+
+	if (log->overflow) {
+		/* the log is incomplete, the final cleanup does it all */
+		for (i = first; i < plan->num_steps; i++) {
+			struct ulogd_pluginstance *pi = plan->steps[i].pi;
+
+			for (j = 0; j < pi->output.num_keys; j++)
+				clean_key(&pi->output.keys[j]);
+		}
+		return;
+	}
+
+	for (i = 0; i < log->num; i++) {
+		if (key_from_step(plan, first, log->keys[i]))
+			clean_key(log->keys[i]);
+		else
+			log->keys[n++] = log->keys[i];
+	}
+	log->num = n;
+}
+
+/* propagate the output keys of a filter through the plugins following
+ * it. Only from a timer, fd or signal callback of the filter, which keep
+ * the worker thread of the stack, if any, out of the plan meanwhile, or
+ * from its interp: the keys of the record at hand, set by the plugins
+ * before it, stay valid. */
+void ulogd_propagate_from(struct ulogd_pluginstance *pi)
+{
+	struct ulogd_plan *plan = pi->stack->plan;
+	unsigned int i;
+
+	for (i = 0; i < plan->num_steps; i++) {
+		if (plan->steps[i].pi == pi)
+			break;
+	}
+	if (i == plan->num_steps)
+		return;
+
+	propagate_steps(plan, i + 1, NULL);
+	clean_results_from(plan, i);
+}
+
+/***********************************************************************
+ * batched propagation
+ ***********************************************************************/
+
+/* staged value is an offset into the string buffer of the batch */
+#define BATCH_F_STRBUF	0x8000
+
+struct ulogd_batch {
+	/* records handed to interp_batch, and their keys */
+	struct ulogd_key **records;
+	struct ulogd_key *keys;
+	unsigned int size;
+	/* string values are copied here, buffers of filters get reused */
+	char *strbuf;
+	size_t strbuf_size;
+	size_t strbuf_len;
+};
+
+void ulogd_init_record(struct ulogd_pluginstance *pi, struct ulogd_key *rec)
+{
+	unsigned int i;
+
+	memcpy(rec, pi->output.keys,
+	       sizeof(struct ulogd_key) * pi->output.num_keys);
+	for (i = 0; i < pi->output.num_keys; i++) {
+		rec[i].flags &= ~(ULOGD_RETF_VALID | ULOGD_RETF_FREE);
+		memset(&rec[i].u.value, 0, sizeof(rec[i].u.value));
+		rec[i].dirty = NULL;
+	}
+}
+
+/* copy the values of a record into the output keys of the source */
+void ulogd_load_record(struct ulogd_pluginstance *pi, struct ulogd_key *rec)
+{
+	unsigned int i;
+
+	for (i = 0; i < pi->output.num_keys; i++) {
+		struct ulogd_key *key = &pi->output.keys[i];
+
+		if (!(rec[i].flags & ULOGD_RETF_VALID))
+			continue;
+
+		key->len = rec[i].len;
+		key->u.value = rec[i].u.value;
+		okey_set_valid(key);
+	}
+}
+
+static int batch_reserve(struct ulogd_pluginstance_stack *stack,
+			 unsigned int num, unsigned int num_keys)
+{
+	struct ulogd_batch *b = stack->batch;
+	unsigned int i;
+
+	if (!b) {
+		b = calloc(1, sizeof(*b));
+		if (!b)
+			return -1;
+		stack->batch = b;
+	}
+
+	if (num > b->size) {
+		struct ulogd_key **records;
+		struct ulogd_key *keys;
+
+		records = realloc(b->records, sizeof(*records) * num);
+		if (!records)
+			return -1;
+		b->records = records;
+
+		keys = realloc(b->keys, sizeof(*keys) * num * num_keys);
+		if (!keys)
+			return -1;
+		b->keys = keys;
+		b->size = num;
+	}
+
+	for (i = 0; i < num; i++)
+		b->records[i] = &b->keys[i * num_keys];
+
+	b->strbuf_len = 0;
+
+	return 0;
+}
+
+/* returns offset + 1 of the copy in strbuf, 0 on failure */
+static size_t batch_strdup(struct ulogd_batch *b, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	size_t off = b->strbuf_len;
+
+	if (off + len > b->strbuf_size) {
+		size_t size = b->strbuf_size ? b->strbuf_size : 4096;
+		char *buf;
+
+		while (off + len > size)
+			size *= 2;
+
+		buf = realloc(b->strbuf, size);
+		if (!buf)
+			return 0;
+		b->strbuf = buf;
+		b->strbuf_size = size;
+	}
+	memcpy(b->strbuf + off, str, len);
+	b->strbuf_len += len;
+
+	return off + 1;
+}
+
+/* snapshot the resolved input keys of sink into dst. If rec is set, keys
+ * produced by source pi are taken from it instead of pi's output keys. */
+static void batch_stage(struct ulogd_batch *b, struct ulogd_pluginstance *pi,
+			struct ulogd_key *rec, struct ulogd_pluginstance *sink,
+			struct ulogd_key *dst)
+{
+	unsigned int i;
+
+	for (i = 0; i < sink->input.num_keys; i++) {
+		struct ulogd_key *key = sink->input.keys[i].u.source;
+		struct ulogd_key *val = key;
+		int owned = 0;
+
+		if (!key || (sink->input.keys[i].flags & ULOGD_KEYF_INACTIVE)) {
+			memset(&dst[i], 0, sizeof(dst[i]));
+			continue;
+		}
+
+		if (rec && key >= pi->output.keys &&
+		    key < pi->output.keys + pi->output.num_keys) {
+			val = &rec[key - pi->output.keys];
+			owned = 1;
+		}
+
+		memcpy(&dst[i], key, sizeof(dst[i]));
+		dst[i].dirty = NULL;
+		dst[i].flags = val->flags & ULOGD_RETF_VALID;
+		dst[i].len = val->len;
+		dst[i].u.value = val->u.value;
+
+		/* record values stay valid until the batch is done, but
+		 * filters may reuse their buffers for the next record */
+		if (owned || !(dst[i].flags & ULOGD_RETF_VALID) ||
+		    key->type != ULOGD_RET_STRING || !val->u.value.ptr)
+			continue;
+
+		/* the offset is turned into a pointer in batch_fixup() */
+		dst[i].u.value.ptr = (void *) batch_strdup(b, val->u.value.ptr);
+		if (dst[i].u.value.ptr)
+			dst[i].flags |= BATCH_F_STRBUF;
+		else
+			dst[i].flags &= ~ULOGD_RETF_VALID;
+	}
+}
+
+static void batch_fixup(struct ulogd_batch *b, unsigned int num,
+			unsigned int num_keys)
+{
+	unsigned int i;
+
+	for (i = 0; i < num * num_keys; i++) {
+		struct ulogd_key *key = &b->keys[i];
+
+		if (!(key->flags & BATCH_F_STRBUF))
+			continue;
+
+		key->flags &= ~BATCH_F_STRBUF;
+		key->u.value.ptr = b->strbuf + ((size_t) key->u.value.ptr - 1);
+	}
+}
+
+/* Propagate a batch of records through the stack of source pi. Filters
+ * still see one record at a time, but a sink implementing interp_batch
+ * is called once for all records that made it through the filters. */
+void ulogd_propagate_batch(struct ulogd_pluginstance *pi,
+			   struct ulogd_key **records, unsigned int num)
+{
+	struct ulogd_plan *plan = pi->stack->plan;
+	struct ulogd_pluginstance *sink = NULL;
+	struct ulogd_batch *b;
+	unsigned int i, staged = 0;
+	int direct, ret;
+
+	if (num == 0)
+		return;
+
+	if (plan->num_steps)
+		sink = plan->steps[plan->num_steps - 1].pi;
+
+	if (!sink || !sink->plugin->interp_batch || sink->async ||
+	    pi->stack->worker || batch_reserve(pi->stack, num, sink->input.num_keys) < 0) {
+		for (i = 0; i < num; i++) {
+			ulogd_load_record(pi, records[i]);
+			ulogd_propagate_results(pi);
+		}
+		return;
+	}
+	b = pi->stack->batch;
+
+	/* nothing in between: take the values right from the records */
+	direct = plan->num_steps == 1;
+
+	for (i = 0; i < num; i++) {
+		if (direct) {
+			batch_stage(b, pi, records[i], sink,
+				    b->records[staged++]);
+			continue;
+		}
+
+		ulogd_load_record(pi, records[i]);
+		if (propagate_upto(pi, sink) == 0)
+			batch_stage(b, pi, NULL, sink, b->records[staged++]);
+		ulogd_clean_results(pi);
+	}
+
+	if (staged == 0)
+		return;
+
+	batch_fixup(b, staged, sink->input.num_keys);
+
+	ret = sink->plugin->interp_batch(sink, b->records, staged);
+	if (ret == ULOGD_IRET_ERR)
+		ulogd_log(ULOGD_NOTICE, "error during propagate_batch\n");
+}
+
+/***********************************************************************
+ * record queues, stack worker threads and asynchronous sinks
+ ***********************************************************************/
+
+/* A queue hands records from one thread to another through a lock-free
+ * single-producer/single-consumer ring. A record is a compact copy of a
+ * set of keys, strings and sized RAW values included, so the producer
+ * may clean its keys right after pushing.
+ *
+ * With stack_threads, the source of each stack keeps running in the main
+ * loop while the plugins after it run on a worker thread. A sink
+ * configured with async=1 has its interp() called on a thread of its
+ * own, with its input keys rewired to a copy the queue is loaded into. */
+
+#define QUEUE_ALIGN(x)		(((x) + 7) & ~(size_t)7)
+/* rest of the ring is unused, continue at its start */
+#define QUEUE_WRAP		0xffffffff
+/* records run per acquisition of the run lock */
+#define QUEUE_CHUNK		64
+/* seconds between two "queue full" messages */
+#define QUEUE_WARN_INTERVAL	10
+
+/* value is an offset from the start of the record */
+#define QUEUE_F_BLOB		0x0001
+
+struct queue_val {
+	uint16_t idx;
+	uint16_t flags;
+	uint32_t len;
+	__typeof__(((struct ulogd_key *)0)->u.value) value;
+};
+
+struct queue_rec {
+	uint32_t len;
+	uint16_t num;
+	uint16_t pad;
+	struct queue_val vals[0];
+};
+
+struct ulogd_queue {
+	/* ring buffer, head is written by the producer only and tail by
+	 * the consumer only. Both grow monotonically. */
+	char *buf;
+	size_t size;
+	size_t head __attribute__((aligned(64)));
+	size_t tail __attribute__((aligned(64)));
+
+	pthread_t thread;
+	int running;
+	/* eventfd waking a consumer in the main loop, -1 for threads */
+	int efd;
+	/* held by the consumer while it runs records */
+	pthread_mutex_t run_lock;
+	/* sleeping consumer waits on wake, see queue_sleep() */
+	pthread_mutex_t wake_lock;
+	pthread_cond_t wake;
+	int sleeping;
+	int stop;
+
+	/* called on the thread for each record */
+	void (*run)(struct ulogd_queue *q, struct queue_rec *rec);
+	char name[ULOGD_MAX_KEYLEN + 16];
+
+	unsigned long pushed;
+	unsigned long dropped;
+	time_t last_warn;
+};
+
+struct ulogd_worker {
+	struct ulogd_queue q;
+	struct ulogd_pluginstance *source;
+	/* the worker's copy of the source output keys */
+	struct ulogd_key *shadow;
+	/* source output keys set by the record being built */
+	struct ulogd_keylog src_dirty;
+	/* all source output keys, pushed if src_dirty overflowed */
+	struct ulogd_key **src_keys;
+};
+
+struct ulogd_async {
+	struct ulogd_queue q;
+	struct ulogd_pluginstance *pi;
+	/* keys the sink inputs were resolved to, and the copy of them
+	 * the inputs now point to */
+	struct ulogd_key **orig;
+	struct ulogd_key *shadow;
+	uint64_t *valid;
+	unsigned int valid_words;
+};
+
+static struct config_keyset async_kset = {
+	.num_ces = 2,
+	.ces = {
+		{
+			.key = "async",
+			.type = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 0,
+		},
+		{
+			.key = "queue_size",
+			.type = CONFIG_TYPE_INT,
+			.options = CONFIG_OPT_NONE,
+			.u.value = 4096,
+		},
+	},
+};
+
+#define async_ce(x)		((x)->ces[0])
+#define async_size_ce(x)	((x)->ces[1])
+
+static struct ulogd_pluginstance *callback_owner;
+
+/* the queue whose consumer may run code of pi concurrently */
+static struct ulogd_queue *callback_queue(struct ulogd_pluginstance *pi)
+{
+	if (!pi)
+		return NULL;
+	if (pi->async)
+		return &pi->async->q;
+	/* the source of a threaded stack runs in the main loop */
+	if (!pi->stack->worker || pi->list.prev == &pi->stack->list)
+		return NULL;
+	return &pi->stack->worker->q;
+}
+
+struct ulogd_pluginstance *ulogd_callback_enter(struct ulogd_pluginstance *pi)
+{
+	struct ulogd_pluginstance *prev = callback_owner;
+	struct ulogd_queue *q = callback_queue(pi);
+
+	if (q && q->running)
+		pthread_mutex_lock(&q->run_lock);
+	callback_owner = pi;
+	return prev;
+}
+
+void ulogd_callback_leave(struct ulogd_pluginstance *pi,
+			  struct ulogd_pluginstance *prev)
+{
+	struct ulogd_queue *q = callback_queue(pi);
+
+	if (q && q->running)
+		pthread_mutex_unlock(&q->run_lock);
+	callback_owner = prev;
+}
+
+struct ulogd_pluginstance *ulogd_callback_owner(void)
+{
+	return callback_owner;
+}
+
+/* round a size in kilobytes up to a power of two */
+static size_t queue_size(int kbytes)
+{
+	size_t size = 4096;
+
+	while (size < (size_t)kbytes * 1024 && size < ((size_t)1 << 31))
+		size <<= 1;
+
+	return size;
+}
+
+static void *queue_thread(void *data);
+
+static int queue_init(struct ulogd_queue *q, size_t size,
+		      void (*run)(struct ulogd_queue *q,
+				  struct queue_rec *rec))
+{
+	q->buf = malloc(size);
+	if (!q->buf)
+		return -ENOMEM;
+	q->size = size;
+	q->run = run;
+	q->efd = -1;
+	pthread_mutex_init(&q->run_lock, NULL);
+	pthread_mutex_init(&q->wake_lock, NULL);
+	pthread_cond_init(&q->wake, NULL);
+	return 0;
+}
+
+static void queue_fini(struct ulogd_queue *q)
+{
+	pthread_mutex_destroy(&q->run_lock);
+	pthread_mutex_destroy(&q->wake_lock);
+	pthread_cond_destroy(&q->wake);
+	free(q->buf);
+}
+
+static int queue_start(struct ulogd_queue *q)
+{
+	sigset_t all, old;
+	int ret;
+
+	/* signals are handled by the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&q->thread, NULL, queue_thread, q);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		ulogd_log(ULOGD_ERROR, "can't start thread for %s: %s\n",
+			  q->name, strerror(ret));
+		return -1;
+	}
+	q->running = 1;
+
+	return 0;
+}
+
+/* let the consumer drain the queue and wait for it */
+static void queue_stop(struct ulogd_queue *q)
+{
+	if (!q->running)
+		return;
+
+	__atomic_store_n(&q->stop, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&q->wake_lock);
+	pthread_cond_signal(&q->wake);
+	pthread_mutex_unlock(&q->wake_lock);
+	pthread_join(q->thread, NULL);
+	q->running = 0;
+
+	ulogd_log(ULOGD_INFO, "%s: %lu records queued, %lu dropped\n",
+		  q->name, q->pushed, q->dropped);
+}
+
+/* size of the data behind a key that has to be copied along, -1 if the
+ * value can't cross threads at all */
+static ssize_t queue_blob_len(struct ulogd_key *key)
+{
+	switch (key->type) {
+	case ULOGD_RET_STRING:
+	case ULOGD_RET_RAWSTR:
+		if (!key->u.value.ptr)
+			return 0;
+		return strlen(key->u.value.ptr) + 1;
+	case ULOGD_RET_RAW:
+		/* no length: an object of some library, e.g. a conntrack */
+		if (!key->u.value.ptr || key->len == 0)
+			return -1;
+		return key->len;
+	default:
+		return 0;
+	}
+}
+
+static void queue_drop(struct ulogd_queue *q)
+{
+	time_t now = time(NULL);
+
+	q->dropped++;
+	if (now - q->last_warn < QUEUE_WARN_INTERVAL)
+		return;
+
+	q->last_warn = now;
+	ulogd_log(ULOGD_NOTICE, "queue of %s full, %lu records dropped "
+		  "so far\n", q->name, q->dropped);
+}
+
+/* copy the valid ones of keys into the ring. The index of a key is its
+ * offset from base, or its position in keys if base is NULL. Returns -1
+ * if the record was dropped. */
+static int queue_push(struct ulogd_queue *q, struct ulogd_key **keys,
+		      unsigned int n, struct ulogd_key *base)
+{
+	unsigned int i, num = 0;
+	size_t len, blob = 0, pos, skip = 0, tail;
+	struct queue_rec *rec;
+	char *data;
+
+	/* size the record first */
+	for (i = 0; i < n; i++) {
+		ssize_t l;
+
+		if (!keys[i] || !(keys[i]->flags & ULOGD_RETF_VALID))
+			continue;
+		l = queue_blob_len(keys[i]);
+		if (l < 0)
+			continue;
+		blob += l;
+		num++;
+	}
+	len = QUEUE_ALIGN(sizeof(*rec) + num * sizeof(struct queue_val) +
+			  blob);
+
+	pos = q->head & (q->size - 1);
+	if (len > q->size - pos)
+		skip = q->size - pos;
+	tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	if (len > q->size || skip + len > q->size - (q->head - tail)) {
+		queue_drop(q);
+		return -1;
+	}
+	if (skip) {
+		*(uint32_t *)(q->buf + pos) = QUEUE_WRAP;
+		pos = 0;
+	}
+
+	rec = (struct queue_rec *)(q->buf + pos);
+	rec->len = len;
+	rec->num = num;
+	data = (char *)&rec->vals[num];
+
+	num = 0;
+	for (i = 0; i < n; i++) {
+		struct ulogd_key *key = keys[i];
+		struct queue_val *v = &rec->vals[num];
+		ssize_t l;
+
+		if (!key || !(key->flags & ULOGD_RETF_VALID))
+			continue;
+		l = queue_blob_len(key);
+		if (l < 0)
+			continue;
+
+		v->idx = base ? key - base : i;
+		v->flags = 0;
+		v->len = key->len;
+		memcpy(&v->value, &key->u.value, sizeof(v->value));
+		if (l > 0) {
+			memcpy(data, key->u.value.ptr, l);
+			v->value.ptr = (void *)(data - (char *)rec);
+			v->flags = QUEUE_F_BLOB;
+			data += l;
+		}
+		num++;
+	}
+
+	/* publish, then wake the consumer if it went to sleep */
+	__atomic_store_n(&q->head, q->head + skip + len, __ATOMIC_SEQ_CST);
+	q->pushed++;
+	if (!__atomic_load_n(&q->sleeping, __ATOMIC_SEQ_CST))
+		return 0;
+
+	if (q->efd >= 0) {
+		uint64_t one = 1;
+
+		if (__atomic_exchange_n(&q->sleeping, 0, __ATOMIC_SEQ_CST))
+			(void)write(q->efd, &one, sizeof(one));
+	} else {
+		pthread_mutex_lock(&q->wake_lock);
+		pthread_cond_signal(&q->wake);
+		pthread_mutex_unlock(&q->wake_lock);
+	}
+	return 0;
+}
+
+/* load a queued value into key */
+static void queue_load(struct ulogd_key *key, struct queue_rec *rec,
+		       struct queue_val *v)
+{
+	key->len = v->len;
+	memcpy(&key->u.value, &v->value, sizeof(v->value));
+	if (v->flags & QUEUE_F_BLOB)
+		key->u.value.ptr = (char *)rec + (size_t)v->value.ptr;
+}
+
+static void queue_sleep(struct ulogd_queue *q)
+{
+	pthread_mutex_lock(&q->wake_lock);
+	__atomic_store_n(&q->sleeping, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->head, __ATOMIC_SEQ_CST) == q->tail &&
+	    !__atomic_load_n(&q->stop, __ATOMIC_SEQ_CST))
+		pthread_cond_wait(&q->wake, &q->wake_lock);
+	__atomic_store_n(&q->sleeping, 0, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&q->wake_lock);
+}
+
+static void *queue_thread(void *data)
+{
+	struct ulogd_queue *q = data;
+
+	while (1) {
+		size_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		unsigned int n = 0;
+
+		if (head == q->tail) {
+			/* drained, leave only now if asked to stop */
+			if (__atomic_load_n(&q->stop, __ATOMIC_ACQUIRE))
+				break;
+			queue_sleep(q);
+			continue;
+		}
+
+		pthread_mutex_lock(&q->run_lock);
+		while (q->tail != head && n++ < QUEUE_CHUNK) {
+			size_t pos = q->tail & (q->size - 1);
+			struct queue_rec *rec = (void *)(q->buf + pos);
+			size_t len;
+
+			if (rec->len == QUEUE_WRAP) {
+				len = q->size - pos;
+			} else {
+				len = rec->len;
+				q->run(q, rec);
+			}
+			__atomic_store_n(&q->tail, q->tail + len,
+					 __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&q->run_lock);
+	}
+
+	return NULL;
+}
+
+static void worker_clean_source(struct ulogd_pluginstance *pi,
+				struct ulogd_worker *w)
+{
+	struct ulogd_keylog *log = &w->src_dirty;
+	unsigned int i;
+
+	if (!log->overflow) {
+		for (i = 0; i < log->num; i++)
+			clean_key(log->keys[i]);
+	} else {
+		for (i = 0; i < pi->output.num_keys; i++)
+			clean_key(&pi->output.keys[i]);
+		log->overflow = 0;
+	}
+	log->num = 0;
+}
+
+/* hand the source keys of the current record over to the worker */
+static void worker_push(struct ulogd_pluginstance *pi)
+{
+	struct ulogd_worker *w = pi->stack->worker;
+
+	if (!w->src_dirty.overflow)
+		queue_push(&w->q, w->src_dirty.keys, w->src_dirty.num,
+			   pi->output.keys);
+	else
+		queue_push(&w->q, w->src_keys, pi->output.num_keys,
+			   pi->output.keys);
+	worker_clean_source(pi, w);
+}
+
+static void worker_run(struct ulogd_queue *q, struct queue_rec *rec)
+{
+	struct ulogd_worker *w = (struct ulogd_worker *)q;
+	unsigned int i;
+
+	for (i = 0; i < rec->num; i++) {
+		struct ulogd_key *key = &w->shadow[rec->vals[i].idx];
+
+		queue_load(key, rec, &rec->vals[i]);
+		okey_set_valid(key);
+	}
+
+	propagate_upto(w->source, NULL);
+	ulogd_clean_results(w->source);
+}
+
+static void worker_free(struct ulogd_worker *w)
+{
+	queue_fini(&w->q);
+	free(w->src_dirty.keys);
+	free(w->src_keys);
+	free(w->shadow);
+	free(w);
+}
+
+/* rewire keys resolved to one of the n keys at from to the one at the
+ * same position in to */
+static void rebase_inputs(struct ulogd_plan *plan, struct ulogd_key *from,
+			  struct ulogd_key *to, unsigned int n)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < plan->num_steps; i++) {
+		struct ulogd_pluginstance *pi = plan->steps[i].pi;
+
+		for (j = 0; j < pi->input.num_keys; j++) {
+			struct ulogd_key *src = pi->input.keys[j].u.source;
+
+			if (src >= from && src < from + n)
+				pi->input.keys[j].u.source = &to[src - from];
+		}
+	}
+}
+
+/* rewire the stack to a worker's copy of the source keys */
+static int worker_setup(struct ulogd_pluginstance_stack *stack, size_t size)
+{
+	struct ulogd_plan *plan = stack->plan;
+	struct ulogd_pluginstance *source;
+	struct ulogd_key *keys;
+	struct ulogd_worker *w;
+	unsigned int i, n;
+	void *ptr;
+
+	source = llist_entry(stack->list.next, struct ulogd_pluginstance,
+			     list);
+	keys = source->output.keys;
+	n = source->output.num_keys;
+
+	if (posix_memalign(&ptr, 64, sizeof(*w)))
+		return -ENOMEM;
+	w = ptr;
+	memset(w, 0, sizeof(*w));
+	w->source = source;
+	w->shadow = calloc(n + 1, sizeof(struct ulogd_key));
+	w->src_keys = calloc(n + 1, sizeof(struct ulogd_key *));
+	w->src_dirty.keys = calloc(n + 1, sizeof(struct ulogd_key *));
+	if (!w->shadow || !w->src_keys || !w->src_dirty.keys ||
+	    queue_init(&w->q, size, worker_run) < 0) {
+		free(w->shadow);
+		free(w->src_keys);
+		free(w->src_dirty.keys);
+		free(w);
+		return -ENOMEM;
+	}
+	w->src_dirty.size = n;
+	snprintf(w->q.name, sizeof(w->q.name), "stack of %s", source->id);
+
+	for (i = 0; i < n; i++) {
+		w->shadow[i] = keys[i];
+		w->shadow[i].flags &= ~(ULOGD_RETF_VALID | ULOGD_RETF_FREE);
+		memset(&w->shadow[i].u.value, 0,
+		       sizeof(w->shadow[i].u.value));
+		w->src_keys[i] = &keys[i];
+		keys[i].dirty = &w->src_dirty;
+		/* the source keys come first in the plan */
+		plan->keys[i] = &w->shadow[i];
+	}
+	rebase_inputs(plan, keys, w->shadow, n);
+	stack->worker = w;
+
+	ulogd_log(ULOGD_INFO, "%s runs on its own thread, %zu bytes queue\n",
+		  w->q.name, size);
+
+	return 0;
+}
+
+/* called by the plan in place of the interp of an asynchronous sink */
+static int async_push(struct ulogd_pluginstance *pi)
 {
-	int	ret;
-	unsigned char c;
+	struct ulogd_async *a = pi->async;
 
-	while ((ret = read(fd, &c, 1)) > 0) {
-		call_signal_handler_tasks((int)c);
-	}
-	return 0;
+	queue_push(&a->q, a->orig, pi->input.num_keys, NULL);
+	return ULOGD_IRET_OK;
 }
 
-static int create_signal_channel(void)
+static void async_run(struct ulogd_queue *q, struct queue_rec *rec)
 {
-	int	ret;
-	long	flags;
+	struct ulogd_async *a = (struct ulogd_async *)q;
+	unsigned int i;
+	int ret;
 
-	if ((ret = pipe(signal_channel)) < 0)
-		return ret;
+	memset(a->valid, 0, a->valid_words * sizeof(uint64_t));
+	for (i = 0; i < rec->num; i++) {
+		unsigned int idx = rec->vals[i].idx;
 
-	/* SIGNAL_RX_FD, channel[0] */
-	if ((flags = fcntl(SIGNAL_RX_FD, F_GETFL)) < 0)
-		goto err_exit;
-	flags |= O_NONBLOCK;
-	if ( fcntl(SIGNAL_RX_FD, F_SETFL, flags) < 0 )
-		goto err_exit;
+		queue_load(&a->shadow[idx], rec, &rec->vals[i]);
+		a->shadow[idx].flags |= ULOGD_RETF_VALID;
+		a->valid[idx / 64] |= 1ULL << (idx % 64);
+	}
 
-	/* SIGNAL_TX_FD, channel[1] */
-	if ((flags = fcntl(SIGNAL_TX_FD, F_GETFL)) < 0)
-		goto err_exit;
-	flags |= O_NONBLOCK;
-	if ( fcntl(SIGNAL_TX_FD, F_SETFL, flags) < 0 )
-		goto err_exit;
+	ret = a->pi->plugin->interp(a->pi);
+	if (ret == ULOGD_IRET_ERR)
+		ulogd_log(ULOGD_NOTICE, "error during propagate_results\n");
 
-	/* register SIGNAL_RX_FD to ulogd */
-	signal_channel_ulogfd.fd = SIGNAL_RX_FD;
-	ulogd_register_fd(&signal_channel_ulogfd);
+	for (i = 0; i < rec->num; i++)
+		a->shadow[rec->vals[i].idx].flags &= ~ULOGD_RETF_VALID;
+}
 
-	return 0;
+static void async_free(struct ulogd_async *a)
+{
+	queue_fini(&a->q);
+	free(a->orig);
+	free(a->shadow);
+	free(a->valid);
+	free(a);
+}
 
-err_exit:
-	if (SIGNAL_RX_FD >= 0) {
-		(void)close(SIGNAL_RX_FD);
-		SIGNAL_RX_FD = -1;
+/* move the sink of the stack to a thread of its own if configured so */
+static int async_setup(struct ulogd_pluginstance_stack *stack)
+{
+	struct ulogd_plan *plan = stack->plan;
+	struct ulogd_plan_step *step;
+	struct config_keyset *kset;
+	struct ulogd_async *a;
+	struct ulogd_pluginstance *pi;
+	unsigned int i, n;
+	size_t size;
+	void *ptr;
+
+	if (plan->num_steps == 0)
+		return 0;
+	step = &plan->steps[plan->num_steps - 1];
+	pi = step->pi;
+
+	/* the keys are looked up in the section of the sink */
+	size = sizeof(*kset) + async_kset.num_ces * sizeof(kset->ces[0]);
+	kset = malloc(size);
+	if (!kset)
+		return -ENOMEM;
+	memcpy(kset, &async_kset, size);
+	if (config_parse_file(pi->id, kset) < 0 || !async_ce(kset).u.value) {
+		free(kset);
+		return 0;
 	}
-	if (SIGNAL_TX_FD >= 0) {
-		(void)close(SIGNAL_TX_FD);
-		SIGNAL_TX_FD = -1;
+	size = queue_size(async_size_ce(kset).u.value);
+	free(kset);
+
+	if (pi->plugin->output.type != ULOGD_DTYPE_SINK) {
+		ulogd_log(ULOGD_ERROR, "%s: async is only supported for "
+			  "output plugins\n", pi->id);
+		return 0;
 	}
-	return -1;
+
+	n = pi->input.num_keys;
+	if (posix_memalign(&ptr, 64, sizeof(*a)))
+		return -ENOMEM;
+	a = ptr;
+	memset(a, 0, sizeof(*a));
+	a->pi = pi;
+	a->valid_words = (n + 63) / 64;
+	a->orig = calloc(n + 1, sizeof(struct ulogd_key *));
+	a->shadow = calloc(n + 1, sizeof(struct ulogd_key));
+	a->valid = calloc(a->valid_words + 1, sizeof(uint64_t));
+	if (!a->orig || !a->shadow || !a->valid ||
+	    queue_init(&a->q, size, async_run) < 0) {
+		free(a->orig);
+		free(a->shadow);
+		free(a->valid);
+		free(a);
+		return -ENOMEM;
+	}
+	snprintf(a->q.name, sizeof(a->q.name), "%s", pi->id);
+
+	for (i = 0; i < n; i++) {
+		struct ulogd_key *src = pi->input.keys[i].u.source;
+
+		if (!src || pi->input.keys[i].flags & ULOGD_KEYF_INACTIVE)
+			continue;
+		a->orig[i] = src;
+		a->shadow[i] = *src;
+		a->shadow[i].flags &= ~(ULOGD_RETF_VALID | ULOGD_RETF_FREE);
+		a->shadow[i].dirty = NULL;
+		memset(&a->shadow[i].u.value, 0,
+		       sizeof(a->shadow[i].u.value));
+		pi->input.keys[i].u.source = &a->shadow[i];
+	}
+	pi->input_valid = a->valid;
+	pi->async = a;
+
+	/* the bitmap of the plan is not used by the sink anymore */
+	step->interp = async_push;
+	plan->sink = NULL;
+
+	ulogd_log(ULOGD_INFO, "%s runs on its own thread, %zu bytes queue\n",
+		  pi->id, a->q.size);
+
+	return 0;
 }
 
+/* records a source builds on a thread of its own are run in the main
+ * loop, up to FEED_BUDGET per wakeup */
+#define FEED_BUDGET	64
 
-/***********************************************************************
- * MAIN PROGRAM
- ***********************************************************************/
+struct ulogd_feed {
+	struct ulogd_queue q;
+	struct ulogd_pluginstance *pi;
+	struct ulogd_fd ufd;
+	/* producer: the keys of the record being pushed */
+	struct ulogd_key **ptrs;
+	/* consumer: records loaded from the ring */
+	struct ulogd_key *keys;
+	struct ulogd_key *recs[FEED_BUDGET];
+};
 
-static inline int ulogd2syslog_level(int level)
+/* run the queued records through the stacks of the source */
+static unsigned int feed_drain(struct ulogd_feed *f)
 {
-	int syslog_level = LOG_WARNING;
+	struct ulogd_queue *q = &f->q;
+	struct ulogd_pluginstance *pi = f->pi, *npi;
+	size_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	size_t tail = q->tail;
+	unsigned int i, j, n = 0;
+
+	while (tail != head && n < FEED_BUDGET) {
+		size_t pos = tail & (q->size - 1);
+		struct queue_rec *rec = (void *)(q->buf + pos);
+
+		if (rec->len == QUEUE_WRAP) {
+			tail += q->size - pos;
+			continue;
+		}
+		for (i = 0; i < rec->num; i++) {
+			struct ulogd_key *key = &f->recs[n][rec->vals[i].idx];
 
-	switch (level) {
-		case ULOGD_DEBUG:
-			syslog_level = LOG_DEBUG;
-			break;
-		case ULOGD_INFO:
-			syslog_level = LOG_INFO;
-			break;
-		case ULOGD_NOTICE:
-			syslog_level = LOG_NOTICE;
-			break;
-		case ULOGD_ERROR:
-			syslog_level = LOG_ERR;
-			break;
-		case ULOGD_FATAL:
-			syslog_level = LOG_CRIT;
-			break;
+			queue_load(key, rec, &rec->vals[i]);
+			key->flags |= ULOGD_RETF_VALID;
+		}
+		tail += rec->len;
+		n++;
 	}
 
-	return syslog_level;
+	if (n) {
+		llist_for_each_entry(npi, &pi->plist, plist)
+			ulogd_propagate_batch(npi, f->recs, n);
+		ulogd_propagate_batch(pi, f->recs, n);
+
+		for (i = 0; i < n; i++) {
+			for (j = 0; j < pi->output.num_keys; j++)
+				f->recs[i][j].flags &= ~ULOGD_RETF_VALID;
+		}
+	}
+	/* the values pointed into the ring until now */
+	__atomic_store_n(&q->tail, tail, __ATOMIC_RELEASE);
+
+	return n;
 }
 
-/* log message to the logfile */
-void __ulogd_log(int level, char *file, int line, const char *format, ...)
+static int feed_read_cb(int fd, unsigned int what, void *data)
 {
-	char *timestr;
-	va_list ap;
-	time_t tm;
-	FILE *outfd;
+	struct ulogd_feed *f = data;
+	struct ulogd_queue *q = &f->q;
+	uint64_t cnt, one = 1;
 
-	/* log only messages which have level at least as high as loglevel */
-	if (level < loglevel_ce.u.value)
-		return;
+	if (!(what & ULOGD_FD_READ))
+		return 0;
 
-	if (logfile == syslog_dummy) {
-		/* FIXME: this omits the 'file' string */
-		va_start(ap, format);
-		vsyslog(ulogd2syslog_level(level), format, ap);
-		va_end(ap);
-	} else {
-		if (logfile)
-			outfd = logfile;
-		else
-			outfd = stderr;
+	(void)read(fd, &cnt, sizeof(cnt));
 
-		tm = time(NULL);
-		timestr = ctime(&tm);
-		timestr[strlen(timestr)-1] = '\0';
-		fprintf(outfd, "%s <%1.1d> %s:%d ", timestr, level, file, line);
-		if (verbose && outfd != stderr)
-			fprintf(stderr, "%s <%1.1d> %s:%d ", timestr, level, file, line);
+	if (feed_drain(f) == FEED_BUDGET) {
+		/* more to do, but let the other descriptors run first */
+		(void)write(fd, &one, sizeof(one));
+		return 0;
+	}
 
+	/* go to sleep unless a record came in meanwhile */
+	__atomic_store_n(&q->sleeping, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->head, __ATOMIC_SEQ_CST) != q->tail &&
+	    __atomic_exchange_n(&q->sleeping, 0, __ATOMIC_SEQ_CST))
+		(void)write(fd, &one, sizeof(one));
 
-		va_start(ap, format);
-		vfprintf(outfd, format, ap);
-		va_end(ap);
-		/* flush glibc's buffer */
-		fflush(outfd);
+	return 0;
+}
 
-		if (verbose && outfd != stderr) {
-			va_start(ap, format);
-			vfprintf(stderr, format, ap);
-			va_end(ap);
-			fflush(stderr);
-		}
+struct ulogd_feed *ulogd_feed_create(struct ulogd_pluginstance *pi,
+				     unsigned int kbytes)
+{
+	unsigned int i, n = pi->output.num_keys;
+	struct ulogd_feed *f;
+	void *ptr;
 
+	if (posix_memalign(&ptr, 64, sizeof(*f)))
+		return NULL;
+	f = ptr;
+	memset(f, 0, sizeof(*f));
+	f->pi = pi;
+	f->ptrs = calloc(n + 1, sizeof(struct ulogd_key *));
+	f->keys = calloc(FEED_BUDGET * n + 1, sizeof(struct ulogd_key));
+	if (!f->ptrs || !f->keys)
+		goto err;
+	if (queue_init(&f->q, queue_size(kbytes), NULL) < 0)
+		goto err;
+	snprintf(f->q.name, sizeof(f->q.name), "feed of %s", pi->id);
+
+	for (i = 0; i < FEED_BUDGET; i++) {
+		f->recs[i] = &f->keys[i * n];
+		ulogd_init_record(pi, f->recs[i]);
+	}
+
+	f->q.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (f->q.efd < 0) {
+		queue_fini(&f->q);
+		goto err;
+	}
+	/* nothing queued yet: the first record has to wake us */
+	f->q.sleeping = 1;
+
+	f->ufd.fd = f->q.efd;
+	f->ufd.cb = &feed_read_cb;
+	f->ufd.data = f;
+	f->ufd.when = ULOGD_FD_READ;
+	if (ulogd_register_fd(&f->ufd) < 0) {
+		close(f->q.efd);
+		queue_fini(&f->q);
+		goto err;
 	}
+
+	return f;
+
+err:
+	free(f->ptrs);
+	free(f->keys);
+	free(f);
+	return NULL;
 }
 
-static void warn_and_exit(int daemonize)
+int ulogd_feed_push(struct ulogd_feed *f, struct ulogd_key *rec)
 {
-	cleanup_pidfile();
+	unsigned int i, n = f->pi->output.num_keys;
+	int ret;
 
-	if (!daemonize) {
-		if (logfile && !verbose) {
-			fprintf(stderr, "Fatal error, check logfile \"%s\""
-				" or use '-v' flag.\n",
-				ulogd_logfile);
+	for (i = 0; i < n; i++)
+		f->ptrs[i] = &rec[i];
+	ret = queue_push(&f->q, f->ptrs, n, rec);
+	for (i = 0; i < n; i++)
+		clean_key(&rec[i]);
 
-		} else
-			fprintf(stderr, "Fatal error.\n");
-	}
-exit(1);
+	return ret;
 }
 
-/* clean results (set all values to 0 and free pointers) */
-static void ulogd_clean_results(struct ulogd_pluginstance *pi)
+void ulogd_feed_destroy(struct ulogd_feed *f)
 {
-	struct ulogd_pluginstance *cur;
+	int left = __atomic_load_n(&f->q.head, __ATOMIC_ACQUIRE) != f->q.tail;
 
-	DEBUGP("cleaning up results\n");
+	ulogd_unregister_fd(&f->ufd);
+	close(f->q.efd);
 
-	/* iterate through plugin stack */
-	llist_for_each_entry(cur, &pi->stack->list, list) {
-		unsigned int i;
-		
-		/* iterate through input keys of pluginstance */
-		for (i = 0; i < cur->output.num_keys; i++) {
-			struct ulogd_key *key = &cur->output.keys[i];
+	ulogd_log(ULOGD_INFO, "%s: %lu records queued, %lu dropped%s\n",
+		  f->q.name, f->q.pushed, f->q.dropped,
+		  left ? ", some left unprocessed" : "");
 
-			if (!(key->flags & ULOGD_RETF_VALID))
-				continue;
+	queue_fini(&f->q);
+	free(f->ptrs);
+	free(f->keys);
+	free(f);
+}
 
-			if (key->flags & ULOGD_RETF_FREE) {
-				free(key->u.value.ptr);
-				key->u.value.ptr = NULL;
-			}
-			memset(&key->u.value, 0, sizeof(key->u.value));
-			key->flags &= ~ULOGD_RETF_VALID;
+/* set up the configured threads once all stacks are there */
+static int start_stack_threads(void)
+{
+	struct ulogd_pluginstance_stack *stack;
+	struct ulogd_pluginstance *pi;
+
+	/* the sink inputs may be rebased onto the copy of a worker */
+	llist_for_each_entry(stack, &ulogd_pi_stacks, stack_list) {
+		if (!stack->plan || stack->plan->num_steps == 0)
+			continue;
+		if (threads_ce.u.value &&
+		    worker_setup(stack, queue_size(queue_size_ce.u.value)) < 0)
+			return -1;
+		if (async_setup(stack) < 0)
+			return -1;
+	}
+
+	llist_for_each_entry(stack, &ulogd_pi_stacks, stack_list) {
+		llist_for_each_entry(pi, &stack->list, list) {
+			if (pi->async && queue_start(&pi->async->q) < 0)
+				return -1;
 		}
+		if (stack->worker && queue_start(&stack->worker->q) < 0)
+			return -1;
 	}
+
+	return 0;
 }
 
-/* propagate results to all downstream plugins in the stack */
-void ulogd_propagate_results(struct ulogd_pluginstance *pi)
+/* stop the workers first, they feed the asynchronous sinks */
+static void stop_stack_threads(void)
 {
-	struct ulogd_pluginstance *cur = pi;
-	int abort_stack = 0;
-	/* iterate over remaining plugin stack */
-	llist_for_each_entry_continue(cur, &pi->stack->list, list) {
-		int ret;
-		
-		ret = cur->plugin->interp(cur);
-		switch (ret) {
-		case ULOGD_IRET_ERR:
-			ulogd_log(ULOGD_NOTICE,
-				  "error during propagate_results\n");
-			/* fallthrough */
-		case ULOGD_IRET_STOP:
-			/* we shall abort further iteration of the stack */
-			abort_stack = 1;
-			break;
-		case ULOGD_IRET_OK:
-			/* we shall continue travelling down the stack */
-			continue;
-		default:
-			ulogd_log(ULOGD_NOTICE,
-				  "unknown return value `%d' from plugin %s\n",
-				  ret, cur->plugin->name);
-			abort_stack = 1;
-			break;
-		}
+	struct ulogd_pluginstance_stack *stack;
+	struct ulogd_pluginstance *pi;
 
-		if (abort_stack)
-			break;
+	llist_for_each_entry(stack, &ulogd_pi_stacks, stack_list) {
+		if (stack->worker)
+			queue_stop(&stack->worker->q);
 	}
 
-	ulogd_clean_results(pi);
+	llist_for_each_entry(stack, &ulogd_pi_stacks, stack_list) {
+		llist_for_each_entry(pi, &stack->list, list) {
+			if (pi->async)
+				queue_stop(&pi->async->q);
+		}
+	}
 }
 
 static struct ulogd_pluginstance *
@@ -804,8 +2081,12 @@ create_stack_resolve_keys(struct ulogd_pluginstance_stack *stack)
 		/* call plugin to tell us which keys it requires in
 		 * given configuration */
 		if (pi_cur->plugin->configure) {
-			int ret = pi_cur->plugin->configure(pi_cur, 
-							    stack);
+			struct ulogd_pluginstance *prev;
+			int ret;
+
+			prev = ulogd_callback_enter(pi_cur);
+			ret = pi_cur->plugin->configure(pi_cur, stack);
+			ulogd_callback_leave(pi_cur, prev);
 			if (ret < 0) {
 				ulogd_log(ULOGD_ERROR, "error during "
 					  "configure of plugin %s\n",
@@ -889,6 +2170,9 @@ create_stack_resolve_keys(struct ulogd_pluginstance_stack *stack)
 					  "source for %s(%s)\n", okey->name,
 					  pi_cur->plugin->name, ikey->name);
 				ikey->u.source = okey;
+				okey->flags |= ULOGD_RETF_NEEDED;
+				if (!(ikey->flags & ULOGD_KEYF_HEADERS))
+					okey->flags |= ULOGD_RETF_PAYLOAD;
 			}
 		}
 	}
@@ -940,7 +2224,11 @@ static int create_stack_start_instances(struct ulogd_pluginstance_stack *stack)
 
 		/* only call start if a plugin with same ID was not started */
 		if (!pluginstance_started(pi)) {
+			struct ulogd_pluginstance *prev;
+
+			prev = ulogd_callback_enter(pi);
 			ret = pi->plugin->start(pi);
+			ulogd_callback_leave(pi, prev);
 			if (ret < 0) {
 				ulogd_log(ULOGD_ERROR, 
 					  "error starting `%s'\n",
@@ -952,6 +2240,94 @@ static int create_stack_start_instances(struct ulogd_pluginstance_stack *stack)
 	return 0;
 }
 
+/* flatten the stack into arrays for the propagation hot path */
+static int create_stack_compile(struct ulogd_pluginstance_stack *stack,
+				const char *option)
+{
+	struct ulogd_plan *plan;
+	struct ulogd_pluginstance *pi;
+	unsigned int i, num_steps = 0, num_keys = 0;
+	int level = verbose ? ULOGD_NOTICE : ULOGD_DEBUG;
+
+	llist_for_each_entry(pi, &stack->list, list) {
+		if (&pi->list != stack->list.next)
+			num_steps++;
+		num_keys += pi->output.num_keys;
+	}
+
+	plan = calloc(1, sizeof(*plan));
+	if (!plan)
+		return -ENOMEM;
+
+	plan->steps = calloc(num_steps + 1, sizeof(*plan->steps));
+	plan->keys = calloc(num_keys + 1, sizeof(*plan->keys));
+	plan->dirty.keys = calloc(num_keys + 1, sizeof(*plan->dirty.keys));
+	if (!plan->steps || !plan->keys || !plan->dirty.keys) {
+		free(plan->steps);
+		free(plan->keys);
+		free(plan->dirty.keys);
+		free(plan);
+		return -ENOMEM;
+	}
+	plan->dirty.size = num_keys;
+
+	/* the first plugin is the source, it never gets interp called */
+	llist_for_each_entry(pi, &stack->list, list) {
+		if (&pi->list != stack->list.next) {
+			plan->steps[plan->num_steps].interp = pi->plugin->interp;
+			plan->steps[plan->num_steps].pi = pi;
+			plan->num_steps++;
+		}
+		for (i = 0; i < pi->output.num_keys; i++) {
+			struct ulogd_key *key = &pi->output.keys[i];
+
+			key->dirty = &plan->dirty;
+			key->sink_idx = -1;
+			plan->keys[plan->num_keys++] = key;
+		}
+	}
+
+	/* map the output keys to the sink inputs they feed */
+	if (plan->num_steps) {
+		pi = plan->steps[plan->num_steps - 1].pi;
+		plan->valid_words = (pi->input.num_keys + 63) / 64;
+		plan->valid = calloc(plan->valid_words + 1, sizeof(uint64_t));
+		if (!plan->valid) {
+			free(plan->steps);
+			free(plan->keys);
+			free(plan->dirty.keys);
+			free(plan);
+			return -ENOMEM;
+		}
+		plan->sink = pi;
+		pi->input_valid = plan->valid;
+
+		for (i = 0; i < pi->input.num_keys; i++) {
+			struct ulogd_key *key = pi->input.keys[i].u.source;
+
+			if (!key ||
+			    pi->input.keys[i].flags & ULOGD_KEYF_INACTIVE)
+				continue;
+			if (key->sink_idx >= 0)
+				plan->valid_scan = 1;
+			else
+				key->sink_idx = i;
+		}
+	}
+	stack->plan = plan;
+
+	ulogd_log(level, "compiled stack '%s': %u steps, %u output keys\n",
+		  option, plan->num_steps, plan->num_keys);
+	for (i = 0; i < plan->num_steps; i++) {
+		pi = plan->steps[i].pi;
+		ulogd_log(level, "  [%u] %s (%s)%s\n", i, pi->id,
+			  pi->plugin->name,
+			  pi->plugin->interp_batch ? " batch" : "");
+	}
+
+	return 0;
+}
+
 /* create a new stack of plugins */
 static int create_stack(const char *option)
 {
@@ -974,6 +2350,9 @@ static int create_stack(const char *option)
 		goto out_stack;
 	}
 	INIT_LLIST_HEAD(&stack->list);
+	stack->plan = NULL;
+	stack->batch = NULL;
+	stack->worker = NULL;
 
 	ulogd_log(ULOGD_NOTICE, "building new pluginstance stack: '%s'\n",
 		  option);
@@ -1040,6 +2419,13 @@ static int create_stack(const char *option)
 		goto out;
 	}
 
+	/* PASS 4: compile the stack into its execution plan */
+	ret = create_stack_compile(stack, option);
+	if (ret < 0) {
+		ulogd_log(ULOGD_ERROR, "unable to compile stack\n");
+		goto out;
+	}
+
 	/* add head of pluginstance stack to list of stacks */
 	llist_add(&stack->stack_list, &ulogd_pi_stacks);
 	free(buf);
@@ -1057,18 +2443,15 @@ out_buf:
 static void ulogd_main_loop(void)
 {
 	int ret;
-	struct timeval next_alarm;
-	struct timeval *next = NULL;
 
-	while (1) {
-		if (next != NULL && !timerisset(next))
-			next = ulogd_do_timer_run(&next_alarm);
-		else
-			next = ulogd_get_next_timer_run(&next_alarm);
+	ulogd_select_edge_triggered(edge_ce.u.value);
 
-		ret = ulogd_select_main(next);
+	/* timers are delivered through a timerfd, so block until
+	 * some descriptor becomes ready. */
+	while (1) {
+		ret = ulogd_select_main(NULL);
 		if (ret < 0 && errno != EINTR)
-	                ulogd_log(ULOGD_ERROR, "select says %s\n",
+	                ulogd_log(ULOGD_ERROR, "epoll_wait says %s\n",
 				  strerror(errno));
 	}
 }
@@ -1314,8 +2697,13 @@ static void deliver_signal_pluginstances(int signal)
 
 	llist_for_each_entry(stack, &ulogd_pi_stacks, stack_list) {
 		llist_for_each_entry(pi, &stack->list, list) {
-			if (pi->plugin->signal)
-				(*pi->plugin->signal)(pi, signal);
+			struct ulogd_pluginstance *prev;
+
+			if (!pi->plugin->signal)
+				continue;
+			prev = ulogd_callback_enter(pi);
+			(*pi->plugin->signal)(pi, signal);
+			ulogd_callback_leave(pi, prev);
 		}
 	}
 }
@@ -1329,11 +2717,16 @@ static void stop_pluginstances()
 		llist_for_each_entry_safe(pi, npi, &stack->list, list) {
 			if ((pi->plugin->priv_size > 0 || *pi->plugin->stop) &&
 			    pluginstance_stop(pi)) {
-				ulogd_log(ULOGD_DEBUG, "calling stop for %s\n",
-					  pi->plugin->name);
-				(*pi->plugin->stop)(pi);
+				if (pi->plugin->stop) {
+					ulogd_log(ULOGD_DEBUG,
+						  "calling stop for %s\n",
+						  pi->plugin->name);
+					(*pi->plugin->stop)(pi);
+				}
 				pi->private[0] = 0;
 			}
+			if (pi->async)
+				async_free(pi->async);
 			free(pi);
 		}
 	}
@@ -1355,6 +2748,21 @@ static void stop_stack()
 	struct ulogd_pluginstance_stack *stack, *nstack;
 
 	llist_for_each_entry_safe(stack, nstack, &ulogd_pi_stacks, stack_list) {
+		if (stack->plan) {
+			free(stack->plan->steps);
+			free(stack->plan->keys);
+			free(stack->plan->dirty.keys);
+			free(stack->plan->valid);
+			free(stack->plan);
+		}
+		if (stack->batch) {
+			free(stack->batch->records);
+			free(stack->batch->keys);
+			free(stack->batch->strbuf);
+			free(stack->batch);
+		}
+		if (stack->worker)
+			worker_free(stack->worker);
 		free(stack);
 	}
 }
@@ -1379,6 +2787,8 @@ static void sigterm_handler_task(int signal)
 
 	deliver_signal_pluginstances(signal);
 
+	stop_stack_threads();
+
 	stop_pluginstances();
 
 	stop_stack();
@@ -1415,8 +2825,10 @@ static void signal_handler_task(int signal)
 	case SIGHUP:
 		/* reopen logfile */
 		if (logfile != stdout && logfile != syslog_dummy) {
+			pthread_mutex_lock(&log_lock);
 			fclose(logfile);
 			logfile = fopen(ulogd_logfile, "a");
+			pthread_mutex_unlock(&log_lock);
  			if (!logfile) {
 				fprintf(stderr, 
 					"ERROR: can't open logfile %s: %s\n", 
@@ -1642,6 +3054,11 @@ int main(int argc, char* argv[])
 	signal(SIGUSR2, &signal_handler);
 	set_scheduler();
 
+	if (start_stack_threads() < 0) {
+		ulogd_log(ULOGD_FATAL, "can't start threads\n");
+		warn_and_exit(daemonize);
+	}
+
 	ulogd_log(ULOGD_INFO, 
 		  "initialization finished, entering main loop\n");
 
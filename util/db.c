@@ -337,7 +337,7 @@ static void __format_query_db(struct ulogd_pluginstance *upi, char *start)
 			ulogd_log(ULOGD_NOTICE, "no source for `%s' ?!?\n",
 				  upi->input.keys[i].name);
 
-		if (!res || !IS_VALID(*res)) {
+		if (!res || !ulogd_input_valid(upi, i)) {
 			/* no result, we have to fake something */
 			stmt_ins += sprintf(stmt_ins, "NULL,");
 			continue;